@@ -21,6 +21,14 @@
  * dyadic ranges ({[14-15] as 7 in range 2, [16-31] as 1 in range 16, [32-47] as 2 in range 16, [48-48] as 48 in range 1}).
  * Dyadic ranges are similarly useful for histogramming, order stats, etc.
  *
+ * The width and depth of the arrays can be chosen from an error target
+ * (see cmsketch_dims).  A dyadic range holding few distinct values does not need
+ * counters at all: each range starts out as a sorted list of exact (value, count)
+ * pairs, and is only converted to CountMin arrays once the list outgrows a
+ * quarter of their size.  The high ranges of most columns never get that far.
+ * (With the default dimensions, 64 ranges of 8 x 1024 64-bit counters, a fully
+ * dense sketch takes 4MB.)
+ *
  * The results of the estimators below generally have guarantees of the form
  * "the answer is within \epsilon of the true answer with probability 1-\delta."
  */
@@ -38,6 +46,11 @@
 #include "countmin.h"
 
 #include <ctype.h>
+#include <math.h>
+
+#ifndef M_E
+#define M_E 2.7182818284590452354
+#endif
 
 PG_FUNCTION_INFO_V1(__cmsketch_int8_trans);
 
@@ -48,7 +61,6 @@ PG_FUNCTION_INFO_V1(__cmsketch_int8_trans);
 Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = NULL;
-    cmtransval *transval;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -67,15 +79,88 @@ Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
     /* get the provided element, being careful in case it's NULL */
     if (!PG_ARGISNULL(1)) {
         transblob = cmsketch_check_transval(fcinfo, true);
-        transval = (cmtransval *)(VARDATA(transblob));
 
-        /* the following line modifies the contents of transval, and hence transblob */
-        countmin_dyadic_trans_c(transval, PG_GETARG_DATUM(1));
+        /*
+         * the following line modifies the contents of transblob, and may
+         * move it to make room in a level
+         */
+        transblob = countmin_dyadic_trans_c(transblob, PG_GETARG_DATUM(1));
         PG_RETURN_DATUM(PointerGetDatum(transblob));
     }
     else PG_RETURN_DATUM(PointerGetDatum(PG_GETARG_BYTEA_P(0)));
 }
 
+PG_FUNCTION_INFO_V1(__cmsketch_int8_sized_trans);
+
+/*!
+ * transition function for cmsketch(col, epsilon, delta [, counter_bits]).
+ * Like __cmsketch_int8_trans, but the first call sizes the sketch from an
+ * error target: see cmsketch_dims.
+ */
+Datum __cmsketch_int8_sized_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        int32  counter_bits = (PG_NARGS() > 4) ? PG_GETARG_INT32(4) : 64;
+        uint32 width, depth;
+
+        cmsketch_dims(PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), &width, &depth);
+        if (counter_bits != 32 && counter_bits != 64)
+            elog(ERROR, "cmsketch counters must be 32 or 64 bits, got %d",
+                 counter_bits);
+        transblob = cmsketch_init_transval(get_fn_expr_argtype(fcinfo->flinfo, 1),
+                                           width, depth, counter_bits/CHAR_BIT);
+        ((cmtransval *)VARDATA(transblob))->nargs = 0;
+    }
+
+    transblob = countmin_dyadic_trans_c(transblob, PG_GETARG_DATUM(1));
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+/*!
+ * choose the dimensions of a CountMin sketch so that a count is
+ * overestimated by at most epsilon times the total count, with probability
+ * at least 1 - delta: width e/epsilon (rounded up to a power of 2) and
+ * depth ln(1/delta).  See Cormode and Muthukrishnan.
+ * \param epsilon the error bound, relative to the total count
+ * \param delta the probability of exceeding the bound
+ * \param width out-value: counters per row
+ * \param depth out-value: rows per level
+ */
+void cmsketch_dims(float8 epsilon, float8 delta, uint32 *width, uint32 *depth)
+{
+    float8 w, d;
+
+    if (!(epsilon > 0 && epsilon < 1))
+        elog(ERROR, "cmsketch epsilon must be between 0 and 1, got %g", epsilon);
+    if (!(delta > 0 && delta < 1))
+        elog(ERROR, "cmsketch delta must be between 0 and 1, got %g", delta);
+
+    w = ceil(M_E / epsilon);
+    d = ceil(log(1.0 / delta));
+    if (w > CM_MAX_WIDTH)
+        elog(ERROR,
+             "cmsketch epsilon %g needs more than %d counters per row",
+             epsilon, CM_MAX_WIDTH);
+    if (d > CM_MAX_DEPTH)
+        elog(ERROR, "cmsketch delta %g needs more than %d rows",
+             delta, CM_MAX_DEPTH);
+
+    for (*width = 1; *width < w; *width <<= 1)
+        ;
+    *depth = (d < 1) ? 1 : (uint32)d;
+}
+
 /*!
  * check if the transblob is not initialized, and do so if not
  * \param transblob a cmsketch transval packed in a bytea
@@ -92,7 +177,8 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
      */
     if (!CM_TRANSVAL_INITIALIZED(transblob)) {
         /* XXX would be nice to pfree the existing transblob, but pfree complains. */
-        transblob = cmsketch_init_transval(element_type);
+        transblob = cmsketch_init_transval(element_type, CM_DEFAULT_WIDTH,
+                                           CM_DEFAULT_DEPTH, sizeof(uint64));
         transval = (cmtransval *)VARDATA(transblob);
 
         if (initargs) {
@@ -118,65 +204,423 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
     return(transblob);
 }
 
-bytea *cmsketch_init_transval(Oid typOid)
+/*!
+ * bytes needed by a sketch with the dimensions of dims, where level j has
+ * room for caps[j] pairs, or is dense if caps[j] is CM_LEVEL_DENSE
+ */
+static uint32 cm_layout_size(const cmsketch *dims, const uint32 *caps)
+{
+    uint32 j, sz = CM_DATA_START;
+
+    for (j = 0; j < RANGES; j++)
+        sz += (caps[j] == CM_LEVEL_DENSE) ? CM_DENSE_SZ(dims)
+                                          : caps[j]*sizeof(cmpair);
+    return sz;
+}
+
+/*!
+ * set up an empty sketch in zeroed memory at s, with the dimensions of dims
+ * and the level capacities caps (as in cm_layout_size)
+ */
+static void cm_layout(cmsketch *s, const cmsketch *dims, const uint32 *caps)
+{
+    uint32 j, off = CM_DATA_START;
+
+    s->depth = dims->depth;
+    s->width = dims->width;
+    s->counterBytes = dims->counterBytes;
+    s->sparseMax = dims->sparseMax;
+    for (j = 0; j < RANGES; j++) {
+        s->levels[j].offset = off;
+        if (caps[j] == CM_LEVEL_DENSE) {
+            s->levels[j].nentries = CM_LEVEL_DENSE;
+            s->levels[j].capacity = 0;
+            off += CM_DENSE_SZ(s);
+        }
+        else {
+            s->levels[j].nentries = 0;
+            s->levels[j].capacity = caps[j];
+            off += caps[j]*sizeof(cmpair);
+        }
+    }
+    s->size = off;
+}
+
+bytea *cmsketch_init_transval(Oid typOid, uint32 width, uint32 depth,
+                              uint32 counterBytes)
 {
     bool        typIsVarlena;
     cmtransval *transval;
+    cmsketch    dims;
+    uint32      caps[RANGES];
+    uint32      j, sz;
+    bytea *     transblob;
+
+    dims.width = width;
+    dims.depth = depth;
+    dims.counterBytes = counterBytes;
+    /* a sparse level may take up to a quarter of the space of a dense one */
+    dims.sparseMax = Max(1, depth*width*counterBytes / (4*sizeof(cmpair)));
+    for (j = 0; j < RANGES; j++)
+        caps[j] = Min(CM_SPARSE_INITIAL, dims.sparseMax);
+    sz = cm_layout_size(&dims, caps);
 
     /* allocate and zero out a transval via palloc0 */
-    bytea *     transblob = (bytea *)palloc0(CM_TRANSVAL_SZ);
-    SET_VARSIZE(transblob, CM_TRANSVAL_SZ);
+    transblob = (bytea *)palloc0(CM_TRANSVAL_SZ(sz));
+    SET_VARSIZE(transblob, CM_TRANSVAL_SZ(sz));
 
     transval = (cmtransval *)VARDATA(transblob);
     transval->typOid = typOid;
+    transval->hashKind = SKETCH_HASH_CM_DYADIC;
     getTypeOutputInfo(transval->typOid,
                       &(transval->outFuncOid),
                       &typIsVarlena);
+    cm_layout(&transval->sketch, &dims, caps);
     return(transblob);
 }
 
 /*!
- * perform multiple sketch insertions, one for each dyadic range (from 0 up to RANGES-1).
- * * \param transval the cmsketch transval
- * * \param inputi the value to be inserted
+ * counter positions for val in the rows of a dense level: successive
+ * 16-bit runs of its hash, masked to the (power of 2) width
+ */
+static void cm_dense_cols(const cmsketch *s, uint32 level, int64 val,
+                          uint32 *cols)
+{
+    uint8  hash[SKETCH_HASHLEN];
+    uint16 twobytes;
+    uint32 i;
+
+    cmsketch_dyadic_hash(val, level, hash);
+    for (i = 0; i < s->depth; i++) {
+        memcpy(&twobytes, hash + 2*i, sizeof(uint16));
+        cols[i] = twobytes & (s->width - 1);
+    }
+}
+
+/*! add cnt to the counters of val in a dense level */
+static void cm_dense_add(cmsketch *s, uint32 level, int64 val, uint64 cnt)
+{
+    uint32 cols[CM_MAX_DEPTH];
+    char * counters = CM_LEVEL_DATA(s, level);
+    uint32 i;
+
+    cm_dense_cols(s, level, val, cols);
+    for (i = 0; i < s->depth; i++) {
+        uint32 k = i*s->width + cols[i];
+
+        if (s->counterBytes == sizeof(uint32)) {
+            uint32 *c = (uint32 *)counters + k;
+
+            if ((uint64)*c + cnt > UINT64CONST(0xFFFFFFFF))
+                elog(ERROR, "maximum count exceeded in 32-bit sketch counters");
+            *c += cnt;
+        }
+        else {
+            uint64 *c = (uint64 *)counters + k;
+
+            if (*c > (uint64)INT64_MAX - cnt)
+                elog(ERROR, "maximum count exceeded in sketch");
+            *c += cnt;
+        }
+    }
+}
+
+/*! the CountMin estimate for val in a dense level: its smallest counter */
+static uint64 cm_dense_count(const cmsketch *s, uint32 level, int64 val)
+{
+    uint32      cols[CM_MAX_DEPTH];
+    const char *counters = CM_LEVEL_DATA(s, level);
+    uint64      min = UINT64CONST(0xFFFFFFFFFFFFFFFF);
+    uint64      c;
+    uint32      i;
+
+    cm_dense_cols(s, level, val, cols);
+    for (i = 0; i < s->depth; i++) {
+        uint32 k = i*s->width + cols[i];
+
+        if (s->counterBytes == sizeof(uint32))
+            c = ((const uint32 *)counters)[k];
+        else
+            c = ((const uint64 *)counters)[k];
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
+
+/*! index of the first pair in a sparse level with a value >= val */
+static uint32 cm_sparse_find(const cmpair *pairs, uint32 n, int64 val)
+{
+    uint32 lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo)/2;
+
+        if (pairs[mid].val < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*!
+ * add cnt to the pair for val in a sparse level, keeping the pairs sorted.
+ * Returns false, changing nothing, if val is new and the level is full.
+ */
+static bool cm_sparse_insert(cmsketch *s, uint32 level, int64 val, uint64 cnt)
+{
+    cmlevel *l = &s->levels[level];
+    cmpair * pairs = (cmpair *)CM_LEVEL_DATA(s, level);
+    uint32   i = cm_sparse_find(pairs, l->nentries, val);
+
+    if (i < l->nentries && pairs[i].val == val) {
+        pairs[i].cnt += cnt;
+        return true;
+    }
+    if (l->nentries == l->capacity)
+        return false;
+    memmove(&pairs[i+1], &pairs[i], (l->nentries - i)*sizeof(cmpair));
+    pairs[i].val = val;
+    pairs[i].cnt = cnt;
+    l->nentries++;
+    return true;
+}
+
+/*!
+ * the number of times val was inserted at a dyadic level: exact for a
+ * sparse level, a CountMin estimate for a dense one
+ * \param s the sketch
+ * \param level the dyadic level
+ * \param val the value, already shifted for the level
+ */
+uint64 cmsketch_level_count(const cmsketch *s, uint32 level, int64 val)
+{
+    const cmpair *pairs;
+    uint32        i, n;
+
+    if (CM_LEVEL_IS_DENSE(s, level))
+        return cm_dense_count(s, level, val);
+
+    pairs = (const cmpair *)CM_LEVEL_DATA(s, level);
+    n = s->levels[level].nentries;
+    i = cm_sparse_find(pairs, n, val);
+    return (i < n && pairs[i].val == val) ? pairs[i].cnt : 0;
+}
+
+/*! number of distinct values in the union of two sparse levels */
+static uint32 cm_sparse_union_size(const cmsketch *s1, const cmsketch *s2,
+                                   uint32 level)
+{
+    const cmpair *a = (const cmpair *)CM_LEVEL_DATA(s1, level);
+    const cmpair *b = (const cmpair *)CM_LEVEL_DATA(s2, level);
+    uint32        na = s1->levels[level].nentries;
+    uint32        nb = s2->levels[level].nentries;
+    uint32        i = 0, k = 0, n = 0;
+
+    while (i < na || k < nb) {
+        if (k == nb || (i < na && a[i].val < b[k].val))
+            i++;
+        else if (i == na || b[k].val < a[i].val)
+            k++;
+        else {
+            i++;
+            k++;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*!
+ * add the counts in a level of src into the same level of dst, which has
+ * the same dimensions.  A dense dst takes anything; a sparse dst must be
+ * adding a sparse level and have room for the union of their values.
  */
-void countmin_dyadic_trans_c(cmtransval *transval, Datum input)
+static void cm_add_level(cmsketch *dst, const cmsketch *src, uint32 level)
+{
+    cmlevel *     dl = &dst->levels[level];
+    const cmpair *b = (const cmpair *)CM_LEVEL_DATA(src, level);
+    uint32        nb = src->levels[level].nentries;
+    uint32        i, k, n;
+
+    if (CM_LEVEL_IS_DENSE(dst, level) && CM_LEVEL_IS_DENSE(src, level)) {
+        n = src->depth*src->width;
+        if (src->counterBytes == sizeof(uint32)) {
+            uint32       *c = (uint32 *)CM_LEVEL_DATA(dst, level);
+            const uint32 *d = (const uint32 *)CM_LEVEL_DATA(src, level);
+
+            for (k = 0; k < n; k++) {
+                if ((uint64)c[k] + d[k] > UINT64CONST(0xFFFFFFFF))
+                    elog(ERROR, "maximum count exceeded in 32-bit sketch counters");
+                c[k] += d[k];
+            }
+        }
+        else {
+            uint64       *c = (uint64 *)CM_LEVEL_DATA(dst, level);
+            const uint64 *d = (const uint64 *)CM_LEVEL_DATA(src, level);
+
+            for (k = 0; k < n; k++)
+                c[k] += d[k];
+        }
+    }
+    else if (CM_LEVEL_IS_DENSE(dst, level)) {
+        for (k = 0; k < nb; k++)
+            cm_dense_add(dst, level, b[k].val, b[k].cnt);
+    }
+    else if (CM_LEVEL_IS_DENSE(src, level))
+        elog(ERROR, "countmin error: cannot add a dense level into a sparse one");
+    else if (nb > 0) {
+        /* merge the two sorted runs of pairs through a scratch array */
+        cmpair *a = (cmpair *)CM_LEVEL_DATA(dst, level);
+        uint32  na = dl->nentries;
+        cmpair *merged = (cmpair *)palloc((na + nb)*sizeof(cmpair));
+
+        for (i = k = n = 0; i < na || k < nb; n++) {
+            if (k == nb || (i < na && a[i].val < b[k].val))
+                merged[n] = a[i++];
+            else if (i == na || b[k].val < a[i].val)
+                merged[n] = b[k++];
+            else {
+                merged[n] = a[i++];
+                merged[n].cnt += b[k++].cnt;
+            }
+        }
+        if (n > dl->capacity)
+            elog(ERROR, "countmin error: sparse level overflow");
+        memcpy(a, merged, n*sizeof(cmpair));
+        dl->nentries = n;
+        pfree(merged);
+    }
+}
+
+/*!
+ * copy the sketch src into zeroed memory at dst, laid out with the level
+ * capacities caps (as in cm_layout_size).  Sparse levels can become dense.
+ */
+static void cm_relayout(cmsketch *dst, const cmsketch *src, const uint32 *caps)
 {
     uint32 j;
+
+    cm_layout(dst, src, caps);
+    for (j = 0; j < RANGES; j++) {
+        if (CM_LEVEL_IS_DENSE(dst, j) && CM_LEVEL_IS_DENSE(src, j))
+            memcpy(CM_LEVEL_DATA(dst, j), CM_LEVEL_DATA(src, j),
+                   CM_DENSE_SZ(src));
+        else
+            cm_add_level(dst, src, j);
+    }
+}
+
+/*!
+ * move a transval into a bigger one with room for a new value in a full
+ * sparse level.  That level doubles its capacity, or goes dense once it
+ * would pass sparseMax.  Other sparse levels that are more than half full
+ * grow too, so that levels filling at the same rate share one copy.
+ * \param transblob a cmsketch transval packed in a bytea
+ * \param level the full level
+ * \returns the new transval
+ */
+static bytea *cm_grow(bytea *transblob, uint32 level)
+{
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    cmsketch *  s = &transval->sketch;
+    uint32      caps[RANGES];
+    uint32      j, sz;
+    bytea *     newblob;
+    cmtransval *newval;
+
+    for (j = 0; j < RANGES; j++) {
+        cmlevel *l = &s->levels[j];
+
+        if (CM_LEVEL_IS_DENSE(s, j))
+            caps[j] = CM_LEVEL_DENSE;
+        else if (j != level && 2*l->nentries <= l->capacity)
+            caps[j] = l->capacity;
+        else if (l->capacity >= s->sparseMax)
+            caps[j] = CM_LEVEL_DENSE;
+        else
+            caps[j] = Min(2*l->capacity, s->sparseMax);
+    }
+    sz = cm_layout_size(s, caps);
+
+    /* we can't repalloc because it fails trying to free the old transblob */
+    newblob = (bytea *)palloc0(CM_TRANSVAL_SZ(sz));
+    SET_VARSIZE(newblob, CM_TRANSVAL_SZ(sz));
+    newval = (cmtransval *)VARDATA(newblob);
+    memcpy(newval, transval, offsetof(cmtransval, sketch));
+    cm_relayout(&newval->sketch, s, caps);
+    return(newblob);
+}
+
+/*!
+ * perform multiple sketch insertions, one for each dyadic range (from 0 up to RANGES-1).
+ * \param transblob the cmsketch transval packed in a bytea
+ * \param input the value to be inserted
+ * \returns the transval, which moves if a level had to grow
+ */
+bytea *countmin_dyadic_trans_c(bytea *transblob, Datum input)
+{
+    cmtransval *transval = (cmtransval *)VARDATA(transblob);
+    int64       val = DatumGetInt64(input);
+    uint32      j;
     
     if (transval->typOid != INT8OID)
         elog(ERROR, "cmsketch can only compute ranges for int64");
 
     for (j = 0; j < RANGES; j++) {
-        countmin_trans_c(transval->sketches[j], input, 
-                         transval->outFuncOid, transval->typOid);
-        /* now divide by 2 for the next dyadic range */
-        input = Int64GetDatum(DatumGetInt64(input) >> 1);
+        /* level j counts val/(2^j) */
+        int64 v = val >> j;
+
+        if (CM_LEVEL_IS_DENSE(&transval->sketch, j))
+            cm_dense_add(&transval->sketch, j, v, 1);
+        else if (!cm_sparse_insert(&transval->sketch, j, v, 1)) {
+            transblob = cm_grow(transblob, j);
+            transval = (cmtransval *)VARDATA(transblob);
+            if (CM_LEVEL_IS_DENSE(&transval->sketch, j))
+                cm_dense_add(&transval->sketch, j, v, 1);
+            else
+                (void)cm_sparse_insert(&transval->sketch, j, v, 1);
+        }
     }
+    return(transblob);
+}
+
+/*!
+ * The SKETCH_HASH_CM_DYADIC hash of an int8 at a dyadic level.
+ * Level j of a sketch counts x >> j, so its counter positions can only
+ * depend on that shifted value; what we can avoid is the cost of a general
+ * byte hash.  One 64-bit mix of the value, salted by its level, gives the
+ * first 8 bytes, and a second mix of that gives the next 8.  Both mixes are
+ * bijections, so distinct values at a level never share their first word.
+ * \param val the (already shifted) value
+ * \param level the dyadic level, 0 to RANGES-1
+ * \param out SKETCH_HASHLEN bytes to hold the result
+ */
+void cmsketch_dyadic_hash(int64 val, uint32 level, uint8 *out)
+{
+    uint64 h1 = sketch_fmix64((uint64)val ^ (CM_LEVEL_SALT * (level + 1)));
+    uint64 h2 = sketch_fmix64(h1 ^ CM_REMIX_SALT);
+
+    memcpy(out, &h1, sizeof(uint64));
+    memcpy(out + sizeof(uint64), &h2, sizeof(uint64));
 }
 
 /*!
  * Main loop of Cormode and Muthukrishnan's sketching algorithm, for setting counters in
- * sketches at a single "dyadic range". For each call, we want to use DEPTH independent
- * hash functions.  We do this by using a single md5 hash function, and taking
+ * a fixed-size countmin sketch (as used by MFV sketches). For each call, we want to use DEPTH independent
+ * hash functions.  We do this by using a single 128-bit hash function, and taking
  * successive 16-bit runs of the result as independent hash outputs.
  * \param sketch the current countmin sketch
- * \param dat the datum to be inserted
- * \param outFuncOid Oid of the PostgreSQL function to convert dat to a string
- * \param typOid Oid of the Postgres type for dat
+ * \param hash the SKETCH_HASHLEN-byte hash of the datum to be inserted
  */
-Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
+void countmin_trans_c(countmin sketch, const uint8 *hash)
 {
-    bytea *nhash;
-
-    nhash = sketch_md5_bytea(dat, typOid);
-
     /*
      * iterate through all sketches, incrementing the counters indicated by the hash
      * we don't care about return value here, so 3rd (initialization) argument is arbitrary.
      */
-    (void)hash_counters_iterate(nhash, sketch, 0, &increment_counter);
-    return(PointerGetDatum(nhash));
+    (void)hash_counters_iterate(hash, sketch, 0, &increment_counter);
 }
 
 /*
@@ -184,20 +628,101 @@ Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
  */
 
 /*!
- * return the array of sketch counters as a bytea
+ * return the sketch as a bytea, behind a cmsketch_header recording how its
+ * counters were hashed.  Sparse levels are trimmed to the pairs in use.
  */
 PG_FUNCTION_INFO_V1(__cmsketch_final);
 Datum __cmsketch_final(PG_FUNCTION_ARGS)
 {
-    bytea *     blob = PG_GETARG_BYTEA_P(0);
-    cmtransval *sketch = (cmtransval *)VARDATA(blob);
-    int         len = RANGES*sizeof(countmin) + VARHDRSZ;
-    bytea *out = palloc0(len);    
-    
-    memcpy((uint8 *)VARDATA(out), sketch->sketches, len - VARHDRSZ);
+    PG_RETURN_BYTEA_P(cmsketch_finish_c(PG_GETARG_BYTEA_P(0)));
+}
+
+/*!
+ * the finished sketch of a cmsketch transval, as returned by the cmsketch
+ * aggregate
+ * \param blob a cmsketch transval packed in a bytea, possibly empty
+ */
+bytea *cmsketch_finish_c(bytea *blob)
+{
+    cmtransval *transval;
+    cmsketch *  s;
+    uint32      caps[RANGES];
+    uint32      j, len;
+    bytea *     out;
+    cmsketch_header *header;
+
+    /* an empty input gets an empty sketch */
+    if (!CM_TRANSVAL_INITIALIZED(blob))
+        blob = cmsketch_init_transval(INT8OID, CM_DEFAULT_WIDTH,
+                                      CM_DEFAULT_DEPTH, sizeof(uint64));
+    transval = (cmtransval *)VARDATA(blob);
+    s = &transval->sketch;
+
+    for (j = 0; j < RANGES; j++)
+        caps[j] = s->levels[j].nentries;
+    len = VARHDRSZ + sizeof(cmsketch_header) + cm_layout_size(s, caps);
+    out = palloc0(len);
+    header = (cmsketch_header *)VARDATA(out);
+    header->magic = CM_SKETCH_MAGIC;
+    header->version = CM_SKETCH_VERSION;
+    header->hashKind = transval->hashKind;
+    cm_relayout((cmsketch *)((char *)header + sizeof(cmsketch_header)), s,
+                caps);
     SET_VARSIZE(out, len);
     
-    PG_RETURN_BYTEA_P(out);
+    return(out);
+}
+
+/*!
+ * turn a finished sketch back into a transval, so that it can be merged.
+ * Only sketches with a version 2 cmsketch_header can be; older ones are
+ * plain counters that have to be rebuilt from the data.
+ * \param blob a finished sketch, as returned by the cmsketch aggregate
+ */
+bytea *cmsketch_from_stored(bytea *blob)
+{
+    cmsketch_header *header = (cmsketch_header *)VARDATA(blob);
+    cmsketch *       s = (cmsketch *)((char *)header + sizeof(cmsketch_header));
+    uint32           size = VARSIZE(blob) - VARHDRSZ - sizeof(cmsketch_header);
+    uint32           j, end;
+    bool             typIsVarlena;
+    bytea *          transblob;
+    cmtransval *     transval;
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(cmsketch_header) + CM_DATA_START
+        || header->magic != CM_SKETCH_MAGIC)
+        elog(ERROR, "invalid CountMin sketch: sketches from before version %d "
+             "have to be recomputed to be merged", CM_SKETCH_VERSION);
+    if (header->version != CM_SKETCH_VERSION)
+        elog(ERROR, "unsupported CountMin sketch version %d", header->version);
+    if (s->size != size || s->depth == 0 || s->depth > CM_MAX_DEPTH
+        || s->width == 0 || s->width > CM_MAX_WIDTH
+        || (s->width & (s->width - 1)) != 0
+        || (s->counterBytes != sizeof(uint32)
+            && s->counterBytes != sizeof(uint64)))
+        elog(ERROR, "invalid CountMin sketch");
+    for (j = 0; j < RANGES; j++) {
+        if (CM_LEVEL_IS_DENSE(s, j))
+            end = s->levels[j].offset + CM_DENSE_SZ(s);
+        else if (s->levels[j].nentries > s->levels[j].capacity)
+            end = size + 1;
+        else
+            end = s->levels[j].offset + s->levels[j].capacity*sizeof(cmpair);
+        if (s->levels[j].offset < CM_DATA_START || end > size)
+            elog(ERROR, "invalid CountMin sketch");
+    }
+
+    transblob = (bytea *)palloc0(CM_TRANSVAL_SZ(size));
+    SET_VARSIZE(transblob, CM_TRANSVAL_SZ(size));
+    transval = (cmtransval *)VARDATA(transblob);
+    transval->nargs = -1;
+    transval->typOid = INT8OID;
+    getTypeOutputInfo(transval->typOid,
+                      &(transval->outFuncOid),
+                      &typIsVarlena);
+    transval->hashKind = header->hashKind;
+    memcpy(&transval->sketch, s, size);
+    return(transblob);
 }
 
 /*!
@@ -206,44 +731,62 @@ Datum __cmsketch_final(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(__cmsketch_merge);
 Datum __cmsketch_merge(PG_FUNCTION_ARGS)
 {
-    bytea *     counterblob1 = PG_GETARG_BYTEA_P(0);
-    bytea *     counterblob2 = PG_GETARG_BYTEA_P(1);
+    PG_RETURN_DATUM(PointerGetDatum(
+                        cmsketch_merge_c(PG_GETARG_BYTEA_P(0),
+                                         PG_GETARG_BYTEA_P(1))));
+}
+
+/*!
+ * merge two cmsketch transvals into a new one
+ * \param counterblob1 a cmsketch transval packed in a bytea, possibly empty
+ * \param counterblob2 another one, with the same dimensions
+ */
+bytea *cmsketch_merge_c(bytea *counterblob1, bytea *counterblob2)
+{
     cmtransval *transval1 = (cmtransval *)VARDATA(counterblob1);
     cmtransval *transval2 = (cmtransval *)VARDATA(counterblob2);
+    cmsketch *  s1, *s2;
     cmtransval *newtrans;
-    countmin *  sketches2 = (countmin *)
-                            ((cmtransval *)(VARDATA(counterblob2)))->sketches;
     bytea *     newblob;
-    countmin *  newsketches;
-    uint32      i, j, k;
-    int         sz;
-
-    /* make sure they're initialized! */
-    if (!CM_TRANSVAL_INITIALIZED(counterblob1)
-        && !CM_TRANSVAL_INITIALIZED(counterblob2))
-        /* if both are empty can return one of them */
-        PG_RETURN_DATUM(PointerGetDatum(counterblob1));
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob1)) {
-        counterblob1 = cmsketch_init_transval(transval2->typOid);
-        transval1 = (cmtransval *)VARDATA(counterblob1);
-    }
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob2)) {
-        counterblob2 = cmsketch_init_transval(transval1->typOid);
-        transval2 = (cmtransval *)VARDATA(counterblob2);
+    uint32      caps[RANGES];
+    uint32      i, sz;
+
+    /* if either is empty, the other is the answer */
+    if (!CM_TRANSVAL_INITIALIZED(counterblob1))
+        return(counterblob2);
+    else if (!CM_TRANSVAL_INITIALIZED(counterblob2))
+        return(counterblob1);
+
+    s1 = &transval1->sketch;
+    s2 = &transval2->sketch;
+    if (s1->width != s2->width || s1->depth != s2->depth
+        || s1->counterBytes != s2->counterBytes)
+        elog(ERROR,
+             "cannot merge CountMin sketches with different dimensions");
+    if (transval1->hashKind != transval2->hashKind)
+        elog(ERROR,
+             "cannot merge CountMin sketches built with different hash functions");
+
+    /* a level stays sparse if the union of its values fits */
+    for (i = 0; i < RANGES; i++) {
+        if (CM_LEVEL_IS_DENSE(s1, i) || CM_LEVEL_IS_DENSE(s2, i))
+            caps[i] = CM_LEVEL_DENSE;
+        else {
+            sz = cm_sparse_union_size(s1, s2, i);
+            caps[i] = (sz > s1->sparseMax) ? CM_LEVEL_DENSE
+                      : Max(sz, Min(CM_SPARSE_INITIAL, s1->sparseMax));
+        }
     }
+    sz = cm_layout_size(s1, caps);
 
-    sz = VARSIZE(counterblob1);
-    /* allocate a new transval as a copy of counterblob1 */
-    newblob = (bytea *)palloc(sz);
-    memcpy(newblob, counterblob1, sz);
+    /* allocate a new transval holding counterblob1, and add in counterblob2 */
+    newblob = (bytea *)palloc0(CM_TRANSVAL_SZ(sz));
+    SET_VARSIZE(newblob, CM_TRANSVAL_SZ(sz));
     newtrans = (cmtransval *)(VARDATA(newblob));
-    newsketches = (countmin *)(newtrans)->sketches;
-
-    /* add in values from counterblob2 */
+    memcpy(newtrans, transval1, offsetof(cmtransval, sketch));
+    cm_relayout(&newtrans->sketch, s1, caps);
     for (i = 0; i < RANGES; i++)
-        for (j = 0; j < DEPTH; j++)
-            for (k = 0; k < NUMCOUNTERS; k++)
-                newsketches[i][j][k] += sketches2[i][j][k];
+        cm_add_level(&newtrans->sketch, s2, i);
 
     if (newtrans->nargs == -1) {
         /* transfer in the args from the other input */
@@ -252,9 +795,33 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
             newtrans->args[i] = transval2->args[i];
     }
 
-    PG_RETURN_DATUM(PointerGetDatum(newblob));
+    return(newblob);
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_union_trans);
+
+/*!
+ * UDA transition function for cmsketch_union_agg: fold a finished sketch
+ * into the union so far
+ */
+Datum __cmsketch_union_trans(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BYTEA_P(cmsketch_merge_c(PG_GETARG_BYTEA_P(0),
+                                       cmsketch_from_stored(
+                                           PG_GETARG_BYTEA_P(1))));
 }
 
+PG_FUNCTION_INFO_V1(__cmsketch_union);
+
+/*! the union of two finished sketches with the same dimensions */
+Datum __cmsketch_union(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = cmsketch_from_stored(PG_GETARG_BYTEA_P(0));
+    bytea *transblob2 = cmsketch_from_stored(PG_GETARG_BYTEA_P(1));
+
+    PG_RETURN_BYTEA_P(cmsketch_finish_c(cmsketch_merge_c(transblob1,
+                                                         transblob2)));
+}
 
 
 /*
@@ -265,21 +832,28 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
  * get the approximate count of objects with value arg
  * \param sketch a countmin sketch
  * \param arg the Datum we want to find the count of
- * \param funcOid the Postgres function that converts arg to a string
+ * \param typLen the typlen of arg's type
+ * \param typByVal whether arg's type is passed by value
+ * \param hashKind the sketch_hash_kind the sketch was built with
  */
-int64 cmsketch_count_c(countmin sketch, Datum arg, Oid funcOid, Oid typOid)
+int64 cmsketch_count_c(countmin sketch, Datum arg, int16 typLen, bool typByVal,
+                       int hashKind)
 {
-    bytea *nhash;
+    uint8 hash[SKETCH_HASHLEN];
 
-    /* get the md5 hash of the argument. */
-    nhash = sketch_md5_bytea(arg, typOid);
-    return(cmsketch_count_md5_datum(sketch, nhash, funcOid));
+    sketch_hash_datum(arg, typLen, typByVal, hashKind, hash);
+    return(cmsketch_count_hash(sketch, hash));
 }
 
-int64 cmsketch_count_md5_datum(countmin sketch, bytea *md5_bytea, Oid funcOid)
+/*!
+ * get the approximate count of the objects whose hash is given
+ * \param sketch a countmin sketch
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
+ */
+int64 cmsketch_count_hash(countmin sketch, const uint8 *hash)
 {
     /* iterate through the sketches, finding the min counter associated with this hash */
-    return(hash_counters_iterate(md5_bytea, sketch, INT64_MAX,
+    return(hash_counters_iterate(hash, sketch, INT64_MAX,
                                           &min_counter));
 }
 
@@ -293,19 +867,23 @@ PG_FUNCTION_INFO_V1(cmsketch_dump);
 Datum cmsketch_dump(PG_FUNCTION_ARGS)
 {
     bytea *   transblob = (bytea *)PG_GETARG_BYTEA_P(0);
-    countmin *sketches;
+    cmsketch *s;
     char *    newblob = (char *)palloc(10240);
-    uint32    i, j, k, c;
-
-    sketches = ((cmtransval *)VARDATA(transblob))->sketches;
-    for (i=0, c=0; i < RANGES; i++)
-        for (j=0; j < DEPTH; j++)
-            for(k=0; k < NUMCOUNTERS; k++) {
-                if (sketches[i][j][k] != 0)
-                    c += sprintf(&newblob[c], "[(%d,%d,%d):" INT64_FORMAT
-                                 "], ", i, j, k, sketches[i][j][k]);
-                if (c > 10000) break;
-            }
+    uint32    i, k, c;
+
+    s = &((cmtransval *)VARDATA(transblob))->sketch;
+    for (i=0, c=0; i < RANGES && c <= 10000; i++) {
+        if (CM_LEVEL_IS_DENSE(s, i)) {
+            c += sprintf(&newblob[c], "[%d: dense], ", i);
+            continue;
+        }
+        for (k=0; k < s->levels[i].nentries && c <= 10000; k++) {
+            cmpair *p = (cmpair *)CM_LEVEL_DATA(s, i) + k;
+
+            c += sprintf(&newblob[c], "[(%d," INT64_FORMAT "):" INT64_FORMAT
+                         "], ", i, p->val, (int64)p->cnt);
+        }
+    }
     newblob[c] = '\0';
     PG_RETURN_NULL();
 }
@@ -314,12 +892,12 @@ Datum cmsketch_dump(PG_FUNCTION_ARGS)
 /*!
  * for each row of the sketch, use the 16 bits starting at 2^i mod NUMCOUNTERS,
  * and invoke the lambda on those 16 bits (which may destructively modify counters).
- * \param hashval the MD5 hashed value that we take 16 bits at a time
+ * \param hashval the hashed value that we take 16 bits at a time
  * \param sketch the cmsketch
  * \param initial the initialized return value
  * \param lambdaptr the function to invoke on each 16 bits
  */
-int64 hash_counters_iterate(bytea *hashval,
+int64 hash_counters_iterate(const uint8 *hashval,
                             countmin sketch, /* width is DEPTH*NUMCOUNTERS */
                             int64 initial,
                             int64 (*lambdaptr)(uint32,
@@ -328,7 +906,7 @@ int64 hash_counters_iterate(bytea *hashval,
                                                int64))
 {
     uint32         i, col;
-    char          *c;
+    const uint8   *c;
     unsigned short twobytes;
     int64          retval = initial;
 
@@ -338,7 +916,7 @@ int64 hash_counters_iterate(bytea *hashval,
      * XXX but I was hoping memmove would deal with unaligned access in a portable way.
      * XXX However the deref of 2 bytes seems to work OK.
      */
-    for (i = 0, c = (char *)VARDATA(hashval); 
+    for (i = 0, c = hashval; 
          i < DEPTH; 
          i++, c += 2) {
         twobytes = *(unsigned short *)c;
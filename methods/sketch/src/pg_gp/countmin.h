@@ -37,11 +37,69 @@ typedef uint64 countmin[DEPTH][NUMCOUNTERS];
 
 #define MAXARGS 3
 
+/*! cmsketch dimensions used when no error target is given */
+#define CM_DEFAULT_WIDTH NUMCOUNTERS
+#define CM_DEFAULT_DEPTH DEPTH
+/*! each row picks its counter with 16 bits of a SKETCH_HASHLEN-byte hash */
+#define CM_MAX_WIDTH 65536
+#define CM_MAX_DEPTH (SKETCH_HASHLEN/2)
+/*! room for (value, count) pairs in a fresh sparse level */
+#define CM_SPARSE_INITIAL 4
+/*! nentries of a level that holds counters rather than pairs */
+#define CM_LEVEL_DENSE 0xFFFFFFFF
+
+/*!
+ * \internal
+ * \brief an exact count in a sparse level
+ * \endinternal
+ */
+typedef struct {
+    int64  val;  /*! the (shifted) value */
+    uint64 cnt;  /*! how many times it was inserted */
+} cmpair;
+
+/*!
+ * \internal
+ * \brief directory entry for one dyadic level of a cmsketch
+ * \endinternal
+ */
+typedef struct {
+    uint32 offset;    /*! byte offset of the level's data from the cmsketch */
+    uint32 nentries;  /*! pairs in use, or CM_LEVEL_DENSE */
+    uint32 capacity;  /*! pairs that fit at offset; unused once dense */
+} cmlevel;
+
+/*!
+ * \internal
+ * \brief a dyadic CountMin sketch with configurable dimensions
+ *
+ * Each of the RANGES dyadic levels starts out sparse: a sorted array of
+ * exact (value, count) pairs.  Most levels of a low-cardinality column
+ * never grow past that.  A level that outgrows sparseMax pairs is
+ * converted into depth rows of width counters, each counterBytes wide.
+ * The level data follows the struct, starting at CM_DATA_START, and the
+ * whole thing is flat so it can live inside a bytea.
+ * \endinternal
+ */
+typedef struct {
+    uint32  depth;         /*! rows in a dense level */
+    uint32  width;         /*! counters per row, a power of 2 */
+    uint32  counterBytes;  /*! 4 or 8 */
+    uint32  sparseMax;     /*! most pairs a level holds before going dense */
+    uint32  size;          /*! bytes in use, including the level data */
+    cmlevel levels[RANGES];
+} cmsketch;
+
+#define CM_DATA_START (TYPEALIGN(sizeof(int64), sizeof(cmsketch)))
+#define CM_LEVEL_DATA(s, j) ((char *)(s) + (s)->levels[j].offset)
+#define CM_LEVEL_IS_DENSE(s, j) ((s)->levels[j].nentries == CM_LEVEL_DENSE)
+#define CM_DENSE_SZ(s) ((s)->depth * (s)->width * (s)->counterBytes)
+
 /*!
  * \internal
  * \brief the transition value struct for CM sketches
  *
- * Holds the sketch counters
+ * Holds the sketch
  * and a cache of handy metadata that we'll reuse across calls
  * \endinternal
  */
@@ -50,13 +108,38 @@ typedef struct {
     int nargs;            /*! number of args being carried for finalizer */
     Oid typOid;     /*! oid of the data type we are sketching */
     Oid outFuncOid; /*! oid of the OutFunc for that data type */
-    countmin sketches[RANGES];
+    int hashKind;   /*! sketch_hash_kind used to place counts */
+    cmsketch sketch;  /*! variable-sized: the level data follows */
 } cmtransval;
 
-/*! base size of a cmtransval */
-#define CM_TRANSVAL_SZ (VARHDRSZ + sizeof(cmtransval))
+/*! size of a cmtransval whose sketch takes sz bytes */
+#define CM_TRANSVAL_SZ(sz) (VARHDRSZ + offsetof(cmtransval, sketch) + (sz))
+
+#define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= CM_TRANSVAL_SZ(CM_DATA_START))
 
-#define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= CM_TRANSVAL_SZ)
+/*! salts for SKETCH_HASH_CM_DYADIC: see cmsketch_dyadic_hash */
+#define CM_LEVEL_SALT UINT64CONST(0x9e3779b97f4a7c15)
+#define CM_REMIX_SALT UINT64CONST(0xc2b2ae3d27d4eb4f)
+
+#define CM_SKETCH_MAGIC 0x434d534b /* "CMSK" */
+#define CM_SKETCH_VERSION 2
+
+/*!
+ * \internal
+ * \brief header of the finished sketch returned by cmsketch
+ *
+ * A cmsketch follows the header, with every sparse level trimmed to its
+ * pairs.  Version 1 sketches had RANGES*sizeof(countmin) bytes of dense
+ * counters instead.  Sketches finished before the header was introduced
+ * are exactly those counters, placed with md5; readers tell them apart by
+ * length.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;     /*! CM_SKETCH_MAGIC */
+    uint16 version;   /*! CM_SKETCH_VERSION */
+    uint16 hashKind;  /*! sketch_hash_kind used to place counts */
+} cmsketch_header;
 
 
 /*!
@@ -109,9 +192,13 @@ typedef struct {
  * Each mfv entry contains an offset from the top of the structure where
  * we can find a Postgres text object holding the output format of a
  * frequent value.
+ * The mfvsketch aggregate returns the transval as is, so it starts with a
+ * magic number and version for telling stored sketches apart.
  * \endinternal
  */
 typedef struct {
+    uint32 magic;         /*! MFV_SKETCH_MAGIC */
+    uint16 version;       /*! MFV_SKETCH_VERSION */
     unsigned max_mfvs;    /*! number of frequent values */
     unsigned next_mfv;    /*! index of next mfv to insert into */
     unsigned next_offset; /*! next memory offset to insert into */
@@ -119,6 +206,7 @@ typedef struct {
     int typLen;           /*! Length of the data type */
     bool typByVal;        /*! Whether type is by value or by reference */
     Oid outFuncOid;       /*! Oid of the outfunc for this type */
+    int hashKind;         /*! sketch_hash_kind used by the countmin sketch */
     countmin sketch;      /*! a single countmin sketch */
     /*!
      * type-independent collection of Most Frequent Values
@@ -129,6 +217,9 @@ typedef struct {
     offsetcnt mfvs[0];
 } mfvtransval;
 
+#define MFV_SKETCH_MAGIC 0x4d465653 /* "MFVS" */
+#define MFV_SKETCH_VERSION 1
+
 /*! base size of an MFV transval */
 #define MFV_TRANSVAL_SZ(i) (VARHDRSZ + sizeof(mfvtransval) + i*sizeof(offsetcnt))
 
@@ -138,17 +229,23 @@ typedef struct {
                                           next_offset)
                                           
 /* countmin aggregate protos */
-Datum  countmin_trans_c(countmin, Datum, Oid, Oid);
+void   countmin_trans_c(countmin, const uint8 *);
 bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool);
-bytea *cmsketch_init_transval(Oid);
-void   countmin_dyadic_trans_c(cmtransval *, Datum);
+bytea *cmsketch_init_transval(Oid, uint32, uint32, uint32);
+void   cmsketch_dims(float8, float8, uint32 *, uint32 *);
+bytea *countmin_dyadic_trans_c(bytea *, Datum);
+uint64 cmsketch_level_count(const cmsketch *, uint32, int64);
+void   cmsketch_dyadic_hash(int64, uint32, uint8 *);
+bytea *cmsketch_merge_c(bytea *, bytea *);
+bytea *cmsketch_finish_c(bytea *);
+bytea *cmsketch_from_stored(bytea *);
 
 /* countmin scalar function protos */
-int64  cmsketch_count_c(countmin, Datum, Oid, Oid);
-int64  cmsketch_count_md5_datum(countmin, bytea *, Oid);
+int64  cmsketch_count_c(countmin, Datum, int16, bool, int);
+int64  cmsketch_count_hash(countmin, const uint8 *);
 
 /* hash_counters_iterate and its lambdas */
-int64  hash_counters_iterate(bytea *, countmin, int64, int64 (*lambdaptr)(
+int64  hash_counters_iterate(const uint8 *, countmin, int64, int64 (*lambdaptr)(
                                  uint32,
                                  uint32,
                                  countmin,
@@ -165,16 +262,21 @@ bytea *mfv_transval_insert_at(bytea *, Datum, uint32);
 void *mfv_transval_getval(bytea *, uint32);
 bytea *mfv_init_transval(int, Oid);
 bytea *mfvsketch_merge_c(bytea *, bytea *);
+ArrayType *mfvsketch_histogram_c(bytea *);
+void   mfvsketch_check(bytea *);
 void   mfv_copy_datum(bytea *, int, Datum);
 int cnt_cmp_desc(const void *i, const void *j);
 
 
 /* UDF protos */
 Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_int8_sized_trans(PG_FUNCTION_ARGS);
 Datum cmsketch_width_histogram(PG_FUNCTION_ARGS);
 Datum cmsketch_dhistogram(PG_FUNCTION_ARGS);
 Datum __cmsketch_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_merge(PG_FUNCTION_ARGS);
+Datum __cmsketch_union_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_union(PG_FUNCTION_ARGS);
 Datum cmsketch_dump(PG_FUNCTION_ARGS);
 Datum __cmsketch_count_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_rangecount_final(PG_FUNCTION_ARGS);
@@ -184,6 +286,10 @@ Datum __cmsketch_dhist_final(PG_FUNCTION_ARGS);
 Datum __mfvsketch_trans(PG_FUNCTION_ARGS);
 Datum __mfvsketch_final(PG_FUNCTION_ARGS);
 Datum __mfvsketch_merge(PG_FUNCTION_ARGS);
+Datum __mfvsketch_sketch_final(PG_FUNCTION_ARGS);
+Datum __mfvsketch_union_trans(PG_FUNCTION_ARGS);
+Datum mfvsketch_histogram(PG_FUNCTION_ARGS);
+Datum mfvsketch_union(PG_FUNCTION_ARGS);
 
 #endif /* _COUNTMIN_H_ */
 
@@ -16,8 +16,9 @@
  * trials using multiple independent hash functions on multiple bitmaps.
  *
  * The FM sketch technique works poorly with small inputs, so we
- * explicitly count the first 12K distinct values in a main-memory
- * data structure before switching over to sketching.
+ * explicitly count the first 12K distinct values in a hash set of their
+ * hashes before switching over to sketching.  Switching replays the
+ * hashes, so no value is hashed twice.
  *
  * See the paper mentioned below
  * for detailed explanation, formulae, and pseudocode.
@@ -30,11 +31,9 @@
 #include "utils/elog.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
-#include "libpq/md5.h"
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
-#include "sortasort.h"
 #include <ctype.h>
 
 #ifndef NO_PG_MODULE_MAGIC
@@ -42,7 +41,7 @@ PG_MODULE_MAGIC;
 #endif
 
 #define NMAP 256
-#define FMSKETCH_SZ (VARHDRSZ + NMAP*(MD5_HASHLEN_BITS)/CHAR_BIT)
+#define FMSKETCH_SZ (VARHDRSZ + NMAP*(SKETCH_HASHLEN_BITS)/CHAR_BIT)
 
 /*!
  * For FM, empirically, estimates seem to fall below 1% error around 12k
@@ -50,14 +49,33 @@ PG_MODULE_MAGIC;
  */
 #define MINVALS 1024*12
 
+/*! initial number of slots in the SMALL-mode hash set: a power of 2 */
+#define FM_HASHSET_INITIAL 16
+
+typedef enum {SMALL, BIG} fmstatus;
+
+#define FM_SKETCH_MAGIC 0x464d534b /* "FMSK" */
+#define FM_SKETCH_VERSION 1
+
 /*!
- * initial size for a sortasort: we'll guess at 8 bytes per datum.
- * sortasort will grow dynamically if we guessed too low
+ * \internal
+ * \brief an open-addressing hash set of value hashes
+ *
+ * Holds the SKETCH_HASHLEN-byte hashes of the distinct values seen so far,
+ * in nslots slots with linear probing.  The slot of a hash is picked by its
+ * first 64 bits.  An all-zero slot is empty, so an all-zero hash is only
+ * recorded in hasZero.  The set is flat, so it can be copied and moved as
+ * bytes; it grows by doubling before it gets more than half full.
+ * \endinternal
  */
-#define SORTASORT_INITIAL_STORAGE  sizeof(sortasort) + MINVALS*sizeof(uint32) + \
-    8*MINVALS
+typedef struct {
+    uint32 nvals;    /*! number of distinct hashes, including a zero hash */
+    uint32 nslots;   /*! number of slots, a power of 2 */
+    bool   hasZero;  /*! whether the all-zero hash was seen */
+    uint8  slots[0]; /*! nslots*SKETCH_HASHLEN bytes */
+} fmhashset;
 
-typedef enum {SMALL, BIG} fmstatus;
+#define FM_HASHSET_SZ(nslots) (sizeof(fmhashset) + (nslots)*SKETCH_HASHLEN)
 
 /*!
  * \internal
@@ -66,16 +84,24 @@ typedef enum {SMALL, BIG} fmstatus;
  * because FM sketches work poorly on small numbers of values,
  * our transval can be in one of two modes.
  * for "SMALL" numbers of values (<=MINVALS), the storage array
- * is a "sortasort" data structure containing an array of input values.
- * for "BIG" datasets (>MINVAL), it is an array of FM sketch bitmaps.
+ * is an fmhashset of the hashes of the values seen, which also gives an
+ * exact count.
+ * for "BIG" datasets (>MINVAL), it is an array of FM sketch bitmaps,
+ * filled from the same hashes.
+ * hashKind records the sketch_hash_kind used for both.
+ * The fmsketch aggregate returns the transval as is, so it starts with a
+ * magic number and version for telling stored sketches apart.
  * \endinternal
  */
 typedef struct {
+    uint32   magic;      /*! FM_SKETCH_MAGIC */
+    uint16   version;    /*! FM_SKETCH_VERSION */
     fmstatus status;
     Oid      typOid;
     Oid      funcOid;
     int16    typLen;
     bool     typByVal;   
+    uint8    hashKind;
     char storage[0];
 } fmtransval;
 
@@ -84,9 +110,20 @@ Datum __fmsketch_count_distinct_c(bytea *);
 Datum __fmsketch_trans(PG_FUNCTION_ARGS);
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS);
 Datum __fmsketch_merge(PG_FUNCTION_ARGS);
+Datum __fmsketch_final(PG_FUNCTION_ARGS);
+Datum __fmsketch_union_trans(PG_FUNCTION_ARGS);
+Datum fmsketch_cardinality(PG_FUNCTION_ARGS);
+Datum fmsketch_union(PG_FUNCTION_ARGS);
+Datum fmsketch_intersection(PG_FUNCTION_ARGS);
+bytea *fmsketch_merge_c(bytea *, bytea *);
+int64  fmsketch_count_c(bytea *);
+void   fmsketch_check(bytea *);
 void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out);
-bytea *fmsketch_sortasort_insert(bytea *, Datum, size_t);
 bytea *fm_new(fmtransval *);
+bytea *fm_small_new(fmtransval *, uint32);
+bytea *fmsketch_hashset_insert(bytea *, const uint8 *);
+bytea *fm_small_to_big(bytea *);
+void   fm_sketch_hash(bytea *, const uint8 *);
 
 PG_FUNCTION_INFO_V1(__fmsketch_trans);
 
@@ -98,8 +135,7 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
     Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
     Oid         funcOid;
     bool        typIsVarlena;
-    Datum       retval;
-    Datum       inval;
+    uint8       hash[SKETCH_HASHLEN];
 
     if (!OidIsValid(element_type))
         elog(ERROR, "could not determine data type of input");
@@ -122,94 +158,43 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
 
     /* get the provided element, being careful in case it's NULL */
     if (!PG_ARGISNULL(1)) {
-        inval = PG_GETARG_DATUM(1);
-
         /*
-         * if this is the first call, initialize transval to hold a sortasort
+         * if this is the first call, initialize transval to hold a hash set
          * on the first call, we should have the empty string (if the agg was declared properly!)
          */
         if (VARSIZE(transblob) <= VARHDRSZ) {
-            size_t blobsz = VARHDRSZ + sizeof(fmtransval) +
-                            SORTASORT_INITIAL_STORAGE;
+            fmtransval template;
 
-            transblob = (bytea *)palloc0(blobsz);
-            SET_VARSIZE(transblob, blobsz);
-            transval = (fmtransval *)VARDATA(transblob);
-
-            transval->typOid = element_type;
+            memset(&template, 0, sizeof(fmtransval));
+            template.magic = FM_SKETCH_MAGIC;
+            template.version = FM_SKETCH_VERSION;
+            template.typOid = element_type;
             /* figure out the outfunc for this type */
             getTypeOutputInfo(element_type, &funcOid, &typIsVarlena);
-            get_typlenbyval(element_type, &(transval->typLen), &(transval->typByVal));
-            transval->status = SMALL;
-            sortasort_init((sortasort *)transval->storage,
-                           MINVALS,
-                           SORTASORT_INITIAL_STORAGE, 
-                           transval->typLen,
-                           transval->typByVal);
-        }
-        else {
-            /* extract the existing transval from the transblob */
-            transval = (fmtransval *)VARDATA(transblob);
+            get_typlenbyval(element_type, &(template.typLen), &(template.typByVal));
+            template.hashKind = SKETCH_HASH_DEFAULT;
+            transblob = fm_small_new(&template, FM_HASHSET_INITIAL);
         }
+        transval = (fmtransval *)VARDATA(transblob);
 
-        /*
-         * if we've seen < MINVALS distinct values, place datum into the sortasort
-         * XXXX Would be cleaner to try the sortasort insert and if it fails, then continue.
-         */
-        if (transval->status == SMALL
-            && ((sortasort *)(transval->storage))->num_vals <
-            MINVALS) {
-            int len = ExtractDatumLen(inval, transval->typLen, transval->typByVal);
-            
-            retval =
-                PointerGetDatum(fmsketch_sortasort_insert(
-                                    transblob,
-                                    inval, len));
-            PG_RETURN_DATUM(retval);
-        }
+        sketch_hash_datum(PG_GETARG_DATUM(1), transval->typLen,
+                          transval->typByVal, transval->hashKind, hash);
 
-        /*
-         * if we've seen exactly MINVALS distinct values, create FM bitmaps
-         * and load the contents of the sortasort into the FM sketch
-         */
-        else if (transval->status == SMALL
-                 && ((sortasort *)(transval->storage))->num_vals ==
-                 MINVALS) {
-            int        i;
-            sortasort  *s = (sortasort *)(transval->storage);
-            bytea      *newblob = fm_new(transval);
-            
-            transval = (fmtransval *)VARDATA(newblob);
-            
-            /*
-             * "catch up" on the past as if we were doing FM from the beginning:
-             * apply the FM sketching algorithm to each value previously stored in the sortasort
-             */
-            for (i = 0; i < MINVALS; i++)
-                __fmsketch_trans_c(newblob, 
-                                   PointerExtractDatum(SORTASORT_GETVAL(s,i), s->typByVal));
-
-            /*
-             * XXXX would like to pfree the old transblob, but the memory allocator doesn't like it
-             * XXXX Meanwhile we know that this memory "leak" is of fixed size and will get
-             * XXXX deallocated "soon" when the memory context is destroyed.
-             */
-            /* drop through to insert the current datum in "BIG" mode */
-            transblob = newblob;
+        /* Apply FM algorithm to this datum */
+        if (transval->status == BIG) {
+            fm_sketch_hash(transblob, hash);
+            PG_RETURN_DATUM(PointerGetDatum(transblob));
         }
 
         /*
-         * if we're here we've seen >=MINVALS distinct values and are in BIG mode.
-         * Just for sanity, let's check.
+         * if we've seen <= MINVALS distinct values, remember the hash;
+         * past that, create FM bitmaps and load the hashes into them
          */
-        if (transval->status != BIG)
-            elog(
-                ERROR,
-                "FM sketch failed internal sanity check");
-
-        /* Apply FM algorithm to this datum */
-        retval = __fmsketch_trans_c(transblob, inval);
-        PG_RETURN_DATUM(retval);
+        transblob = fmsketch_hashset_insert(transblob, hash);
+        if (((fmhashset *)((fmtransval *)VARDATA(transblob))->storage)->nvals
+            > MINVALS)
+            transblob = fm_small_to_big(transblob);
+        PG_RETURN_DATUM(PointerGetDatum(transblob));
     }
     else PG_RETURN_NULL();
 }
@@ -239,55 +224,166 @@ bytea *fm_new(fmtransval *template)
     return(newblob);
 }
 
+/*!
+ * generate a bytea holding a transval in SMALL mode, with an empty hash set
+ * \param template the transval whose fields we copy in
+ * \param nslots the number of slots in the hash set, a power of 2
+ */
+bytea *fm_small_new(fmtransval *template, uint32 nslots)
+{
+    size_t      size = VARHDRSZ + sizeof(fmtransval) + FM_HASHSET_SZ(nslots);
+    /* use palloc0 so that all the slots start out empty */
+    bytea *     newblob = (bytea *)palloc0(size);
+    fmtransval *transval;
+
+    SET_VARSIZE(newblob, size);
+    transval = (fmtransval *)VARDATA(newblob);
+    memcpy(transval, template, sizeof(fmtransval));
+    transval->status = SMALL;
+    ((fmhashset *)transval->storage)->nslots = nslots;
+    return(newblob);
+}
+
+/*!
+ * add a hash to the hash set of a SMALL transval, doubling the set first if
+ * it would get more than half full.
+ * \param transblob the current transition value packed into a bytea
+ * \param hash the SKETCH_HASHLEN-byte hash of a value
+ * \returns the transition value, which moves if the set had to grow
+ */
+bytea *fmsketch_hashset_insert(bytea *transblob, const uint8 *hash)
+{
+    static const uint8 zero[SKETCH_HASHLEN];
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+    fmhashset * set = (fmhashset *)transval->storage;
+    uint64      h;
+    uint32      i;
+
+    if (memcmp(hash, zero, SKETCH_HASHLEN) == 0) {
+        if (!set->hasZero) {
+            set->hasZero = true;
+            set->nvals++;
+        }
+        return(transblob);
+    }
+
+    if (2*(set->nvals + 1) > set->nslots) {
+        /*
+         * allocate a transval with a set twice as big and move the hashes over.
+         * we can't use repalloc because it fails trying to free the old transblob
+         */
+        bytea *    newblob = fm_small_new(transval, 2*set->nslots);
+        fmhashset *newset = (fmhashset *)((fmtransval *)VARDATA(newblob))->storage;
+
+        for (i = 0; i < set->nslots; i++)
+            if (memcmp(&set->slots[i*SKETCH_HASHLEN], zero, SKETCH_HASHLEN) != 0)
+                newblob = fmsketch_hashset_insert(newblob,
+                                                  &set->slots[i*SKETCH_HASHLEN]);
+        newset->hasZero = set->hasZero;
+        newset->nvals += set->hasZero;
+        transblob = newblob;
+        set = newset;
+    }
+
+    memcpy(&h, hash, sizeof(uint64));
+    for (i = h & (set->nslots - 1); ; i = (i + 1) & (set->nslots - 1)) {
+        uint8 *slot = &set->slots[i*SKETCH_HASHLEN];
+
+        if (memcmp(slot, hash, SKETCH_HASHLEN) == 0)
+            break;
+        if (memcmp(slot, zero, SKETCH_HASHLEN) == 0) {
+            memcpy(slot, hash, SKETCH_HASHLEN);
+            set->nvals++;
+            break;
+        }
+    }
+    return(transblob);
+}
+
+/*!
+ * convert a SMALL transval into a BIG one by applying the FM sketching
+ * algorithm to each hash in its set, as if we were doing FM from the
+ * beginning.  No value needs to be hashed again.
+ * \param transblob a SMALL transition value packed into a bytea
+ */
+bytea *fm_small_to_big(bytea *transblob)
+{
+    static const uint8 zero[SKETCH_HASHLEN];
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+    fmhashset * set = (fmhashset *)transval->storage;
+    bytea *     newblob = fm_new(transval);
+    uint32      i;
+
+    for (i = 0; i < set->nslots; i++)
+        if (memcmp(&set->slots[i*SKETCH_HASHLEN], zero, SKETCH_HASHLEN) != 0)
+            fm_sketch_hash(newblob, &set->slots[i*SKETCH_HASHLEN]);
+    if (set->hasZero)
+        fm_sketch_hash(newblob, zero);
+
+    /*
+     * XXXX would like to pfree the old transblob, but the memory allocator doesn't like it
+     * XXXX Meanwhile we know that this memory "leak" is of fixed size and will get
+     * XXXX deallocated "soon" when the memory context is destroyed.
+     */
+    return(newblob);
+}
+
 /*!
  * Main logic of Flajolet and Martin's sketching algorithm.
- * For each call, we get an md5 hash of the value passed in.
+ * For each call, we hash the value passed in, and sketch the hash.
+ * \param transblob the transition value packed into a bytea
+ * \param input a textual representation of the value to hash
+ */
+Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
+{
+    fmtransval * transval = (fmtransval *) VARDATA(transblob);
+    uint8        c[SKETCH_HASHLEN];
+
+    sketch_hash_datum(indat, transval->typLen, transval->typByVal,
+                      transval->hashKind, c);
+    fm_sketch_hash(transblob, c);
+    return PointerGetDatum(transblob);
+}
+
+/*!
+ * set the FM bit for a hash in a BIG transval.
  * First we use the hash as a random number to choose one of
  * the NMAP bitmaps at random to update.
  * Then we find the position "rmost" of the rightmost 1 bit in the hashed value.
  * We then turn on the "rmost"-th bit FROM THE LEFT in the chosen bitmap.
- * \param transblob the transition value packed into a bytea
- * \param input a textual representation of the value to hash
+ * \param transblob a BIG transition value packed into a bytea
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
  */
-Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
+void fm_sketch_hash(bytea *transblob, const uint8 *hash)
 {
     fmtransval * transval = (fmtransval *) VARDATA(transblob);
     bytea *      bitmaps = (bytea *)transval->storage;
     uint64       index;
-    uint8 *      c;
+    uint8        c[SKETCH_HASHLEN];
     int          rmost;
-    Datum        result;
-    // char        *hex;
-    bytea       *hashed;
 
-    hashed = sketch_md5_bytea(indat, transval->typOid);
-    c = (uint8 *)VARDATA(hashed);
-    // hex = text_to_cstring((bytea *)DatumGetPointer(DirectFunctionCall2(binary_encode, PointerGetDatum(hashed),
-    //                       CStringGetTextDatum("hex"))));
-    // elog(NOTICE, "md5(%s), len %d: %s", text_to_cstring((bytea *)PointerGetDatum(indat)),
-    //      VARSIZE((bytea *)PointerGetDatum(indat)), hex);
+    memcpy(c, hash, SKETCH_HASHLEN);
 
     /*
      * During the insertion we insert each element
      * in one bitmap only (a la Flajolet pseudocode, page 16).
      * Choose the bitmap by taking the 64 high-order bits worth of hash value mod NMAP
      */
-    index = (*(uint64 *)c) % NMAP;
+    memcpy(&index, c, sizeof(uint64));
+    index %= NMAP;
 
     /*
      * Find index of the rightmost non-0 bit.  Turn on that bit (from left!) in the sketch.
      */
-    rmost = rightmost_one(c, 1, MD5_HASHLEN_BITS, 0);
+    rmost = rightmost_one(c, 1, SKETCH_HASHLEN_BITS, 0);
 
     /*
      * last argument must be the index of the bit position from the right.
      * i.e. position 0 is the rightmost.
      * so to set the bit at rmost from the left, we subtract from the total number of bits.
      */
-    result =
-        array_set_bit_in_place(bitmaps, NMAP, MD5_HASHLEN_BITS, index,
-                               (MD5_HASHLEN_BITS - 1) - rmost);
-    return PointerGetDatum(transblob);
+    (void)array_set_bit_in_place(bitmaps, NMAP, SKETCH_HASHLEN_BITS, index,
+                                 (SKETCH_HASHLEN_BITS - 1) - rmost);
 }
 
 PG_FUNCTION_INFO_V1(__fmsketch_count_distinct);
@@ -295,22 +391,33 @@ PG_FUNCTION_INFO_V1(__fmsketch_count_distinct);
 /*! UDA final function to get count(distinct) out of an FM sketch */
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS)
 {
-    fmtransval *transval = (fmtransval *)VARDATA((PG_GETARG_BYTEA_P(0)));
+    PG_RETURN_INT64(fmsketch_count_c(PG_GETARG_BYTEA_P(0)));
+}
+
+/*!
+ * the distinct count of an FM transval: exact for a SMALL one, estimated
+ * for a BIG one.
+ * \param transblob the transition value packed into a bytea
+ */
+int64 fmsketch_count_c(bytea *transblob)
+{
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
 
-    if (VARSIZE((PG_GETARG_BYTEA_P(0))) == VARHDRSZ)
+    if (VARSIZE(transblob) == VARHDRSZ)
         /* nothing was ever aggregated! */
         return (0);
 
-    /* if status is not BIG then get count from sortasort */
+    /* if status is not BIG then get count from the hash set */
     if (transval->status == SMALL)
-        return ((sortasort *)(transval->storage))->num_vals;
+        return ((fmhashset *)(transval->storage))->nvals;
     /* else get count via fm */
     else if (transval->status != BIG) {
         elog(ERROR, "FM transval neither SMALL nor BIG");
         return(0);
     }
     else     /* transval->status == BIG */
-        return __fmsketch_count_distinct_c((bytea *)transval->storage);
+        return DatumGetInt64(
+            __fmsketch_count_distinct_c((bytea *)transval->storage));
 }
 
 /*!
@@ -325,7 +432,7 @@ Datum __fmsketch_count_distinct_c(bytea *bitmaps)
     uint32        S = 0;
     static double phi = 0.77351;     /*
                                       * the magic constant
-                                      * char out[NMAP*MD5_HASHLEN_BITS];
+                                      * char out[NMAP*SKETCH_HASHLEN_BITS];
                                       */
     int    i;
     uint32 lz;
@@ -333,7 +440,7 @@ Datum __fmsketch_count_distinct_c(bytea *bitmaps)
     for (i = 0; i < NMAP; i++)
     {
         lz = leftmost_zero((uint8 *)VARDATA(
-                               bitmaps), NMAP, MD5_HASHLEN_BITS, i);
+                               bitmaps), NMAP, SKETCH_HASHLEN_BITS, i);
         S = S + lz;
     }
 
@@ -348,96 +455,95 @@ PG_FUNCTION_INFO_V1(__fmsketch_merge);
  * Greenplum "prefunc": a function to merge 2 transvals computed at different machines.
  * For simple FM, this is trivial: just OR together the two arrays of bitmaps.
  * But we have to deal with cases where one or both transval is SMALL: i.e. it
- * holds a sortasort, not an FM sketch.
- *
- * XXX  TESTING: Ensure we exercise all branches!
+ * holds a hash set, not an FM sketch.  Either way we only move hashes
+ * around; values are never hashed again.
  */
 Datum __fmsketch_merge(PG_FUNCTION_ARGS)
 {
-    bytea *     transblob1 = (bytea *)PG_GETARG_BYTEA_P(0);
-    bytea *     transblob2 = (bytea *)PG_GETARG_BYTEA_P(1);
+    PG_RETURN_DATUM(PointerGetDatum(
+                        fmsketch_merge_c((bytea *)PG_GETARG_BYTEA_P(0),
+                                         (bytea *)PG_GETARG_BYTEA_P(1))));
+}
+
+/*!
+ * merge two FM transvals into a new one, leaving both arguments alone.
+ * \param transblob1 an FM transval packed into a bytea, possibly empty
+ * \param transblob2 another one
+ */
+bytea *fmsketch_merge_c(bytea *transblob1, bytea *transblob2)
+{
+    static const uint8 zero[SKETCH_HASHLEN];
     fmtransval *transval1, *transval2;
-    sortasort * s1, *s2;
-    sortasort * sortashort, *sortabig;
+    fmhashset * small;
     bytea *     tblob_big, *tblob_small;
     uint32      i;
 
     /* deal with the case where one or both items is the initial value of '' */
-    if (VARSIZE(transblob1) == VARHDRSZ) {
-        PG_RETURN_DATUM(PointerGetDatum(transblob2));
-    }
-    if (VARSIZE(transblob2) == VARHDRSZ) {
-        PG_RETURN_DATUM(PointerGetDatum(transblob1));
-    }
+    if (VARSIZE(transblob1) == VARHDRSZ)
+        return(transblob2);
+    if (VARSIZE(transblob2) == VARHDRSZ)
+        return(transblob1);
 
     transval1 = (fmtransval *)VARDATA(transblob1);
     transval2 = (fmtransval *)VARDATA(transblob2);
 
+    /* hashes from different hash functions can't be combined */
+    if (transval1->hashKind != transval2->hashKind)
+        elog(ERROR,
+             "cannot merge FM sketches built with different hash functions");
+
     if (transval1->status == BIG && transval2->status == BIG) {
         /* easy case: merge two FM sketches via bitwise OR. */
         fmtransval *newval;
         tblob_big = fm_new(transval1);
         newval = (fmtransval *)VARDATA(tblob_big);
-        big_or(transblob1, transblob2, (bytea *)newval->storage);
-        PG_RETURN_DATUM(PointerGetDatum(tblob_big));
-    }
-    else if (transval1->status == SMALL && transval2->status == SMALL) {
-        s1 = (sortasort *)(transval1->storage);
-        s2 = (sortasort *)(transval2->storage);
-        tblob_big =
-            (s1->num_vals > s2->num_vals) ? transblob1 : transblob2;
-        tblob_small =
-            (s1->num_vals > s2->num_vals) ? transblob2 : transblob1;
-        sortashort =
-            (sortasort *)(((fmtransval *)((fmtransval *)VARDATA(tblob_small)))->storage);
-        sortabig = (sortasort *)(((fmtransval *)((fmtransval *)VARDATA(tblob_big)))->storage);
-        if (sortabig->num_vals + sortashort->num_vals <=
-            sortabig->capacity) {
-            /*
-             * we have room in sortabig
-             * one could imagine a more efficient (merge-based) sortasort merge,
-             * but for now we just copy the values from the smaller sortasort into
-             * the bigger one.
-             */
-            for (i = 0; i < sortashort->num_vals; i++) {
-                Datum the_val = PointerExtractDatum(SORTASORT_GETVAL(sortashort,i),
-                                                    transval1->typByVal);
-                int the_len = ExtractDatumLen(the_val, transval1->typLen, 
-                                              transval1->typByVal);
-                tblob_big = fmsketch_sortasort_insert(tblob_big, 
-                                                      the_val, 
-                                                      the_len);
-            }
-            PG_RETURN_DATUM(PointerGetDatum(tblob_big));
-        }
-        /* else drop through. */
+        big_or((bytea *)transval1->storage, (bytea *)transval2->storage,
+               (bytea *)newval->storage);
+        return(tblob_big);
     }
 
     /*
-     * if we got here, then at most one transval is BIG, i.e. one or both transvals is SMALL.
-     * need to form an FM sketch and populate with the SMALL transval(s)
+     * if we got here, then at most one transval is BIG.  Add the hashes of
+     * a SMALL one into a copy of the other, preferring to copy a BIG one or
+     * the bigger set.
      */
-    if (transval1->status == SMALL && transval2->status == SMALL)
-        tblob_big = fm_new(transval1);
-    else
-        tblob_big =
-            (transval1->status == BIG) ? transblob1 : transblob2;
-
-    if (transval1->status == SMALL) {
-        s1 = (sortasort *)(transval1->storage);
-        for(i = 0; i < s1->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s1,i),
-                                                              transval1->typByVal));
-        }
+    if (transval1->status == BIG
+        || (transval2->status == SMALL
+            && ((fmhashset *)transval1->storage)->nvals
+               >= ((fmhashset *)transval2->storage)->nvals)) {
+        tblob_big = transblob1;
+        tblob_small = transblob2;
     }
-    if (transval2->status == SMALL) {
-        s2 = (sortasort *)(transval2->storage);
-        for(i = 0; i < s2->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s2,i),
-                                                              transval1->typByVal));
-        }
+    else {
+        tblob_big = transblob2;
+        tblob_small = transblob1;
+    }
+    tblob_big = (bytea *)memcpy(palloc(VARSIZE(tblob_big)), tblob_big,
+                                VARSIZE(tblob_big));
+    small = (fmhashset *)((fmtransval *)VARDATA(tblob_small))->storage;
+
+    for (i = 0; i < small->nslots; i++) {
+        const uint8 *hash = &small->slots[i*SKETCH_HASHLEN];
+
+        if (memcmp(hash, zero, SKETCH_HASHLEN) == 0)
+            continue;
+        if (((fmtransval *)VARDATA(tblob_big))->status == BIG)
+            fm_sketch_hash(tblob_big, hash);
+        else
+            tblob_big = fmsketch_hashset_insert(tblob_big, hash);
+    }
+    if (small->hasZero) {
+        if (((fmtransval *)VARDATA(tblob_big))->status == BIG)
+            fm_sketch_hash(tblob_big, zero);
+        else
+            tblob_big = fmsketch_hashset_insert(tblob_big, zero);
     }
-    PG_RETURN_DATUM(PointerGetDatum(tblob_big));
+
+    if (((fmtransval *)VARDATA(tblob_big))->status == SMALL
+        && ((fmhashset *)((fmtransval *)VARDATA(tblob_big))->storage)->nvals
+           > MINVALS)
+        tblob_big = fm_small_to_big(tblob_big);
+    return(tblob_big);
 }
 
 /*! OR of two big bitmaps, for gathering sketches computed in parallel. */
@@ -445,72 +551,147 @@ void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
 {
     uint32  i;
 
-    if (VARSIZE(bitmap1) != VARSIZE(bitmap2))
+    if (VARSIZE(bitmap1) != VARSIZE(bitmap2) || VARSIZE(bitmap1) != VARSIZE(out))
         elog(ERROR,
              "attempting to OR two different-sized bitmaps: %d, %d",
              VARSIZE(bitmap1),
              VARSIZE(bitmap2));
 
-    out = (bytea *)palloc(VARSIZE(bitmap1));
-    SET_VARSIZE(out, VARSIZE(bitmap1));
-
     /* could probably be more efficient doing this 32 or 64 bits at a time */
-    for (i=0; i < VARSIZE(bitmap1) - VARHDRSZ; i+=8)
+    for (i=0; i < VARSIZE(bitmap1) - VARHDRSZ; i++)
         ((char *)(VARDATA(out)))[i] = ((char *)(VARDATA(bitmap1)))[i] |
                                       ((char *)(VARDATA(bitmap2)))[i];
 
 }
 
 /*!
- * wrapper for insertion into a sortasort. calls sortasort_try_insert and if that fails it
- * makes more space for insertion (double or more the size) and tries again.
- * \param transblob the current transition value packed into a bytea
- * \param dat the Datum to be inserted
+ * make sure a bytea holds an FM sketch returned by the fmsketch aggregate
+ * \param blob the stored sketch
  */
-bytea *fmsketch_sortasort_insert(bytea *transblob, Datum dat, size_t len)
+void fmsketch_check(bytea *blob)
 {
-    fmtransval *transval = (fmtransval *)VARDATA(transblob);
-    sortasort *s_in =
-        (sortasort *)(transval->storage);
-    bytea *    newblob;
-    bool       success = FALSE;
-    size_t     new_storage_sz;
-    size_t     newsize;
+    fmtransval *transval = (fmtransval *)VARDATA(blob);
+    size_t      size;
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(fmtransval)
+        || transval->magic != FM_SKETCH_MAGIC)
+        elog(ERROR, "invalid FM sketch");
+    if (transval->version != FM_SKETCH_VERSION)
+        elog(ERROR, "unsupported FM sketch version %d", transval->version);
+
+    if (transval->status == SMALL) {
+        fmhashset *set = (fmhashset *)transval->storage;
+
+        size = VARHDRSZ + sizeof(fmtransval) + sizeof(fmhashset);
+        if (VARSIZE(blob) < size || set->nslots == 0
+            || (set->nslots & (set->nslots - 1)) != 0
+            || 2*(uint64)set->nvals > set->nslots)
+            elog(ERROR, "invalid FM sketch");
+        size += set->nslots*SKETCH_HASHLEN;
+        if (VARSIZE(blob) != size)
+            elog(ERROR, "invalid FM sketch");
+
+        /*
+         * fmsketch_hashset_insert() relies on nvals to keep empty slots
+         * around; without one, linear probing would never terminate
+         */
+        {
+            static const uint8 zero[SKETCH_HASHLEN];
+            uint8  hasZero = *(uint8 *)&set->hasZero;
+            uint32 i, nused = 0;
+
+            for (i = 0; i < set->nslots; i++)
+                if (memcmp(&set->slots[i*SKETCH_HASHLEN], zero,
+                           SKETCH_HASHLEN) != 0)
+                    nused++;
+            if (hasZero > 1 || nused + hasZero != set->nvals)
+                elog(ERROR, "invalid FM sketch");
+        }
+    }
+    else if (transval->status == BIG) {
+        size = VARHDRSZ + sizeof(fmtransval) + FMSKETCH_SZ;
+        if (VARSIZE(blob) != size
+            || VARSIZE((bytea *)transval->storage) != FMSKETCH_SZ)
+            elog(ERROR, "invalid FM sketch");
+    }
+    else
+        elog(ERROR, "FM transval neither SMALL nor BIG");
+    if (VARSIZE(blob) != size)
+        elog(ERROR, "invalid FM sketch");
+}
 
-    if (s_in->num_vals >= s_in->capacity)
-        elog(ERROR, "attempt to insert into full sortasort");
+PG_FUNCTION_INFO_V1(__fmsketch_final);
 
-    success = sortasort_try_insert(s_in, dat, transval->typLen);
-    if (success < 0)
-        elog(ERROR, "insufficient directory capacity in sortasort");
+/*!
+ * UDA final function for the fmsketch aggregate: return the sketch itself,
+ * to be stored and combined later
+ */
+Datum __fmsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
 
-    if (success == TRUE) return (transblob);
+    if (VARSIZE(transblob) == VARHDRSZ)
+        /* nothing was ever aggregated! */
+        PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(transblob);
+}
 
-    /* XXX  THIS WHILE LOOP WILL SUCCEED THE FIRST TRY ... REMOVE IT. */
-    while (!success) {
-        /*
-         * else insufficient space
-         * allocate a fmtransval with double-big storage area plus room for v
-         * should work 2nd time around the loop.
-         * we can't use repalloc because it fails trying to free the old transblob
-         */
+PG_FUNCTION_INFO_V1(__fmsketch_union_trans);
 
-        new_storage_sz = s_in->storage_sz*2 + len;
-        /* XXX THIS POINTER ARITHMETIC SHOULD BE HIDDEN BY A MACRO IN THE SORTASORT LIBRARY! */
-        newsize = VARHDRSZ + sizeof(fmtransval) + sizeof(sortasort)
-                  + s_in->capacity*sizeof(s_in->dir[0]) +
-                  new_storage_sz;
-        newblob = (bytea *)palloc(newsize);
-        memcpy(newblob, transblob, VARSIZE(transblob));
-        SET_VARSIZE(newblob, newsize);
-        s_in = (sortasort *)((fmtransval *)VARDATA(newblob))->storage;
-        s_in->storage_sz = new_storage_sz;
-        /*
-         * Can't figure out how to make pfree happy with transblob
-         * pfree(transblob);
-         */
-        transblob = newblob;
-        success = sortasort_try_insert(s_in, dat, transval->typLen);
-    }
-    return(transblob);
+/*!
+ * UDA transition function for fmsketch_union_agg: fold a stored sketch
+ * into the union so far
+ */
+Datum __fmsketch_union_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+    bytea *blob = PG_GETARG_BYTEA_P(1);
+
+    fmsketch_check(blob);
+    PG_RETURN_BYTEA_P(fmsketch_merge_c(transblob, blob));
+}
+
+PG_FUNCTION_INFO_V1(fmsketch_cardinality);
+
+/*! the distinct count of a stored FM sketch */
+Datum fmsketch_cardinality(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    fmsketch_check(blob);
+    PG_RETURN_INT64(fmsketch_count_c(blob));
+}
+
+PG_FUNCTION_INFO_V1(fmsketch_union);
+
+/*! the union of two stored FM sketches */
+Datum fmsketch_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    fmsketch_check(blob1);
+    fmsketch_check(blob2);
+    PG_RETURN_BYTEA_P(fmsketch_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(fmsketch_intersection);
+
+/*!
+ * the number of distinct values common to two stored FM sketches, by
+ * inclusion-exclusion: |A| + |B| - |A union B|.  Exact while the union is
+ * SMALL; otherwise its error is that of the counts, so it is only useful
+ * for overlaps that are not much smaller than the sets.
+ */
+Datum fmsketch_intersection(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+    int64  n;
+
+    fmsketch_check(blob1);
+    fmsketch_check(blob2);
+    n = fmsketch_count_c(blob1) + fmsketch_count_c(blob2)
+        - fmsketch_count_c(fmsketch_merge_c(blob1, blob2));
+    PG_RETURN_INT64(Max(n, 0));
 }
@@ -0,0 +1,610 @@
+/*!
+ * \file hll.c
+ *
+ * \brief HyperLogLog++ distinct-count sketch implementation
+ *
+ * \implementation
+ * A HyperLogLog sketch hashes every value to 64 bits.  The first
+ * <i>precision</i> bits pick one of m = 2^precision registers, and the
+ * register keeps the largest "rank" seen: the position of the first 1 bit in
+ * the remaining bits.  A register that has seen n values holds about
+ * log2(n/m), so the registers together estimate the number of distinct
+ * values with a relative standard error of about 1.04/sqrt(m).  Registers
+ * are 6 bits wide and packed, so the default of 4096 registers takes 3KB.
+ *
+ * Following HLL++, small sets are kept SPARSE: a sorted list of
+ * (index, rank) entries at a much higher precision (HLL_SPARSE_PRECISION),
+ * estimated by linear counting.  This is practically exact for the sizes at
+ * which the list is smaller than the registers.  The list is converted into
+ * registers once it would outgrow them.
+ *
+ * Dense sketches are estimated with Ertl's improved estimator, which
+ * corrects the bias of the raw HyperLogLog estimate over the whole range
+ * analytically rather than with the empirical tables of HLL++.
+ *
+ * Sketches are merged by taking the maximum of each register, so they can
+ * be computed in parallel (Greenplum prefunc), stored, and unioned later.
+ *
+ * See Heule, Nunkesser, Hall: "HyperLogLog in Practice: Algorithmic
+ * Engineering of a State of The Art Cardinality Estimation Algorithm", 2013,
+ * and Ertl: "New cardinality estimation algorithms for HyperLogLog
+ * sketches", 2017.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "hll.h"
+
+#include <math.h>
+
+/*!
+ * \internal
+ * \brief type information for the input column, cached in fn_extra
+ * \endinternal
+ */
+typedef struct {
+    Oid   typOid;
+    int16 typLen;
+    bool  typByVal;
+} hll_typinfo;
+
+static uint32 hll_clz64(uint64);
+static uint32 hll_rank(uint64, uint32);
+static uint32 hll_get_register(const uint8 *, uint32);
+static void   hll_set_register(uint8 *, uint32, uint32);
+static void   hll_dense_add_entry(hllsketch *, uint32);
+static bytea *hll_densify(bytea *);
+static uint32 hll_sparse_find(const uint32 *, uint32, uint32);
+static float8 hll_sigma(float8);
+static float8 hll_tau(float8);
+
+PG_FUNCTION_INFO_V1(__hll_trans);
+
+/*!
+ * UDA transition function for the hll aggregates.
+ * Optional third argument is the precision (only read on the first call).
+ */
+Datum __hll_trans(PG_FUNCTION_ARGS)
+{
+    bytea *      transblob = PG_GETARG_BYTEA_P(0);
+    hll_typinfo *typinfo = (hll_typinfo *)fcinfo->flinfo->fn_extra;
+    uint8        hash[SKETCH_HASHLEN];
+    uint64       h;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* look up the input type once per query, not once per row */
+    if (typinfo == NULL) {
+        typinfo = (hll_typinfo *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                    sizeof(hll_typinfo));
+        typinfo->typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+        if (!OidIsValid(typinfo->typOid))
+            elog(ERROR, "could not determine data type of input");
+        get_typlenbyval(typinfo->typOid, &typinfo->typLen, &typinfo->typByVal);
+        fcinfo->flinfo->fn_extra = typinfo;
+    }
+
+    if (!HLL_INITIALIZED(transblob)) {
+        int32 precision = HLL_DEFAULT_PRECISION;
+
+        if (PG_NARGS() > 2)
+            precision = PG_GETARG_INT32(2);
+        if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+            elog(ERROR, "hll precision must be between %d and %d",
+                 HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+        transblob = hll_init((uint8)precision);
+    }
+
+    sketch_hash_datum(PG_GETARG_DATUM(1), typinfo->typLen, typinfo->typByVal,
+                      SKETCH_HASH_MURMUR3, hash);
+    memcpy(&h, hash, sizeof(uint64));
+
+    PG_RETURN_BYTEA_P(hll_add_hash(transblob, h));
+}
+
+/*!
+ * allocate and initialize an empty sparse HLL sketch
+ * \param precision log2 of the number of registers once dense
+ */
+bytea *hll_init(uint8 precision)
+{
+    uint32     capacity = Min(HLL_SPARSE_INITIAL, HLL_SPARSE_MAX(precision));
+    bytea *    blob = (bytea *)palloc0(HLL_SZ(HLL_SPARSE, precision, capacity));
+    hllsketch *hll;
+
+    SET_VARSIZE(blob, HLL_SZ(HLL_SPARSE, precision, capacity));
+    hll = (hllsketch *)VARDATA(blob);
+    hll->magic = HLL_MAGIC;
+    hll->version = HLL_VERSION;
+    hll->precision = precision;
+    hll->encoding = HLL_SPARSE;
+    hll->capacity = capacity;
+    return(blob);
+}
+
+/*! number of leading zero bits in a nonzero word */
+static uint32 hll_clz64(uint64 w)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(w);
+#else
+    uint32 n = 0;
+
+    while (!(w & UINT64CONST(0x8000000000000000))) {
+        w <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/*!
+ * the rank of a hash: the position of the first 1 bit after the leading
+ * index bits, counting from 1.  All-zero remainders get 64 - bits + 1.
+ * \param h the hash
+ * \param bits the number of leading index bits
+ */
+static uint32 hll_rank(uint64 h, uint32 bits)
+{
+    return hll_clz64((h << bits) | (UINT64CONST(1) << (bits - 1))) + 1;
+}
+
+/*! read register i of packed 6-bit registers */
+static uint32 hll_get_register(const uint8 *regs, uint32 i)
+{
+    uint32 bit = i*HLL_REGISTER_BITS;
+    uint32 word = regs[bit/CHAR_BIT] | (regs[bit/CHAR_BIT + 1] << CHAR_BIT);
+
+    return (word >> (bit % CHAR_BIT)) & ((1U << HLL_REGISTER_BITS) - 1);
+}
+
+/*! write register i of packed 6-bit registers */
+static void hll_set_register(uint8 *regs, uint32 i, uint32 val)
+{
+    uint32 bit = i*HLL_REGISTER_BITS;
+    uint32 shift = bit % CHAR_BIT;
+    uint32 mask = ((1U << HLL_REGISTER_BITS) - 1) << shift;
+    uint32 word = regs[bit/CHAR_BIT] | (regs[bit/CHAR_BIT + 1] << CHAR_BIT);
+
+    word = (word & ~mask) | (val << shift);
+    regs[bit/CHAR_BIT] = word & 0xFF;
+    regs[bit/CHAR_BIT + 1] = word >> CHAR_BIT;
+}
+
+/*!
+ * fold a sparse entry into the registers of a dense sketch.  The entry's
+ * index has HLL_SPARSE_PRECISION - precision bits more than a register
+ * index; if any of them is set, the register's rank is found among them.
+ */
+static void hll_dense_add_entry(hllsketch *hll, uint32 entry)
+{
+    uint32 extra = HLL_SPARSE_PRECISION - hll->precision;
+    uint32 idx = HLL_SPARSE_INDEX(entry);
+    uint32 low = idx & ((1U << extra) - 1);
+    uint32 rank;
+
+    if (low != 0)
+        rank = hll_clz64((uint64)low << (64 - extra)) + 1;
+    else
+        rank = extra + HLL_SPARSE_RHO(entry);
+    idx >>= extra;
+    if (rank > hll_get_register(hll->data, idx))
+        hll_set_register(hll->data, idx, rank);
+}
+
+/*!
+ * return a dense copy of a sparse sketch
+ */
+static bytea *hll_densify(bytea *blob)
+{
+    hllsketch *hll = (hllsketch *)VARDATA(blob);
+    uint32 *   entries = (uint32 *)hll->data;
+    bytea *    newblob = (bytea *)palloc0(HLL_SZ(HLL_DENSE, hll->precision, 0));
+    hllsketch *newhll = (hllsketch *)VARDATA(newblob);
+    uint32     i;
+
+    SET_VARSIZE(newblob, HLL_SZ(HLL_DENSE, hll->precision, 0));
+    *newhll = *hll;
+    newhll->encoding = HLL_DENSE;
+    newhll->nentries = 0;
+    newhll->capacity = 0;
+    for (i = 0; i < hll->nentries; i++)
+        hll_dense_add_entry(newhll, entries[i]);
+    return(newblob);
+}
+
+/*! index of the first entry whose register index is >= idx */
+static uint32 hll_sparse_find(const uint32 *entries, uint32 n, uint32 idx)
+{
+    uint32 lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo)/2;
+
+        if (HLL_SPARSE_INDEX(entries[mid]) < idx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*!
+ * add a hashed value to a sketch
+ * \param blob the sketch, which is updated in place if possible
+ * \param h the 64-bit hash of the value
+ * \returns the sketch, which moves if it had to grow or go dense
+ */
+bytea *hll_add_hash(bytea *blob, uint64 h)
+{
+    hllsketch *hll = (hllsketch *)VARDATA(blob);
+    uint32 *   entries;
+    uint32     idx, rank, i;
+
+    if (hll->encoding == HLL_DENSE) {
+        idx = (uint32)(h >> (64 - hll->precision));
+        rank = hll_rank(h, hll->precision);
+        if (rank > hll_get_register(hll->data, idx))
+            hll_set_register(hll->data, idx, rank);
+        return(blob);
+    }
+
+    idx = (uint32)(h >> (64 - HLL_SPARSE_PRECISION));
+    rank = hll_rank(h, HLL_SPARSE_PRECISION);
+    entries = (uint32 *)hll->data;
+    i = hll_sparse_find(entries, hll->nentries, idx);
+    if (i < hll->nentries && HLL_SPARSE_INDEX(entries[i]) == idx) {
+        if (rank > HLL_SPARSE_RHO(entries[i]))
+            entries[i] = HLL_SPARSE_ENTRY(idx, rank);
+        return(blob);
+    }
+
+    if (hll->nentries == hll->capacity) {
+        uint32     capacity = Min(2*hll->capacity, HLL_SPARSE_MAX(hll->precision));
+        bytea *    newblob;
+        hllsketch *newhll;
+
+        /* no room for another entry: the registers are smaller now */
+        if (hll->capacity >= HLL_SPARSE_MAX(hll->precision))
+            return(hll_add_hash(hll_densify(blob), h));
+
+        /* we can't repalloc because it fails trying to free the old blob */
+        newblob = (bytea *)palloc(HLL_SZ(HLL_SPARSE, hll->precision, capacity));
+        SET_VARSIZE(newblob, HLL_SZ(HLL_SPARSE, hll->precision, capacity));
+        newhll = (hllsketch *)VARDATA(newblob);
+        *newhll = *hll;
+        newhll->capacity = capacity;
+        memcpy(newhll->data, hll->data, hll->nentries*sizeof(uint32));
+        blob = newblob;
+        hll = newhll;
+        entries = (uint32 *)hll->data;
+    }
+
+    memmove(&entries[i+1], &entries[i], (hll->nentries - i)*sizeof(uint32));
+    entries[i] = HLL_SPARSE_ENTRY(idx, rank);
+    hll->nentries++;
+    return(blob);
+}
+
+/*!
+ * the union of two sketches with the same precision, as a new sketch
+ */
+bytea *hll_union_c(bytea *blob1, bytea *blob2)
+{
+    hllsketch *hll1 = (hllsketch *)VARDATA(blob1);
+    hllsketch *hll2 = (hllsketch *)VARDATA(blob2);
+    bytea *    newblob;
+    hllsketch *newhll;
+    uint32     i;
+
+    if (hll1->precision != hll2->precision)
+        elog(ERROR, "cannot merge HLL sketches with different precision");
+
+    if (hll1->encoding == HLL_SPARSE && hll2->encoding == HLL_SPARSE) {
+        uint32 *a = (uint32 *)hll1->data;
+        uint32 *b = (uint32 *)hll2->data;
+        uint32  na = hll1->nentries, nb = hll2->nentries;
+        uint32 *merged = (uint32 *)palloc((na + nb)*sizeof(uint32));
+        uint32  k, n;
+
+        /* merge the sorted entries, keeping the higher rank for an index */
+        for (i = k = n = 0; i < na || k < nb; n++) {
+            if (k == nb || (i < na
+                            && HLL_SPARSE_INDEX(a[i]) < HLL_SPARSE_INDEX(b[k])))
+                merged[n] = a[i++];
+            else if (i == na || HLL_SPARSE_INDEX(b[k]) < HLL_SPARSE_INDEX(a[i]))
+                merged[n] = b[k++];
+            else {
+                merged[n] = Max(a[i], b[k]);
+                i++;
+                k++;
+            }
+        }
+
+        newblob = (bytea *)palloc(HLL_SZ(HLL_SPARSE, hll1->precision, n));
+        SET_VARSIZE(newblob, HLL_SZ(HLL_SPARSE, hll1->precision, n));
+        newhll = (hllsketch *)VARDATA(newblob);
+        *newhll = *hll1;
+        newhll->nentries = newhll->capacity = n;
+        memcpy(newhll->data, merged, n*sizeof(uint32));
+        pfree(merged);
+        if (n > HLL_SPARSE_MAX(hll1->precision))
+            newblob = hll_densify(newblob);
+        return(newblob);
+    }
+
+    /* at least one is dense: start from a dense copy of it */
+    if (hll1->encoding == HLL_SPARSE) {
+        bytea *tmp = blob1;
+
+        blob1 = blob2;
+        blob2 = tmp;
+        hll1 = (hllsketch *)VARDATA(blob1);
+        hll2 = (hllsketch *)VARDATA(blob2);
+    }
+    newblob = (bytea *)palloc(VARSIZE(blob1));
+    memcpy(newblob, blob1, VARSIZE(blob1));
+    newhll = (hllsketch *)VARDATA(newblob);
+
+    if (hll2->encoding == HLL_SPARSE) {
+        for (i = 0; i < hll2->nentries; i++)
+            hll_dense_add_entry(newhll, ((uint32 *)hll2->data)[i]);
+    }
+    else {
+        for (i = 0; i < HLL_REGISTERS(newhll->precision); i++) {
+            uint32 r = hll_get_register(hll2->data, i);
+
+            if (r > hll_get_register(newhll->data, i))
+                hll_set_register(newhll->data, i, r);
+        }
+    }
+    return(newblob);
+}
+
+/*!
+ * return a sparse sketch trimmed to the entries in use, or the sketch
+ * itself if there is nothing to trim
+ */
+bytea *hll_trim(bytea *blob)
+{
+    hllsketch *hll = (hllsketch *)VARDATA(blob);
+    bytea *    newblob;
+    hllsketch *newhll;
+
+    if (hll->encoding == HLL_DENSE || hll->capacity == hll->nentries)
+        return(blob);
+
+    newblob = (bytea *)palloc(HLL_SZ(HLL_SPARSE, hll->precision, hll->nentries));
+    SET_VARSIZE(newblob, HLL_SZ(HLL_SPARSE, hll->precision, hll->nentries));
+    newhll = (hllsketch *)VARDATA(newblob);
+    *newhll = *hll;
+    newhll->capacity = hll->nentries;
+    memcpy(newhll->data, hll->data, hll->nentries*sizeof(uint32));
+    return(newblob);
+}
+
+/*!
+ * make sure a bytea holds a sketch we can read
+ */
+void hll_check(bytea *blob)
+{
+    hllsketch *hll = (hllsketch *)VARDATA(blob);
+
+    if (!HLL_INITIALIZED(blob) || hll->magic != HLL_MAGIC)
+        elog(ERROR, "invalid HLL sketch");
+    if (hll->version != HLL_VERSION)
+        elog(ERROR, "unsupported HLL sketch version %d", hll->version);
+    if (hll->precision < HLL_MIN_PRECISION
+        || hll->precision > HLL_MAX_PRECISION
+        || (hll->encoding != HLL_SPARSE && hll->encoding != HLL_DENSE)
+        || hll->nentries > hll->capacity
+        || VARSIZE(blob) != HLL_SZ(hll->encoding, hll->precision, hll->capacity))
+        elog(ERROR, "invalid HLL sketch");
+    if (hll->encoding == HLL_SPARSE) {
+        /*
+         * hll_dense_add_entry() indexes the registers with the entry's index
+         * and hll_sparse_find() relies on the entries being sorted
+         */
+        uint32 *entries = (uint32 *)hll->data;
+        uint32  i;
+
+        for (i = 0; i < hll->nentries; i++)
+            if (HLL_SPARSE_INDEX(entries[i]) >= (1U << HLL_SPARSE_PRECISION)
+                || HLL_SPARSE_RHO(entries[i]) > 64 - HLL_SPARSE_PRECISION + 1
+                || (i > 0 && HLL_SPARSE_INDEX(entries[i])
+                             <= HLL_SPARSE_INDEX(entries[i-1])))
+                elog(ERROR, "invalid HLL sketch");
+    }
+}
+
+/*! Ertl's sigma(x) = x + sum_k x^(2^k) 2^(k-1) */
+static float8 hll_sigma(float8 x)
+{
+    float8 y = 1, z = x, zprev;
+
+    if (x == 1)
+        return HUGE_VAL;
+    do {
+        x *= x;
+        zprev = z;
+        z += x*y;
+        y += y;
+    } while (z != zprev);
+    return z;
+}
+
+/*! Ertl's tau(x) = (1 - x - sum_k (1 - x^(2^-k))^2 2^-k) / 3 */
+static float8 hll_tau(float8 x)
+{
+    float8 y = 1, z = 1 - x, zprev;
+
+    if (x == 0 || x == 1)
+        return 0;
+    do {
+        x = sqrt(x);
+        zprev = z;
+        y *= 0.5;
+        z -= (1 - x)*(1 - x)*y;
+    } while (z != zprev);
+    return z / 3;
+}
+
+/*!
+ * estimate the number of distinct values added to a sketch.
+ * Sparse sketches use linear counting over their 2^HLL_SPARSE_PRECISION
+ * virtual registers; dense sketches use Ertl's improved estimator over the
+ * histogram of register values.
+ */
+float8 hll_estimate(const hllsketch *hll)
+{
+    float8 m, denom;
+    uint32 q = 64 - hll->precision;
+    uint32 hist[64 + 2];
+    uint32 i;
+
+    if (hll->encoding == HLL_SPARSE) {
+        m = (float8)HLL_REGISTERS(HLL_SPARSE_PRECISION);
+        if (hll->nentries == 0)
+            return 0;
+        return m * log(m / (m - hll->nentries));
+    }
+
+    m = (float8)HLL_REGISTERS(hll->precision);
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < HLL_REGISTERS(hll->precision); i++)
+        hist[hll_get_register(hll->data, i)]++;
+
+    denom = m * hll_tau(1 - hist[q+1] / m);
+    for (i = q; i >= 1; i--)
+        denom = 0.5 * (denom + hist[i]);
+    denom += m * hll_sigma(hist[0] / m);
+    return m * m / (2 * log(2)) / denom;
+}
+
+/*!
+ * Greenplum "prefunc" to combine sketches from multiple machines
+ */
+PG_FUNCTION_INFO_V1(__hll_merge);
+Datum __hll_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    /* make sure they're initialized! */
+    if (!HLL_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    else if (!HLL_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+
+    PG_RETURN_BYTEA_P(hll_union_c(blob1, blob2));
+}
+
+/*!
+ * UDA transition function for hll_union_agg: fold a stored sketch into
+ * the union so far
+ */
+PG_FUNCTION_INFO_V1(__hll_union_trans);
+Datum __hll_union_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+    bytea *blob = PG_GETARG_BYTEA_P(1);
+
+    hll_check(blob);
+    if (!HLL_INITIALIZED(transblob))
+        PG_RETURN_BYTEA_P(blob);
+
+    PG_RETURN_BYTEA_P(hll_union_c(transblob, blob));
+}
+
+/*!
+ * UDA final function for the hll aggregate: return the sketch, trimmed to
+ * the entries in use
+ */
+PG_FUNCTION_INFO_V1(__hll_final);
+Datum __hll_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (!HLL_INITIALIZED(blob))
+        PG_RETURN_NULL();
+
+    PG_RETURN_BYTEA_P(hll_trim(blob));
+}
+
+/*!
+ * UDA final function for the hll_dcount aggregate
+ */
+PG_FUNCTION_INFO_V1(__hll_count_distinct);
+Datum __hll_count_distinct(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (!HLL_INITIALIZED(blob))
+        PG_RETURN_INT64(0);
+
+    PG_RETURN_INT64((int64)rint(hll_estimate((hllsketch *)VARDATA(blob))));
+}
+
+/*!
+ * scalar function: estimated number of distinct values in a stored sketch
+ */
+PG_FUNCTION_INFO_V1(hll_cardinality);
+Datum hll_cardinality(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    hll_check(blob);
+    PG_RETURN_INT64((int64)rint(hll_estimate((hllsketch *)VARDATA(blob))));
+}
+
+/*!
+ * scalar function: the union of two stored sketches
+ */
+PG_FUNCTION_INFO_V1(hll_union);
+Datum hll_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    hll_check(blob1);
+    hll_check(blob2);
+    PG_RETURN_BYTEA_P(hll_trim(hll_union_c(blob1, blob2)));
+}
+
+/*!
+ * the number of distinct values common to two sketches, by
+ * inclusion-exclusion: |A| + |B| - |A union B|.  The error is that of the
+ * three estimates, so it is only useful for overlaps that are not much
+ * smaller than the sets.
+ */
+PG_FUNCTION_INFO_V1(hll_intersection);
+Datum hll_intersection(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+    float8 n;
+
+    hll_check(blob1);
+    hll_check(blob2);
+    n = hll_estimate((hllsketch *)VARDATA(blob1))
+        + hll_estimate((hllsketch *)VARDATA(blob2))
+        - hll_estimate((hllsketch *)VARDATA(hll_union_c(blob1, blob2)));
+    PG_RETURN_INT64((int64)rint(Max(n, 0)));
+}
@@ -0,0 +1,80 @@
+/*!
+ * \file hll.h
+ *
+ * \brief header file for HyperLogLog++ distinct-count sketches
+ */
+
+#ifndef _HLL_H_
+#define _HLL_H_
+
+#define HLL_MAGIC 0x484c4c53 /* "HLLS" */
+#define HLL_VERSION 1
+
+#define HLL_DEFAULT_PRECISION 12 /* 4096 registers: 3KB, ~1.6% error */
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 18
+/*! precision of the indexes kept by sparse sketches */
+#define HLL_SPARSE_PRECISION 25
+#define HLL_SPARSE_INITIAL 16
+#define HLL_REGISTER_BITS 6
+
+typedef enum {HLL_SPARSE, HLL_DENSE} hllencoding;
+
+/*!
+ * \internal
+ * \brief a HyperLogLog++ sketch, as transition value and as stored value
+ *
+ * A SPARSE sketch is a sorted array of uint32 entries, one per distinct
+ * HLL_SPARSE_PRECISION-bit register index seen, each holding the index and
+ * the register value (HLL_SPARSE_ENTRY).  Once the entries would take more
+ * space than the registers, the sketch turns DENSE: 2^precision registers
+ * of HLL_REGISTER_BITS bits each, packed.  A finished sketch has
+ * capacity == nentries.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;       /*! HLL_MAGIC */
+    uint16 version;     /*! HLL_VERSION */
+    uint8  precision;   /*! log2 of the number of dense registers */
+    uint8  encoding;    /*! an hllencoding */
+    uint32 nentries;    /*! sparse entries in use */
+    uint32 capacity;    /*! sparse entries allocated; 0 when dense */
+    uint8  data[0];     /*! sparse entries or packed registers */
+} hllsketch;
+
+#define HLL_REGISTERS(p) (1U << (p))
+/*! bytes of packed registers, plus one so a register can be read as 16 bits */
+#define HLL_DENSE_SZ(p) ((HLL_REGISTERS(p)*HLL_REGISTER_BITS + CHAR_BIT - 1) \
+                         / CHAR_BIT + 1)
+/*! most entries a sparse sketch holds before it goes dense */
+#define HLL_SPARSE_MAX(p) (HLL_DENSE_SZ(p) / sizeof(uint32))
+
+#define HLL_SPARSE_ENTRY(idx, rho) (((uint32)(idx) << HLL_REGISTER_BITS) | (rho))
+#define HLL_SPARSE_INDEX(e) ((e) >> HLL_REGISTER_BITS)
+#define HLL_SPARSE_RHO(e) ((e) & ((1U << HLL_REGISTER_BITS) - 1))
+
+#define HLL_SZ(encoding, p, capacity) \
+    (VARHDRSZ + sizeof(hllsketch) + \
+     (((encoding) == HLL_DENSE) ? HLL_DENSE_SZ(p) : (capacity)*sizeof(uint32)))
+
+#define HLL_INITIALIZED(b) (VARSIZE(b) >= VARHDRSZ + sizeof(hllsketch))
+
+/* HLL protos */
+bytea *hll_init(uint8);
+bytea *hll_add_hash(bytea *, uint64);
+bytea *hll_union_c(bytea *, bytea *);
+bytea *hll_trim(bytea *);
+float8 hll_estimate(const hllsketch *);
+void   hll_check(bytea *);
+
+/* UDF protos */
+Datum __hll_trans(PG_FUNCTION_ARGS);
+Datum __hll_merge(PG_FUNCTION_ARGS);
+Datum __hll_final(PG_FUNCTION_ARGS);
+Datum __hll_count_distinct(PG_FUNCTION_ARGS);
+Datum __hll_union_trans(PG_FUNCTION_ARGS);
+Datum hll_cardinality(PG_FUNCTION_ARGS);
+Datum hll_union(PG_FUNCTION_ARGS);
+Datum hll_intersection(PG_FUNCTION_ARGS);
+
+#endif /* _HLL_H_ */
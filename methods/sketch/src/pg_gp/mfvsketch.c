@@ -58,7 +58,7 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
     mfvtransval *transval;
     uint64       tmpcnt;
     int          i;
-    Datum        md5_datum;
+    uint8        hash[SKETCH_HASHLEN];
 
     /*
      * This function makes destructive updates to its arguments.
@@ -85,14 +85,11 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
 
     transval = (mfvtransval *)VARDATA(transblob);
     /* insert into the countmin sketch */
-    md5_datum = countmin_trans_c(transval->sketch,
-                                newdatum,
-                                transval->outFuncOid,
-                                transval->typOid);
-
-    tmpcnt = cmsketch_count_md5_datum(transval->sketch,
-                                      (bytea *)DatumGetPointer(md5_datum),
-                                      transval->outFuncOid);
+    sketch_hash_datum(newdatum, transval->typLen, transval->typByVal,
+                      transval->hashKind, hash);
+    countmin_trans_c(transval->sketch, hash);
+
+    tmpcnt = cmsketch_count_hash(transval->sketch, hash);
     i = mfv_find(transblob, newdatum);
 
     if (i > -1) {
@@ -182,6 +179,8 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
 
     SET_VARSIZE(transblob, MFV_TRANSVAL_SZ(max_mfvs) + initial_size);
     transval = (mfvtransval *)VARDATA(transblob);
+    transval->magic = MFV_SKETCH_MAGIC;
+    transval->version = MFV_SKETCH_VERSION;
     transval->max_mfvs = max_mfvs;
     transval->next_mfv = 0;
     transval->next_offset = MFV_TRANSVAL_SZ(max_mfvs)-VARHDRSZ;
@@ -191,6 +190,7 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
                       &(typIsVarLen));
     transval->typLen = get_typlen(transval->typOid);
     transval->typByVal = get_typbyval(transval->typOid);
+    transval->hashKind = SKETCH_HASH_DEFAULT;
     if (!transval->outFuncOid) {
         /* no outFunc for this type! */
         elog(ERROR, "no outFunc for type %d", transval->typOid);
@@ -206,18 +206,39 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
 void *mfv_transval_getval(bytea *blob, uint32 i)
 {
     mfvtransval *tvp = (mfvtransval *)VARDATA(blob);
-    void *       retval = (void *)(((char*)tvp) + tvp->mfvs[i].offset);
-    Datum        dat = PointerExtractDatum(retval, tvp->typByVal);
+    uint32       size = VARSIZE(blob) - VARHDRSZ;
+    uint32       offset;
+    uint32       avail;
+    char *       retval;
+    size_t       len;
 
-    if (i > tvp->next_mfv || i < 0)
+    if (i >= tvp->next_mfv)
         elog(ERROR,
              "attempt to get frequent value at illegal index %d in mfv sketch",
              i);
-    if (tvp->mfvs[i].offset > VARSIZE(blob) - VARHDRSZ
-        || tvp->mfvs[i].offset < MFV_TRANSVAL_SZ(tvp->max_mfvs)-VARHDRSZ)
-        elog(ERROR, "illegal offset %u in mfv sketch", tvp->mfvs[i].offset);
-    if (tvp->mfvs[i].offset  + ExtractDatumLen(dat, tvp->typLen, tvp->typByVal)
-        > VARSIZE(blob) - VARHDRSZ)
+    offset = tvp->mfvs[i].offset;
+    if (offset < MFV_TRANSVAL_SZ(tvp->max_mfvs)-VARHDRSZ || offset >= size)
+        elog(ERROR, "illegal offset %u in mfv sketch", offset);
+
+    /* find the length of the value without reading past the sketch */
+    retval = ((char*)tvp) + offset;
+    avail = size - offset;
+    if (tvp->typLen > 0)
+        len = tvp->typLen;
+    else if (tvp->typLen == -1) {
+        if (VARATT_IS_EXTERNAL(retval)
+            || (!VARATT_IS_1B(retval) && avail < VARHDRSZ))
+            elog(ERROR, "illegal value at offset %u in mfv sketch", offset);
+        len = VARSIZE_ANY(retval);
+    }
+    else if (tvp->typLen == -2) {
+        len = strnlen(retval, avail);
+        if (len == avail)
+            elog(ERROR, "value overruns size of mfv sketch");
+    }
+    else
+        elog(ERROR, "illegal type length %d in mfv sketch", tvp->typLen);
+    if (len > avail)
         elog(ERROR, "value overruns size of mfv sketch");
 
     return (retval);
@@ -239,7 +260,8 @@ void mfv_copy_datum(bytea *transblob, int index, Datum dat)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
     size_t       datumLen = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
-    void *       curval = mfv_transval_getval(transblob,index);
+    /* not mfv_transval_getval: the slot may not hold a value yet */
+    void *       curval = (void *)(((char*)transval) + transval->mfvs[index].offset);
 
     memmove(curval, (void *)DatumExtractPointer(dat, transval->typByVal), datumLen);
 }
@@ -347,6 +369,21 @@ PG_FUNCTION_INFO_V1(__mfvsketch_final);
 Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 {
     bytea *      transblob = PG_GETARG_BYTEA_P(0);
+
+    if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0)) PG_RETURN_NULL();
+
+    PG_RETURN_ARRAYTYPE_P(mfvsketch_histogram_c(transblob));
+}
+
+/*!
+ * the histogram of the most frequent values of an mfv sketch, as
+ * {value, count} rows in descending order of count.  Sorts the mfvs of
+ * the sketch in place.
+ * \param transblob a bytea holding an mfv transval
+ */
+ArrayType *mfvsketch_histogram_c(bytea *transblob)
+{
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
     ArrayType *  retval;
     uint32       i;
@@ -362,12 +399,6 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
     Oid          typioparam;
     Oid          typiofunc;
 
-
-    if (PG_ARGISNULL(0)) PG_RETURN_NULL();
-    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0)) PG_RETURN_NULL();
-
-    transval = (mfvtransval *)VARDATA(transblob);
-
     qsort(transval->mfvs, transval->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
     getTypeOutputInfo(INT8OID,
                       &outFuncOid,
@@ -407,7 +438,7 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
                                 -1,
                                 0,
                                 'i');
-    PG_RETURN_ARRAYTYPE_P(retval);
+    return(retval);
 }
 
 
@@ -467,6 +498,12 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
         transval2 = (mfvtransval *)VARDATA(transblob2);
     }
 
+    if (transval1->hashKind != transval2->hashKind)
+        elog(ERROR,
+             "cannot merge MFV sketches built with different hash functions");
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR, "cannot merge MFV sketches of different types");
+
     /* combine sketches */
     for (i = 0; i < DEPTH; i++)
         for (j = 0; j < NUMCOUNTERS; j++)
@@ -479,8 +516,9 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
 
         transval1->mfvs[i].cnt = cmsketch_count_c(transval1->sketch,
                                                   dat,
-                                                  transval1->outFuncOid,
-                                                  transval1->typOid);
+                                                  transval1->typLen,
+                                                  transval1->typByVal,
+                                                  transval1->hashKind);
     }
     for (i = 0; i < transval2->next_mfv; i++) {
         void *tmpp = mfv_transval_getval(transblob2,i);
@@ -488,8 +526,9 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
 
         transval2->mfvs[i].cnt = cmsketch_count_c(transval2->sketch,
                                                   dat,
-                                                  transval2->outFuncOid,
-                                                  transval2->typOid);
+                                                  transval2->typLen,
+                                                  transval2->typByVal,
+                                                  transval2->hashKind);
     }
 
     /* now take maxes on mfvs in a sort-merge style, copying into transval1  */
@@ -519,3 +558,87 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
     }
     return(transblob1);
 }
+
+
+/*!
+ * make sure a bytea holds an MFV sketch returned by the mfvsketch aggregate
+ * \param blob the stored sketch
+ */
+void mfvsketch_check(bytea *blob)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(blob);
+    uint32       i;
+
+    if (VARSIZE(blob) < MFV_TRANSVAL_SZ(0)
+        || transval->magic != MFV_SKETCH_MAGIC)
+        elog(ERROR, "invalid MFV sketch");
+    if (transval->version != MFV_SKETCH_VERSION)
+        elog(ERROR, "unsupported MFV sketch version %d", transval->version);
+    if (transval->next_mfv > transval->max_mfvs
+        || VARSIZE(blob) < MFV_TRANSVAL_SZ(transval->max_mfvs)
+        || transval->next_offset > VARSIZE(blob) - VARHDRSZ
+        || transval->typLen != get_typlen(transval->typOid)
+        || transval->typByVal != get_typbyval(transval->typOid))
+        elog(ERROR, "invalid MFV sketch");
+    /* mfv_transval_getval checks the offsets */
+    for (i = 0; i < transval->next_mfv; i++)
+        (void)mfv_transval_getval(blob, i);
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_sketch_final);
+/*!
+ * UDA final function for the mfvsketch aggregate: return the sketch itself,
+ * to be stored and combined later
+ */
+Datum __mfvsketch_sketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0)) PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(transblob);
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_union_trans);
+/*!
+ * UDA transition function for mfvsketch_union_agg: fold a stored sketch
+ * into the union so far.  mfvsketch_merge_c writes to both of its
+ * arguments, so it gets a copy of the stored one.
+ */
+Datum __mfvsketch_union_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+    bytea *blob = PG_GETARG_BYTEA_P_COPY(1);
+
+    mfvsketch_check(blob);
+    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0))
+        PG_RETURN_BYTEA_P(blob);
+    PG_RETURN_BYTEA_P(mfvsketch_merge_c(transblob, blob));
+}
+
+PG_FUNCTION_INFO_V1(mfvsketch_histogram);
+/*!
+ * the histogram of the most frequent values of a stored MFV sketch
+ */
+Datum mfvsketch_histogram(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P_COPY(0);
+
+    mfvsketch_check(blob);
+    PG_RETURN_ARRAYTYPE_P(mfvsketch_histogram_c(blob));
+}
+
+PG_FUNCTION_INFO_V1(mfvsketch_union);
+/*!
+ * the union of two stored MFV sketches.  Like the Greenplum prefunc, this
+ * keeps the values that are most frequent in the merged CountMin sketch
+ * among those kept by either input.
+ */
+Datum mfvsketch_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P_COPY(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P_COPY(1);
+
+    mfvsketch_check(blob1);
+    mfvsketch_check(blob2);
+    PG_RETURN_BYTEA_P(mfvsketch_merge_c(blob1, blob2));
+}
@@ -278,46 +278,142 @@ bit_print(uint8 *c, int numbytes)
     elog(NOTICE, "bitmap: %s", p);
 }
 
+/*! 64-bit rotate left, for murmur3 */
+static inline uint64 rotl64(uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
 /*!
- * Run the datum through an md5 hash.  No need to special-case variable-length types,
- * we'll just hash their length header too.
- * The POSTGRES code for md5 returns a bytea with a textual representation of the
- * md5 result.  We then convert it back into binary.
- * \param dat a Postgres Datum
- * \param typOid Postgres type Oid
- * \returns a bytea containing the hashed bytes
+ * murmur3 finalization mix: forces all bits of a 64-bit block to avalanche.
+ * It is a bijection, so distinct inputs always get distinct outputs.
  */
-bytea *sketch_md5_bytea(Datum dat, Oid typOid)
+uint64 sketch_fmix64(uint64 k)
 {
-    // according to postgres' libpq/md5.c, need 33 bytes to hold 
-    // null-terminated md5 string
-    char outbuf[MD5_HASHLEN*2+1];
-    bytea *out = palloc0(MD5_HASHLEN+VARHDRSZ);    
-    bool byval = get_typbyval(typOid);
-    int len = ExtractDatumLen(dat, get_typlen(typOid), byval);
-    void *datp = DatumExtractPointer(dat, byval);
-    /* 
-     * it's very common to be hashing 0 for countmin sketches.  Rather than 
-     * hard-code it here, we cache on first lookup.  In future a bigger cache here
-     * would be nice.
-     */
-    static bool zero_cached = false;
-    static char md5_of_0_mem[MD5_HASHLEN+VARHDRSZ];
-    static bytea *md5_of_0 = (bytea *) &md5_of_0_mem;
-        
-    if (byval && len == sizeof(int64) && *(int64 *)datp == 0 && zero_cached) {
-        return md5_of_0;
+    k ^= k >> 33;
+    k *= UINT64CONST(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+/*!
+ * Austin Appleby's MurmurHash3, x64 128-bit variant, with seed 0.
+ * Blocks are read in native byte order as in the reference
+ * implementation, so results match it on little-endian machines.
+ * \param key the bytes to hash
+ * \param len the number of bytes
+ * \param out SKETCH_HASHLEN bytes to hold the result: h1 followed by h2
+ */
+static void murmur3_x64_128(const void *key, size_t len, uint8 *out)
+{
+    const uint8 *data = (const uint8 *)key;
+    const uint8 *tail;
+    size_t       nblocks = len / 16;
+    size_t       i;
+    uint64       h1 = 0, h2 = 0;
+    uint64       k1, k2;
+    const uint64 c1 = UINT64CONST(0x87c37b91114253d5);
+    const uint64 c2 = UINT64CONST(0x4cf5ad432745937f);
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + i*16, sizeof(uint64));
+        memcpy(&k2, data + i*16 + 8, sizeof(uint64));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
     }
-    else
-        pg_md5_hash(datp, len, outbuf);        
-    
-    hex_to_bytes(outbuf, (uint8 *)VARDATA(out), MD5_HASHLEN*2);
-    SET_VARSIZE(out, MD5_HASHLEN+VARHDRSZ);
-    if (byval && len == sizeof(int64) && *(int64 *)datp == 0 && !zero_cached) {
-        zero_cached = true;
-        memcpy(md5_of_0, out, MD5_HASHLEN+VARHDRSZ);
+
+    tail = data + nblocks*16;
+    k1 = k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= ((uint64)tail[14]) << 48;
+        case 14: k2 ^= ((uint64)tail[13]) << 40;
+        case 13: k2 ^= ((uint64)tail[12]) << 32;
+        case 12: k2 ^= ((uint64)tail[11]) << 24;
+        case 11: k2 ^= ((uint64)tail[10]) << 16;
+        case 10: k2 ^= ((uint64)tail[9]) << 8;
+        case  9: k2 ^= ((uint64)tail[8]);
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        case  8: k1 ^= ((uint64)tail[7]) << 56;
+        case  7: k1 ^= ((uint64)tail[6]) << 48;
+        case  6: k1 ^= ((uint64)tail[5]) << 40;
+        case  5: k1 ^= ((uint64)tail[4]) << 32;
+        case  4: k1 ^= ((uint64)tail[3]) << 24;
+        case  3: k1 ^= ((uint64)tail[2]) << 16;
+        case  2: k1 ^= ((uint64)tail[1]) << 8;
+        case  1: k1 ^= ((uint64)tail[0]);
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
     }
-    return out;
+
+    h1 ^= (uint64)len;
+    h2 ^= (uint64)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = sketch_fmix64(h1);
+    h2 = sketch_fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    memcpy(out, &h1, sizeof(uint64));
+    memcpy(out + sizeof(uint64), &h2, sizeof(uint64));
+}
+
+/*!
+ * Hash a run of bytes with the given hash kind, writing the SKETCH_HASHLEN
+ * bytes of binary output into out.  No memory is allocated, so callers can
+ * hash into a buffer on the stack.
+ * \param data the bytes to hash
+ * \param len the number of bytes
+ * \param hashkind a sketch_hash_kind
+ * \param out SKETCH_HASHLEN bytes to hold the result
+ */
+void sketch_hash_bytes(const void *data, size_t len, int hashkind, uint8 *out)
+{
+    /*
+     * according to postgres' libpq/md5.c, need 33 bytes to hold
+     * null-terminated md5 string
+     */
+    char md5buf[MD5_HASHLEN*2+1];
+
+    switch (hashkind) {
+        case SKETCH_HASH_MURMUR3:
+            murmur3_x64_128(data, len, out);
+            break;
+        case SKETCH_HASH_MD5:
+            /*
+             * the postgres md5 routine only provides text output, so convert
+             * it back into binary.  Only sketches built before the hash kind
+             * was recorded still take this path.
+             */
+            pg_md5_hash(data, len, md5buf);
+            hex_to_bytes(md5buf, out, MD5_HASHLEN*2);
+            break;
+        default:
+            elog(ERROR, "unknown sketch hash kind %d", hashkind);
+    }
+}
+
+/*!
+ * Run the datum through a sketch hash.  No need to special-case variable-length types,
+ * we'll just hash their length header too.
+ * \param dat a Postgres Datum
+ * \param typLen the typlen of dat's type
+ * \param typByVal whether dat's type is passed by value
+ * \param hashkind a sketch_hash_kind
+ * \param out SKETCH_HASHLEN bytes to hold the result
+ */
+void sketch_hash_datum(Datum dat, int16 typLen, bool typByVal, int hashkind,
+                       uint8 *out)
+{
+    size_t len = ExtractDatumLen(dat, typLen, typByVal);
+    void  *datp = DatumExtractPointer(dat, typByVal);
+
+    sketch_hash_bytes(datp, len, hashkind, out);
 }
 
 
@@ -328,6 +424,8 @@ PG_FUNCTION_INFO_V1(sketch_rightmost_one);
 Datum sketch_rightmost_one(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(sketch_leftmost_zero);
 Datum sketch_leftmost_zero(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(sketch_hash);
+Datum sketch_hash(PG_FUNCTION_ARGS);
 
 Datum sketch_rightmost_one(PG_FUNCTION_ARGS)
 {
@@ -351,6 +449,18 @@ Datum sketch_leftmost_zero(PG_FUNCTION_ARGS)
     return leftmost_zero((uint8 *)bits, len, sketchsz, sketchnum);
 }
 
+Datum sketch_hash(PG_FUNCTION_ARGS)
+{
+    bytea *data = PG_GETARG_BYTEA_P(0);
+    int4   hashkind = PG_GETARG_INT32(1);
+    bytea *out = (bytea *)palloc(SKETCH_HASHLEN + VARHDRSZ);
+
+    sketch_hash_bytes(VARDATA(data), VARSIZE(data) - VARHDRSZ, hashkind,
+                      (uint8 *)VARDATA(out));
+    SET_VARSIZE(out, SKETCH_HASHLEN + VARHDRSZ);
+    PG_RETURN_BYTEA_P(out);
+}
+
 Datum sketch_array_set_bit_in_place(PG_FUNCTION_ARGS)
 {
 
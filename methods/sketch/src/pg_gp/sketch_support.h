@@ -9,6 +9,22 @@
 #define MD5_HASHLEN 16
 #define MD5_HASHLEN_BITS 8*MD5_HASHLEN /*! md5 hash length in bits */
 
+/*!
+ * hash functions available to sketches.  Each sketch records the kind it
+ * was built with, so the values here are part of the on-disk format:
+ * never renumber them.  Zero is md5, which is what sketches built before
+ * the kind was recorded used.
+ */
+typedef enum {
+    SKETCH_HASH_MD5 = 0,        /*! md5, via the Postgres hex routine */
+    SKETCH_HASH_MURMUR3 = 1,    /*! MurmurHash3 x64_128, seed 0 */
+    SKETCH_HASH_CM_DYADIC = 2   /*! cmsketch only: int8 mixes salted by dyadic level */
+} sketch_hash_kind;
+
+#define SKETCH_HASH_DEFAULT SKETCH_HASH_MURMUR3
+#define SKETCH_HASHLEN 16 /*! all sketch hashes are 128 bits */
+#define SKETCH_HASHLEN_BITS 8*SKETCH_HASHLEN
+
 #ifndef MAXINT8LEN
 #define MAXINT8LEN              25 /*! number of chars to hold an int8 */
 #endif
@@ -20,7 +36,9 @@ uint32 ui_rightmost_one(uint32 v);
 void   hex_to_bytes(char *hex, uint8 *bytes, size_t);
 void bit_print(uint8 *c, int numbytes);
 Datum md5_cstring(char *);
-bytea *sketch_md5_bytea(Datum, Oid);
+uint64 sketch_fmix64(uint64);
+void   sketch_hash_bytes(const void *, size_t, int, uint8 *);
+void   sketch_hash_datum(Datum, int16, bool, int, uint8 *);
 int4   safe_log2(int64);
 void   int64_big_endianize(uint64 *, uint32, bool);
 
@@ -0,0 +1,683 @@
+/*!
+ * \file spacesaving.c
+ *
+ * \brief Space-Saving sketch for most frequent values
+ *
+ * \implementation
+ * Space-Saving monitors a fixed number of values (ncounters), each with a
+ * count.  A value that is already monitored gets its count incremented.  A
+ * new value takes a free counter if there is one; otherwise it replaces the
+ * value with the smallest count, inheriting that count (plus one) and
+ * remembering it as its error.  Every monitored value's true frequency lies
+ * between count - error and count, no error exceeds N/ncounters for N values
+ * counted, and any value more frequent than N/ncounters is monitored.
+ *
+ * Counters are kept in a Stream-Summary: counters with equal counts share a
+ * bucket, and the buckets form a list ordered by count.  Incrementing a
+ * counter moves it to the next bucket or bumps its own, and the smallest
+ * count is always the head of the list, so no update looks at more than a
+ * couple of counters.  Monitored values are found through an open-addressing
+ * hash table on their hashes.  All of this lives in one flat bytea, linked
+ * by indexes rather than pointers.
+ *
+ * Sketches from different segments are merged as described by Agarwal et
+ * al.: a value missing from a full sketch is credited with that sketch's
+ * smallest count (which bounds how often it could have been seen there), the
+ * counts and errors are summed, and the ncounters largest are kept.  The
+ * bounds above hold for merged sketches too.
+ *
+ * See Metwally, Agrawal, El Abbadi: "Efficient Computation of Frequent and
+ * Top-k Elements in Data Streams", ICDT 2005, and Agarwal et al.: "Mergeable
+ * Summaries", PODS 2012.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "nodes/execnodes.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "spacesaving.h"
+
+/*!
+ * \internal
+ * \brief a candidate counter during merges and output
+ * \endinternal
+ */
+typedef struct {
+    uint64      count;
+    uint64      error;
+    sstransval *src;
+    uint32      idx;
+} sscandidate;
+
+static void   ss_slot_insert(sstransval *, uint32);
+static void   ss_slot_delete(sstransval *, uint32);
+static uint32 ss_bucket_alloc(sstransval *, uint64, uint32, uint32);
+static void   ss_bucket_free(sstransval *, uint32);
+static void   ss_attach(sstransval *, uint32, uint32);
+static void   ss_detach(sstransval *, uint32);
+static void   ss_increment(sstransval *, uint32);
+static bytea *ss_store_value(bytea *, uint32, const void *, uint32);
+static int    ss_candidate_cmp_desc(const void *, const void *);
+
+#define SS_TRANSVAL(b) ((sstransval *)VARDATA(b))
+
+PG_FUNCTION_INFO_V1(__spacesaving_trans);
+
+/*!
+ * UDA transition function for the spacesaving_top_histogram aggregates.
+ * The third argument is the number of values to report, the optional
+ * fourth the number of counters.
+ */
+Datum __spacesaving_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+    Datum  newdatum = PG_GETARG_DATUM(1);
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* initialize if this is first call */
+    if (!SS_TRANSVAL_INITIALIZED(transblob)) {
+        int32 nresults = PG_GETARG_INT32(2);
+        int64 ncounters = (int64)nresults * SS_COUNTERS_PER_RESULT;
+        Oid   typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+        if (PG_NARGS() > 3)
+            ncounters = PG_GETARG_INT32(3);
+        else if (ncounters > SS_MAX_COUNTERS)
+            ncounters = Max(nresults, SS_MAX_COUNTERS);
+        if (nresults < 1)
+            elog(ERROR, "number of values to report must be positive");
+        if (ncounters < nresults || ncounters > SS_MAX_COUNTERS)
+            elog(ERROR,
+                 "number of counters must be between %d and %d",
+                 nresults, SS_MAX_COUNTERS);
+        if (!OidIsValid(typOid))
+            elog(ERROR, "could not determine data type of input");
+        transblob = ss_init_transval(typOid, (uint32)ncounters,
+                                     (uint32)nresults, 0);
+    }
+
+    PG_RETURN_BYTEA_P(ss_add(transblob, newdatum));
+}
+
+/*!
+ * Allocate an empty Space-Saving sketch
+ * \param typOid the type ID for the column
+ * \param ncounters the number of values to monitor
+ * \param nresults the number of values to report
+ * \param valbytes the bytes to reserve for values, or 0 for a guess
+ */
+bytea *ss_init_transval(Oid typOid, uint32 ncounters, uint32 nresults,
+                        uint32 valbytes)
+{
+    bytea *     transblob;
+    sstransval *transval;
+    sstransval  hdr;
+    ssbucket *  buckets;
+    bool        typIsVarLen;
+    uint32      i;
+
+    hdr.ncounters = ncounters;
+    for (hdr.nslots = 4; hdr.nslots < 2*ncounters; hdr.nslots <<= 1) ;
+
+    hdr.typOid = typOid;
+    get_typlenbyval(typOid, &hdr.typLen, &hdr.typByVal);
+    getTypeOutputInfo(typOid, &hdr.outFuncOid, &typIsVarLen);
+    if (!hdr.outFuncOid) {
+        /* no outFunc for this type! */
+        elog(ERROR, "no outFunc for type %d", typOid);
+    }
+    if (valbytes == 0)
+        valbytes = ncounters * ((hdr.typLen > 0) ? hdr.typLen
+                                : SS_DEFAULT_VALUE_LEN);
+
+    transblob = (bytea *)palloc0(VARHDRSZ + SS_VALUES_START(&hdr) + valbytes);
+    SET_VARSIZE(transblob, VARHDRSZ + SS_VALUES_START(&hdr) + valbytes);
+    transval = SS_TRANSVAL(transblob);
+    memcpy(transval, &hdr, sizeof(sstransval));
+    transval->nused = 0;
+    transval->nresults = nresults;
+    transval->minBucket = SS_NIL;
+    transval->hashKind = SKETCH_HASH_DEFAULT;
+    transval->total = 0;
+    transval->valuesEnd = SS_VALUES_START(transval);
+
+    /* all buckets start out on the free list */
+    buckets = SS_BUCKETS(transval);
+    for (i = 0; i < ncounters; i++)
+        buckets[i].next = i + 1;
+    buckets[ncounters - 1].next = SS_NIL;
+    transval->freeBucket = 0;
+
+    return(transblob);
+}
+
+/*!
+ * Count one occurrence of a value
+ * \param transblob the transition value packed into a bytea
+ * \param dat the value
+ */
+bytea *ss_add(bytea *transblob, Datum dat)
+{
+    sstransval *transval = SS_TRANSVAL(transblob);
+    sscounter * counters;
+    void *      valp;
+    uint8       hash[SKETCH_HASHLEN];
+    uint64      h;
+    uint32      len;
+    uint32      c;
+
+    /* values are compared by their bytes, so compare them untoasted */
+    if (transval->typLen == -1)
+        dat = PointerGetDatum(PG_DETOAST_DATUM(dat));
+    sketch_hash_datum(dat, transval->typLen, transval->typByVal,
+                      transval->hashKind, hash);
+    memcpy(&h, hash, sizeof(uint64));
+    valp = DatumExtractPointer(dat, transval->typByVal);
+    len = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
+    if (transval->typLen == -2)
+        /* keep the terminating NUL of cstrings */
+        len++;
+    transval->total++;
+
+    c = ss_find(transval, h, valp, len);
+    if (c != SS_NIL) {
+        ss_increment(transval, c);
+        return(transblob);
+    }
+
+    if (transval->nused < transval->ncounters) {
+        /* take a free counter, counting from 0 */
+        c = transval->nused++;
+        SS_COUNTERS(transval)[c].error = 0;
+        SS_COUNTERS(transval)[c].valCap = 0;
+        if (transval->minBucket == SS_NIL
+            || SS_BUCKETS(transval)[transval->minBucket].count != 0)
+            ss_bucket_alloc(transval, 0, SS_NIL, transval->minBucket);
+        ss_attach(transval, c, transval->minBucket);
+    }
+    else {
+        /* replace a value with the smallest count */
+        c = SS_BUCKETS(transval)[transval->minBucket].first;
+        ss_slot_delete(transval, c);
+        SS_COUNTERS(transval)[c].error =
+            SS_BUCKETS(transval)[transval->minBucket].count;
+    }
+    transblob = ss_store_value(transblob, c, valp, len);
+    transval = SS_TRANSVAL(transblob);
+    counters = SS_COUNTERS(transval);
+    counters[c].hash = h;
+    ss_slot_insert(transval, c);
+    ss_increment(transval, c);
+
+    return(transblob);
+}
+
+/*!
+ * look to see if the sketch is monitoring a value
+ * \param transval the sketch
+ * \param h the value's hash
+ * \param valp the value's bytes
+ * \param len the number of bytes
+ * \returns the index of the value's counter, or SS_NIL
+ */
+uint32 ss_find(sstransval *transval, uint64 h, const void *valp, uint32 len)
+{
+    uint32 *   slots = SS_SLOTS(transval);
+    sscounter *counters = SS_COUNTERS(transval);
+    uint32     mask = transval->nslots - 1;
+    uint32     i;
+
+    for (i = h & mask; slots[i] != 0; i = (i + 1) & mask) {
+        sscounter *cp = &counters[slots[i] - 1];
+
+        if (cp->hash == h && cp->valLen == len
+            && !memcmp(SS_VALUE(transval, slots[i] - 1), valp, len))
+            return(slots[i] - 1);
+    }
+    return(SS_NIL);
+}
+
+static void ss_slot_insert(sstransval *transval, uint32 c)
+{
+    uint32 *slots = SS_SLOTS(transval);
+    uint32  mask = transval->nslots - 1;
+    uint32  i;
+
+    for (i = SS_COUNTERS(transval)[c].hash & mask; slots[i] != 0;
+         i = (i + 1) & mask) ;
+    slots[i] = c + 1;
+}
+
+/*!
+ * Remove counter c from the hash table, shifting later entries of the
+ * probe sequence back so that no tombstones are needed
+ */
+static void ss_slot_delete(sstransval *transval, uint32 c)
+{
+    uint32 *   slots = SS_SLOTS(transval);
+    sscounter *counters = SS_COUNTERS(transval);
+    uint32     mask = transval->nslots - 1;
+    uint32     i, j, home;
+
+    for (i = counters[c].hash & mask; slots[i] != c + 1; i = (i + 1) & mask) ;
+
+    for (j = (i + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+        home = counters[slots[j] - 1].hash & mask;
+        /* leave the entry alone if its home lies in (i, j] */
+        if ((i < j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i] = 0;
+}
+
+/*!
+ * Take a bucket off the free list and link it in between prev and next
+ * \returns the bucket's index
+ */
+static uint32 ss_bucket_alloc(sstransval *transval, uint64 count,
+                              uint32 prev, uint32 next)
+{
+    ssbucket *buckets = SS_BUCKETS(transval);
+    uint32    b = transval->freeBucket;
+
+    if (b == SS_NIL)
+        elog(ERROR, "out of buckets in space-saving sketch");
+    transval->freeBucket = buckets[b].next;
+
+    buckets[b].count = count;
+    buckets[b].first = SS_NIL;
+    buckets[b].prev = prev;
+    buckets[b].next = next;
+    if (prev != SS_NIL)
+        buckets[prev].next = b;
+    else
+        transval->minBucket = b;
+    if (next != SS_NIL)
+        buckets[next].prev = b;
+    return(b);
+}
+
+static void ss_bucket_free(sstransval *transval, uint32 b)
+{
+    ssbucket *buckets = SS_BUCKETS(transval);
+
+    if (buckets[b].prev != SS_NIL)
+        buckets[buckets[b].prev].next = buckets[b].next;
+    else
+        transval->minBucket = buckets[b].next;
+    if (buckets[b].next != SS_NIL)
+        buckets[buckets[b].next].prev = buckets[b].prev;
+
+    buckets[b].next = transval->freeBucket;
+    transval->freeBucket = b;
+}
+
+static void ss_attach(sstransval *transval, uint32 c, uint32 b)
+{
+    sscounter *counters = SS_COUNTERS(transval);
+    ssbucket * buckets = SS_BUCKETS(transval);
+
+    counters[c].bucket = b;
+    counters[c].prev = SS_NIL;
+    counters[c].next = buckets[b].first;
+    if (buckets[b].first != SS_NIL)
+        counters[buckets[b].first].prev = c;
+    buckets[b].first = c;
+}
+
+static void ss_detach(sstransval *transval, uint32 c)
+{
+    sscounter *counters = SS_COUNTERS(transval);
+
+    if (counters[c].prev != SS_NIL)
+        counters[counters[c].prev].next = counters[c].next;
+    else
+        SS_BUCKETS(transval)[counters[c].bucket].first = counters[c].next;
+    if (counters[c].next != SS_NIL)
+        counters[counters[c].next].prev = counters[c].prev;
+}
+
+/*!
+ * Add one to a counter, keeping the buckets in order
+ */
+static void ss_increment(sstransval *transval, uint32 c)
+{
+    sscounter *counters = SS_COUNTERS(transval);
+    ssbucket * buckets = SS_BUCKETS(transval);
+    uint32     b = counters[c].bucket;
+    uint64     count = buckets[b].count + 1;
+    uint32     nb = buckets[b].next;
+
+    if (nb != SS_NIL && buckets[nb].count == count) {
+        /* join the next bucket */
+        ss_detach(transval, c);
+        if (buckets[b].first == SS_NIL)
+            ss_bucket_free(transval, b);
+        ss_attach(transval, c, nb);
+    }
+    else if (buckets[b].first == c && counters[c].next == SS_NIL)
+        /* alone in its bucket, which stays in order */
+        buckets[b].count = count;
+    else {
+        ss_detach(transval, c);
+        ss_attach(transval, c, ss_bucket_alloc(transval, count, b, nb));
+    }
+}
+
+/*!
+ * Copy a value into the storage of counter c.  The old storage is reused if
+ * the value fits; otherwise the value is appended, compacting and growing
+ * the value area when it is full.
+ * \param transblob the transition value packed into a bytea
+ * \param c the counter
+ * \param valp the value's bytes
+ * \param len the number of bytes
+ */
+static bytea *ss_store_value(bytea *transblob, uint32 c, const void *valp,
+                             uint32 len)
+{
+    sstransval *transval = SS_TRANSVAL(transblob);
+    sscounter * counters = SS_COUNTERS(transval);
+
+    if (counters[c].valCap < len) {
+        uint32 end = VARSIZE(transblob) - VARHDRSZ;
+
+        if (transval->valuesEnd + len > end) {
+            /*
+             * Out of room: pack the live values together, leaving out the
+             * garbage of replaced ones.  If that would leave less than half
+             * of the value area free, pack them into a new blob twice the
+             * size they need instead.  We can't repalloc because it fails
+             * trying to free the old transblob.
+             */
+            bytea *     newblob = transblob;
+            sstransval *newval;
+            sscounter * newcounters;
+            char *      oldvals = (char *)transval;
+            uint32      start = SS_VALUES_START(transval);
+            uint64      live = 0;
+            uint64      area = end - start;
+            uint32      i;
+
+            for (i = 0; i < transval->nused; i++)
+                if (i != c)
+                    live += counters[i].valLen;
+            if (2*(live + len) > area) {
+                area = 2*(live + len);
+                if (start + area > MaxAllocSize - VARHDRSZ)
+                    elog(ERROR, "space-saving sketch values exceed %lu bytes",
+                         (unsigned long)MaxAllocSize);
+                newblob = (bytea *)palloc(VARHDRSZ + start + area);
+                SET_VARSIZE(newblob, VARHDRSZ + start + area);
+                memcpy(VARDATA(newblob), transval, start);
+            }
+            else {
+                /* pack in place, from a copy of the values */
+                oldvals = (char *)palloc(transval->valuesEnd - start) - start;
+                memcpy(oldvals + start, (char *)transval + start,
+                       transval->valuesEnd - start);
+            }
+            newval = SS_TRANSVAL(newblob);
+            newcounters = SS_COUNTERS(newval);
+            newval->valuesEnd = start;
+            for (i = 0; i < newval->nused; i++) {
+                if (i == c)
+                    continue;
+                memcpy((char *)newval + newval->valuesEnd,
+                       oldvals + counters[i].valOffset, counters[i].valLen);
+                newcounters[i].valOffset = newval->valuesEnd;
+                newcounters[i].valCap = counters[i].valLen;
+                newval->valuesEnd += counters[i].valLen;
+            }
+            if (newblob == transblob)
+                pfree(oldvals + start);
+            transblob = newblob;
+            transval = newval;
+            counters = newcounters;
+        }
+        counters[c].valOffset = transval->valuesEnd;
+        counters[c].valCap = len;
+        transval->valuesEnd += len;
+    }
+    memcpy(SS_VALUE(transval, c), valp, len);
+    counters[c].valLen = len;
+
+    return(transblob);
+}
+
+/*!
+ * Greenplum "prefunc" to combine sketches from multiple machines
+ */
+PG_FUNCTION_INFO_V1(__spacesaving_merge);
+Datum __spacesaving_merge(PG_FUNCTION_ARGS)
+{
+    bytea *transblob1 = PG_GETARG_BYTEA_P(0);
+    bytea *transblob2 = PG_GETARG_BYTEA_P(1);
+
+    PG_RETURN_BYTEA_P(ss_merge_c(transblob1, transblob2));
+}
+
+static int ss_candidate_cmp_desc(const void *i, const void *j)
+{
+    const sscandidate *o = (const sscandidate *)i;
+    const sscandidate *p = (const sscandidate *)j;
+
+    if (o->count != p->count)
+        return (o->count < p->count) ? 1 : -1;
+    /* prefer the smaller error among equal counts */
+    if (o->error != p->error)
+        return (o->error > p->error) ? 1 : -1;
+    return 0;
+}
+
+/*!
+ * Merge two Space-Saving sketches into a new one.  A value monitored by
+ * only one of them is credited with the smallest count of the other if
+ * that one is full, since it can't have been seen there more often.
+ * \param transblob1 a Space-Saving transval stored inside a bytea
+ * \param transblob2 another Space-Saving transval in a bytea
+ */
+bytea *ss_merge_c(bytea *transblob1, bytea *transblob2)
+{
+    sstransval * t1, *t2, *t;
+    sscandidate *cands;
+    bool *       matched;
+    bytea *      transblob;
+    uint64       min1 = 0, min2 = 0;
+    uint64       valbytes = 0;
+    uint32       ncands = 0, nkeep;
+    uint32       i, j, last;
+
+    /* handle uninitialized args */
+    if (!SS_TRANSVAL_INITIALIZED(transblob2))
+        return(transblob1);
+    else if (!SS_TRANSVAL_INITIALIZED(transblob1))
+        return(transblob2);
+
+    t1 = SS_TRANSVAL(transblob1);
+    t2 = SS_TRANSVAL(transblob2);
+    if (t1->ncounters != t2->ncounters)
+        elog(ERROR,
+             "cannot merge space-saving sketches with %u and %u counters",
+             t1->ncounters, t2->ncounters);
+    if (t1->typOid != t2->typOid)
+        elog(ERROR,
+             "cannot merge space-saving sketches of different types");
+    if (t1->hashKind != t2->hashKind)
+        elog(ERROR,
+             "cannot merge space-saving sketches built with different hash functions");
+
+    if (t1->nused == t1->ncounters)
+        min1 = SS_BUCKETS(t1)[t1->minBucket].count;
+    if (t2->nused == t2->ncounters)
+        min2 = SS_BUCKETS(t2)[t2->minBucket].count;
+
+    cands = (sscandidate *)palloc((t1->nused + t2->nused)*sizeof(sscandidate));
+    matched = (bool *)palloc0(Max(t2->nused, 1)*sizeof(bool));
+
+    for (i = 0; i < t1->nused; i++) {
+        sscounter *cp = &SS_COUNTERS(t1)[i];
+
+        cands[ncands].count = SS_COUNT(t1, i);
+        cands[ncands].error = cp->error;
+        cands[ncands].src = t1;
+        cands[ncands].idx = i;
+        j = ss_find(t2, cp->hash, SS_VALUE(t1, i), cp->valLen);
+        if (j != SS_NIL) {
+            matched[j] = true;
+            cands[ncands].count += SS_COUNT(t2, j);
+            cands[ncands].error += SS_COUNTERS(t2)[j].error;
+        }
+        else {
+            cands[ncands].count += min2;
+            cands[ncands].error += min2;
+        }
+        ncands++;
+    }
+    for (j = 0; j < t2->nused; j++) {
+        if (matched[j])
+            continue;
+        cands[ncands].count = SS_COUNT(t2, j) + min1;
+        cands[ncands].error = SS_COUNTERS(t2)[j].error + min1;
+        cands[ncands].src = t2;
+        cands[ncands].idx = j;
+        ncands++;
+    }
+
+    /* keep the largest counts */
+    qsort(cands, ncands, sizeof(sscandidate), ss_candidate_cmp_desc);
+    nkeep = Min(ncands, t1->ncounters);
+    for (i = 0; i < nkeep; i++)
+        valbytes += SS_COUNTERS(cands[i].src)[cands[i].idx].valLen;
+    if (valbytes > MaxAllocSize / 2)
+        elog(ERROR, "space-saving sketch values exceed %lu bytes",
+             (unsigned long)MaxAllocSize / 2);
+
+    transblob = ss_init_transval(t1->typOid, t1->ncounters,
+                                 Max(t1->nresults, t2->nresults),
+                                 Max((uint32)valbytes, 1));
+    t = SS_TRANSVAL(transblob);
+    t->hashKind = t1->hashKind;
+    t->total = t1->total + t2->total;
+
+    /* rebuild in ascending order of count, so buckets are appended */
+    last = SS_NIL;
+    for (i = nkeep; i-- > 0; ) {
+        sstransval *src = cands[i].src;
+        sscounter * cp = &SS_COUNTERS(src)[cands[i].idx];
+        uint32      c = t->nused++;
+
+        SS_COUNTERS(t)[c].hash = cp->hash;
+        SS_COUNTERS(t)[c].error = cands[i].error;
+        SS_COUNTERS(t)[c].valCap = 0;
+        transblob = ss_store_value(transblob, c, SS_VALUE(src, cands[i].idx),
+                                   cp->valLen);
+        t = SS_TRANSVAL(transblob);
+        ss_slot_insert(t, c);
+        if (last == SS_NIL || SS_BUCKETS(t)[last].count != cands[i].count)
+            last = ss_bucket_alloc(t, cands[i].count, last, SS_NIL);
+        ss_attach(t, c, last);
+    }
+
+    pfree(cands);
+    pfree(matched);
+    return(transblob);
+}
+
+PG_FUNCTION_INFO_V1(__spacesaving_final);
+/*!
+ * UDA final function returning a histogram of the most frequent values,
+ * as rows of {value, count, error}.  The true frequency of each value lies
+ * between count - error and count.
+ */
+Datum __spacesaving_final(PG_FUNCTION_ARGS)
+{
+    bytea *      transblob = PG_GETARG_BYTEA_P(0);
+    sstransval * transval;
+    sscandidate *cands;
+    Datum *      histo;
+    ArrayType *  retval;
+    Oid          outFuncOid;
+    bool         typIsVarlena;
+    int          dims[2], lbs[2];
+    uint32       i, nout;
+
+    if (!SS_TRANSVAL_INITIALIZED(transblob)) PG_RETURN_NULL();
+    transval = SS_TRANSVAL(transblob);
+    if (transval->nused == 0) PG_RETURN_NULL();
+
+    cands = (sscandidate *)palloc(transval->nused*sizeof(sscandidate));
+    for (i = 0; i < transval->nused; i++) {
+        cands[i].count = SS_COUNT(transval, i);
+        cands[i].error = SS_COUNTERS(transval)[i].error;
+        cands[i].idx = i;
+    }
+    qsort(cands, transval->nused, sizeof(sscandidate), ss_candidate_cmp_desc);
+    nout = Min(transval->nused, transval->nresults);
+
+    getTypeOutputInfo(INT8OID, &outFuncOid, &typIsVarlena);
+    histo = (Datum *)palloc(nout*3*sizeof(Datum));
+    for (i = 0; i < nout; i++) {
+        sscounter *cp = &SS_COUNTERS(transval)[cands[i].idx];
+        Datum      curval = 0;
+        char *     valbuf, *countbuf, *errbuf;
+        void *     tmpp = NULL;
+
+        if (transval->typByVal)
+            memcpy(&curval, SS_VALUE(transval, cands[i].idx), cp->valLen);
+        else {
+            /* copy out, so that the output function sees an aligned value */
+            tmpp = palloc(cp->valLen);
+            memcpy(tmpp, SS_VALUE(transval, cands[i].idx), cp->valLen);
+            curval = PointerGetDatum(tmpp);
+        }
+        valbuf = OidOutputFunctionCall(transval->outFuncOid, curval);
+        countbuf = OidOutputFunctionCall(outFuncOid,
+                                         Int64GetDatum(cands[i].count));
+        errbuf = OidOutputFunctionCall(outFuncOid,
+                                       Int64GetDatum(cands[i].error));
+
+        histo[3*i] = PointerGetDatum(cstring_to_text(valbuf));
+        histo[3*i + 1] = PointerGetDatum(cstring_to_text(countbuf));
+        histo[3*i + 2] = PointerGetDatum(cstring_to_text(errbuf));
+        pfree(valbuf);
+        pfree(countbuf);
+        pfree(errbuf);
+        if (tmpp)
+            pfree(tmpp);
+    }
+
+    dims[0] = nout;
+    dims[1] = 3;
+    lbs[0] = lbs[1] = 0;
+    retval = construct_md_array(histo,
+                                NULL,
+                                2,
+                                dims,
+                                lbs,
+                                TEXTOID,
+                                -1,
+                                false,
+                                'i');
+    PG_RETURN_ARRAYTYPE_P(retval);
+}
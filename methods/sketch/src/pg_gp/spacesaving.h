@@ -0,0 +1,101 @@
+/*!
+ * \file spacesaving.h
+ *
+ * \brief header file for Space-Saving top-k sketches
+ */
+
+#ifndef _SPACESAVING_H_
+#define _SPACESAVING_H_
+
+#define SS_NIL 0xFFFFFFFF           /* end of a list */
+#define SS_MAX_COUNTERS (1 << 20)
+#define SS_COUNTERS_PER_RESULT 10   /* default ncounters / nresults */
+#define SS_DEFAULT_VALUE_LEN 16     /* value bytes to reserve for varlena types */
+
+/*!
+ * \internal
+ * \brief a monitored value
+ *
+ * Its count is that of its bucket.  The true frequency of the value lies
+ * between count - error and count.
+ * \endinternal
+ */
+typedef struct {
+    uint64 error;      /*! the count the value inherited when it was admitted */
+    uint64 hash;       /*! 64 bits of the value's hash */
+    uint32 bucket;     /*! index of the bucket holding the count */
+    uint32 prev;       /*! previous counter in the bucket, or SS_NIL */
+    uint32 next;       /*! next counter in the bucket, or SS_NIL */
+    uint32 valOffset;  /*! offset of the value's bytes from the sstransval */
+    uint32 valLen;     /*! bytes of the value */
+    uint32 valCap;     /*! bytes reserved at valOffset */
+} sscounter;
+
+/*!
+ * \internal
+ * \brief a group of counters with the same count (Stream-Summary)
+ *
+ * Buckets in use form a list in ascending order of count.  Unused buckets
+ * form a free list through next.
+ * \endinternal
+ */
+typedef struct {
+    uint64 count;
+    uint32 first;      /*! first counter with this count */
+    uint32 prev;       /*! bucket with the next smaller count, or SS_NIL */
+    uint32 next;       /*! bucket with the next larger count, or SS_NIL */
+    uint32 pad;
+} ssbucket;
+
+/*!
+ * \internal
+ * \brief the transition value struct for Space-Saving sketches
+ *
+ * A flat, relocatable Stream-Summary: everything is addressed by index or
+ * offset.  The struct is followed by ncounters counters, ncounters buckets,
+ * a hash table of nslots slots (counter index + 1, or 0 when empty) with
+ * linear probing, and the bytes of the values.
+ * \endinternal
+ */
+typedef struct {
+    uint32 ncounters;     /*! number of counters (values monitored) */
+    uint32 nused;         /*! counters in use */
+    uint32 nresults;      /*! number of values to report */
+    uint32 nslots;        /*! hash slots: a power of 2, at least 2*ncounters */
+    uint32 minBucket;     /*! bucket with the smallest count, or SS_NIL */
+    uint32 freeBucket;    /*! first unused bucket, or SS_NIL */
+    uint32 valuesEnd;     /*! offset of the end of the value bytes in use */
+    Oid    typOid;        /*! Oid of the type being counted */
+    Oid    outFuncOid;    /*! Oid of the outfunc for this type */
+    int16  typLen;        /*! length of the data type */
+    bool   typByVal;      /*! whether the type is passed by value */
+    uint8  hashKind;      /*! sketch_hash_kind of the counter hashes */
+    uint64 total;         /*! number of values counted */
+} sstransval;
+
+#define SS_COUNTERS(t) \
+    ((sscounter *)((char *)(t) + MAXALIGN(sizeof(sstransval))))
+#define SS_BUCKETS(t) ((ssbucket *)(SS_COUNTERS(t) + (t)->ncounters))
+#define SS_SLOTS(t) ((uint32 *)(SS_BUCKETS(t) + (t)->ncounters))
+/*! offset of the value bytes from the sstransval */
+#define SS_VALUES_START(t) \
+    (MAXALIGN(sizeof(sstransval)) \
+     + (t)->ncounters*(sizeof(sscounter) + sizeof(ssbucket)) \
+     + (t)->nslots*sizeof(uint32))
+#define SS_VALUE(t, c) ((char *)(t) + SS_COUNTERS(t)[c].valOffset)
+#define SS_COUNT(t, c) (SS_BUCKETS(t)[SS_COUNTERS(t)[c].bucket].count)
+
+#define SS_TRANSVAL_INITIALIZED(b) (VARSIZE(b) >= VARHDRSZ + sizeof(sstransval))
+
+/* Space-Saving protos */
+bytea *ss_init_transval(Oid, uint32, uint32, uint32);
+bytea *ss_add(bytea *, Datum);
+bytea *ss_merge_c(bytea *, bytea *);
+uint32 ss_find(sstransval *, uint64, const void *, uint32);
+
+/* UDF protos */
+Datum __spacesaving_trans(PG_FUNCTION_ARGS);
+Datum __spacesaving_merge(PG_FUNCTION_ARGS);
+Datum __spacesaving_final(PG_FUNCTION_ARGS);
+
+#endif /* _SPACESAVING_H_ */
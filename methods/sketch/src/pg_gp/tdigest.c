@@ -0,0 +1,433 @@
+/*!
+ * \file tdigest.c
+ *
+ * \brief t-digest quantile sketch implementation
+ *
+ * \implementation
+ * A t-digest summarizes a set of numbers by a sorted list of centroids
+ * (mean, weight), each standing in for a cluster of neighboring values.
+ * The clusters are small near the extremes (quantiles 0 and 1) and large
+ * around the median, which gives accurate tail quantiles in little space.
+ * Cluster sizes are limited by the scale function
+ * k(q) = delta/(2 pi) * asin(2q - 1): a cluster may span at most one unit
+ * of k.  Hence a digest never has more than delta + 1 centroids, no matter
+ * how many values it summarizes.
+ *
+ * We use the "merging" variant: incoming values are appended to a buffer.
+ * When the buffer is full, buffer and centroids are sorted together and
+ * merged in a single left-to-right pass.  Two digests are combined by
+ * the same pass over the union of their centroids, so the sketch is
+ * mergeable and can be computed in parallel (Greenplum prefunc).
+ *
+ * Quantiles are answered by interpolating linearly between the centers of
+ * neighboring centroids, and between the outer centroids and the exact
+ * minimum and maximum.
+ *
+ * See Dunning, Ertl: "Computing Extremely Accurate Quantiles Using
+ * t-Digests", 2019.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "tdigest.h"
+
+#include <math.h>
+
+/* Greenplum (PostgreSQL 8.2) always passes float8 by reference */
+#ifndef FLOAT8PASSBYVAL
+#define FLOAT8PASSBYVAL false
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static float8 tdigest_weight_limit(float8, float8);
+static bytea *tdigest_compressed(bytea *);
+
+PG_FUNCTION_INFO_V1(__tdsketch_trans);
+
+/*!
+ * UDA transition function for the tdsketch aggregate.
+ * Optional third argument is the compression (only read on the first call).
+ */
+Datum __tdsketch_trans(PG_FUNCTION_ARGS)
+{
+    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+    float8      val = PG_GETARG_FLOAT8(1);
+    tdtransval *transval;
+
+    /*
+     * This function makes destructive updates to its arguments.
+     * Make sure it's being called in an agg context.
+     */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (isnan(val) || isinf(val))
+        elog(ERROR, "tdsketch does not support NaN or infinite values");
+
+    if (!TD_TRANSVAL_INITIALIZED(transblob)) {
+        float8 compression = TD_DEFAULT_COMPRESSION;
+
+        if (PG_NARGS() > 2)
+            compression = PG_GETARG_INT32(2);
+        transblob = tdigest_init_transval(compression);
+    }
+    transval = (tdtransval *)VARDATA(transblob);
+
+    if (transval->num_buffered == transval->buffer_capacity)
+        tdigest_compress(transval, NULL, 0);
+
+    TD_BUFFER(transval)[transval->num_buffered++] = val;
+    if (transval->count == 0 || val < transval->min)
+        transval->min = val;
+    if (transval->count == 0 || val > transval->max)
+        transval->max = val;
+    transval->count += 1;
+
+    PG_RETURN_BYTEA_P(transblob);
+}
+
+/*!
+ * allocate and initialize an empty t-digest
+ * \param compression the compression parameter delta
+ */
+bytea *tdigest_init_transval(float8 compression)
+{
+    uint32      ncentroids, nbuffered;
+    bytea *     transblob;
+    tdtransval *transval;
+
+    if (compression < TD_MIN_COMPRESSION || compression > TD_MAX_COMPRESSION)
+        elog(ERROR, "tdsketch compression must be between %d and %d",
+             TD_MIN_COMPRESSION, TD_MAX_COMPRESSION);
+
+    ncentroids = (uint32)ceil(compression) + 2;
+    nbuffered = (uint32)(TD_BUFFER_FACTOR * compression);
+
+    /* allocate and zero out a transval via palloc0 */
+    transblob = (bytea *)palloc0(TD_TRANSVAL_SZ(ncentroids, nbuffered));
+    SET_VARSIZE(transblob, TD_TRANSVAL_SZ(ncentroids, nbuffered));
+
+    transval = (tdtransval *)VARDATA(transblob);
+    transval->compression = compression;
+    transval->centroid_capacity = ncentroids;
+    transval->buffer_capacity = nbuffered;
+    return(transblob);
+}
+
+/*!
+ * copy a t-digest into a blob with the given capacities
+ * \param blob the t-digest
+ * \param ncentroids centroid capacity of the copy, at least the number of
+ * centroids in use
+ * \param nbuffered buffer capacity of the copy, at least the number of
+ * values in the buffer
+ */
+bytea *tdigest_copy(bytea *blob, uint32 ncentroids, uint32 nbuffered)
+{
+    tdtransval *transval = (tdtransval *)VARDATA(blob);
+    bytea *     newblob;
+    tdtransval *newtrans;
+
+    if (ncentroids < transval->num_centroids
+        || nbuffered < transval->num_buffered)
+        elog(ERROR, "tdsketch error: copy is too small");
+
+    newblob = (bytea *)palloc(TD_TRANSVAL_SZ(ncentroids, nbuffered));
+    SET_VARSIZE(newblob, TD_TRANSVAL_SZ(ncentroids, nbuffered));
+    newtrans = (tdtransval *)VARDATA(newblob);
+    *newtrans = *transval;
+    newtrans->centroid_capacity = ncentroids;
+    newtrans->buffer_capacity = nbuffered;
+    memcpy(newtrans->centroids, transval->centroids,
+           transval->num_centroids*sizeof(tdcentroid));
+    memcpy(TD_BUFFER(newtrans), TD_BUFFER(transval),
+           transval->num_buffered*sizeof(float8));
+    return(newblob);
+}
+
+/*!
+ * the largest cumulative weight (as a fraction of the total) that a
+ * cluster starting at fraction q0 may reach, i.e., k^{-1}(k(q0) + 1)
+ * \param q0 fraction of the total weight to the left of the cluster
+ * \param compression the compression parameter delta
+ */
+static float8 tdigest_weight_limit(float8 q0, float8 compression)
+{
+    float8 k = compression / (2*M_PI) * asin(2*q0 - 1) + 1;
+
+    if (k >= compression / 4)
+        return 1.0;
+    return (sin(k * 2*M_PI / compression) + 1) / 2;
+}
+
+/*!
+ * merge the buffer, and optionally additional centroids, into the
+ * centroids of a t-digest.  The caller is responsible for accounting for
+ * the weight of the additional centroids in count, min, and max.
+ * \param transval the t-digest
+ * \param extra additional centroids (may be NULL)
+ * \param nextra number of additional centroids
+ */
+void tdigest_compress(tdtransval *transval, tdcentroid *extra, uint32 nextra)
+{
+    uint32      n = transval->num_centroids + transval->num_buffered + nextra;
+    tdcentroid *all;
+    tdcentroid *out = transval->centroids;
+    tdcentroid  cur;
+    float8     *buffer = TD_BUFFER(transval);
+    float8      total = 0, wsofar = 0, wlimit;
+    uint32      i, nout = 0;
+
+    if (n == transval->num_centroids)
+        return;
+
+    all = (tdcentroid *)palloc(n*sizeof(tdcentroid));
+    memcpy(all, transval->centroids,
+           transval->num_centroids*sizeof(tdcentroid));
+    for (i = 0; i < transval->num_buffered; i++) {
+        all[transval->num_centroids + i].mean = buffer[i];
+        all[transval->num_centroids + i].weight = 1;
+    }
+    if (nextra > 0)
+        memcpy(all + transval->num_centroids + transval->num_buffered,
+               extra, nextra*sizeof(tdcentroid));
+    qsort(all, n, sizeof(tdcentroid), tdcentroid_cmp);
+
+    for (i = 0; i < n; i++)
+        total += all[i].weight;
+
+    cur = all[0];
+    wlimit = total * tdigest_weight_limit(0, transval->compression);
+    for (i = 1; i < n; i++) {
+        /*
+         * merge into the current cluster if it stays within one unit of k.
+         * The last free slot is reserved for the current cluster, so we
+         * never overflow even in the face of rounding.
+         */
+        if (wsofar + cur.weight + all[i].weight <= wlimit
+            || nout + 1 == transval->centroid_capacity) {
+            cur.weight += all[i].weight;
+            cur.mean += (all[i].mean - cur.mean) * all[i].weight / cur.weight;
+        }
+        else {
+            wsofar += cur.weight;
+            out[nout++] = cur;
+            cur = all[i];
+            wlimit = total * tdigest_weight_limit(wsofar / total,
+                                                  transval->compression);
+        }
+    }
+    out[nout++] = cur;
+
+    transval->num_centroids = nout;
+    transval->num_buffered = 0;
+    pfree(all);
+}
+
+/*!
+ * comparison function for qsort of centroids by mean
+ */
+int tdcentroid_cmp(const void *i, const void *j)
+{
+    float8 a = ((const tdcentroid *)i)->mean;
+    float8 b = ((const tdcentroid *)j)->mean;
+
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+/*!
+ * Greenplum "prefunc" to combine t-digests from multiple machines
+ */
+PG_FUNCTION_INFO_V1(__tdsketch_merge);
+Datum __tdsketch_merge(PG_FUNCTION_ARGS)
+{
+    bytea *     blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *     blob2 = PG_GETARG_BYTEA_P(1);
+    tdtransval *transval1 = (tdtransval *)VARDATA(blob1);
+    tdtransval *transval2 = (tdtransval *)VARDATA(blob2);
+    tdtransval *newtrans;
+    tdcentroid *extra;
+    float8 *    buffer2 = TD_BUFFER(transval2);
+    bytea *     newblob;
+    uint32      i, nextra;
+
+    /* make sure they're initialized! */
+    if (!TD_TRANSVAL_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    else if (!TD_TRANSVAL_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+
+    if (transval1->compression != transval2->compression)
+        elog(ERROR, "cannot merge t-digests with different compression");
+
+    /* allocate a new transval as a copy of blob1 */
+    newblob = tdigest_copy(blob1, transval1->centroid_capacity,
+                           transval1->buffer_capacity);
+    newtrans = (tdtransval *)VARDATA(newblob);
+
+    /* add in the centroids and buffered values of blob2 */
+    nextra = transval2->num_centroids + transval2->num_buffered;
+    extra = (tdcentroid *)palloc(nextra*sizeof(tdcentroid));
+    memcpy(extra, transval2->centroids,
+           transval2->num_centroids*sizeof(tdcentroid));
+    for (i = 0; i < transval2->num_buffered; i++) {
+        extra[transval2->num_centroids + i].mean = buffer2[i];
+        extra[transval2->num_centroids + i].weight = 1;
+    }
+    tdigest_compress(newtrans, extra, nextra);
+    pfree(extra);
+
+    if (transval2->count > 0) {
+        if (newtrans->count == 0 || transval2->min < newtrans->min)
+            newtrans->min = transval2->min;
+        if (newtrans->count == 0 || transval2->max > newtrans->max)
+            newtrans->max = transval2->max;
+        newtrans->count += transval2->count;
+    }
+
+    PG_RETURN_BYTEA_P(newblob);
+}
+
+/*!
+ * return a compressed copy of a t-digest without a buffer,
+ * or the t-digest itself if it is compressed already
+ */
+static bytea *tdigest_compressed(bytea *blob)
+{
+    tdtransval *transval = (tdtransval *)VARDATA(blob);
+    bytea *     newblob;
+
+    if (transval->buffer_capacity == 0)
+        return blob;
+
+    newblob = tdigest_copy(blob, transval->centroid_capacity,
+                           transval->buffer_capacity);
+    tdigest_compress((tdtransval *)VARDATA(newblob), NULL, 0);
+    return tdigest_copy(newblob,
+                        ((tdtransval *)VARDATA(newblob))->num_centroids, 0);
+}
+
+/*!
+ * UDA final function for the tdsketch aggregate: return the finished
+ * t-digest, trimmed to the centroids in use
+ */
+PG_FUNCTION_INFO_V1(__tdsketch_final);
+Datum __tdsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (!TD_TRANSVAL_INITIALIZED(blob))
+        PG_RETURN_NULL();
+
+    PG_RETURN_BYTEA_P(tdigest_compressed(blob));
+}
+
+/*!
+ * approximate the q-quantile of the values summarized by a compressed
+ * t-digest
+ * \param transval a compressed t-digest with at least one value
+ * \param q the quantile, between 0 and 1
+ */
+float8 tdigest_quantile_c(tdtransval *transval, float8 q)
+{
+    tdcentroid *c = transval->centroids;
+    uint32      n = transval->num_centroids;
+    float8      target = q * transval->count;
+    float8      cum, dw;
+    uint32      i;
+
+    if (target <= 0)
+        return transval->min;
+
+    /* left of the center of the first centroid */
+    if (target < c[0].weight / 2)
+        return transval->min
+               + (c[0].mean - transval->min) * target / (c[0].weight / 2);
+
+    /* between the centers of two centroids */
+    cum = c[0].weight / 2;
+    for (i = 0; i < n - 1; i++) {
+        dw = (c[i].weight + c[i+1].weight) / 2;
+        if (target <= cum + dw)
+            return c[i].mean + (c[i+1].mean - c[i].mean) * (target - cum) / dw;
+        cum += dw;
+    }
+
+    /* right of the center of the last centroid */
+    if (target >= transval->count)
+        return transval->max;
+    return c[n-1].mean
+           + (transval->max - c[n-1].mean) * (target - cum) / (c[n-1].weight / 2);
+}
+
+/*!
+ * scalar function: approximate quantile from a t-digest
+ */
+PG_FUNCTION_INFO_V1(tdsketch_quantile);
+Datum tdsketch_quantile(PG_FUNCTION_ARGS)
+{
+    bytea *     blob = PG_GETARG_BYTEA_P(0);
+    float8      q = PG_GETARG_FLOAT8(1);
+    tdtransval *transval;
+
+    if (!TD_TRANSVAL_INITIALIZED(blob))
+        elog(ERROR, "invalid t-digest");
+    if (!(q >= 0 && q <= 1))
+        elog(ERROR, "quantile must be between 0 and 1");
+
+    transval = (tdtransval *)VARDATA(tdigest_compressed(blob));
+    if (transval->count == 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(tdigest_quantile_c(transval, q));
+}
+
+/*!
+ * scalar function: approximate many quantiles from a t-digest at once
+ */
+PG_FUNCTION_INFO_V1(tdsketch_quantiles);
+Datum tdsketch_quantiles(PG_FUNCTION_ARGS)
+{
+    bytea *     blob = PG_GETARG_BYTEA_P(0);
+    ArrayType * qarray = PG_GETARG_ARRAYTYPE_P(1);
+    tdtransval *transval;
+    Datum *     qs;
+    bool *      nulls;
+    int         nqs, i;
+
+    if (!TD_TRANSVAL_INITIALIZED(blob))
+        elog(ERROR, "invalid t-digest");
+    if (ARR_ELEMTYPE(qarray) != FLOAT8OID)
+        elog(ERROR, "quantiles must be of type float8[]");
+
+    transval = (tdtransval *)VARDATA(tdigest_compressed(blob));
+    if (transval->count == 0)
+        PG_RETURN_NULL();
+
+    deconstruct_array(qarray, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL,
+                      'd', &qs, &nulls, &nqs);
+    for (i = 0; i < nqs; i++) {
+        float8 q = DatumGetFloat8(qs[i]);
+
+        if (nulls[i] || !(q >= 0 && q <= 1))
+            elog(ERROR, "quantiles must be between 0 and 1");
+        qs[i] = Float8GetDatum(tdigest_quantile_c(transval, q));
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(qs, nqs, FLOAT8OID, sizeof(float8),
+                                          FLOAT8PASSBYVAL, 'd'));
+}
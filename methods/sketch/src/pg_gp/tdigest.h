@@ -0,0 +1,77 @@
+/*!
+ * \file tdigest.h
+ *
+ * \brief header file for t-digest quantile sketches
+ */
+
+#ifndef _TDIGEST_H_
+#define _TDIGEST_H_
+
+#define TD_DEFAULT_COMPRESSION 100 /* magic tuning value: ~1% error at the median */
+#define TD_MIN_COMPRESSION 10
+#define TD_MAX_COMPRESSION 10000
+#define TD_BUFFER_FACTOR 5 /* values buffered per unit of compression */
+
+/*!
+ * \internal
+ * \brief a centroid of a t-digest: the mean of a cluster of values
+ * and the number of values in it
+ * \endinternal
+ */
+typedef struct {
+    float8 mean;
+    float8 weight;
+} tdcentroid;
+
+/*!
+ * \internal
+ * \brief the transition value struct for t-digests
+ *
+ * Holds the sorted centroids, followed by a buffer of values that have
+ * not been merged into the centroids yet.  When the buffer fills up,
+ * buffer and centroids are sorted together and merged in a single pass
+ * (see tdigest_compress).  A finished digest has an empty buffer of
+ * capacity 0.
+ * \endinternal
+ */
+typedef struct {
+    float8 compression;         /*! the compression parameter delta */
+    float8 count;               /*! total weight, including the buffer */
+    float8 min;                 /*! smallest value seen */
+    float8 max;                 /*! largest value seen */
+    uint32 num_centroids;       /*! number of centroids in use */
+    uint32 centroid_capacity;   /*! max number of centroids */
+    uint32 num_buffered;        /*! number of values in the buffer */
+    uint32 buffer_capacity;     /*! max number of buffered values */
+    /*!
+     * centroid_capacity centroids, followed by buffer_capacity float8
+     * buffered values
+     */
+    tdcentroid centroids[0];
+} tdtransval;
+
+/*! the buffer of unmerged values */
+#define TD_BUFFER(t) ((float8 *)&((t)->centroids[(t)->centroid_capacity]))
+
+/*! size of a tdtransval blob with the given capacities */
+#define TD_TRANSVAL_SZ(ncentroids, nbuffered) \
+    (VARHDRSZ + sizeof(tdtransval) + (ncentroids)*sizeof(tdcentroid) + \
+     (nbuffered)*sizeof(float8))
+
+#define TD_TRANSVAL_INITIALIZED(b) (VARSIZE(b) >= TD_TRANSVAL_SZ(0, 0))
+
+/* t-digest protos */
+bytea *tdigest_init_transval(float8);
+bytea *tdigest_copy(bytea *, uint32, uint32);
+void   tdigest_compress(tdtransval *, tdcentroid *, uint32);
+float8 tdigest_quantile_c(tdtransval *, float8);
+int    tdcentroid_cmp(const void *, const void *);
+
+/* UDF protos */
+Datum __tdsketch_trans(PG_FUNCTION_ARGS);
+Datum __tdsketch_merge(PG_FUNCTION_ARGS);
+Datum __tdsketch_final(PG_FUNCTION_ARGS);
+Datum tdsketch_quantile(PG_FUNCTION_ARGS);
+Datum tdsketch_quantiles(PG_FUNCTION_ARGS);
+
+#endif /* _TDIGEST_H_ */
@@ -340,11 +340,16 @@ double *sdata_to_float8arr(SparseData sdata) {
 
 	iptr = sdata->index->data;
 	aptr = 0;
-	for (int i=0; i<sdata->unique_value_count; i++) {
-		for (j=0;j<compword_to_int8(iptr);j++,aptr++) {
-			array[aptr] = ((double *)(sdata->vals->data))[i];
+	for (int i=0; i<sdata->unique_value_count; i+=RUN_LENGTH_BLOCK) {
+		double run_lengths[RUN_LENGTH_BLOCK];
+		int num = Min(RUN_LENGTH_BLOCK,sdata->unique_value_count-i);
+		decode_run_lengths(&iptr,run_lengths,num);
+		for (int k=0; k<num; k++) {
+			double val = ((double *)(sdata->vals->data))[i+k];
+			for (j=0;j<run_lengths[k];j++,aptr++) {
+				array[aptr] = val;
+			}
 		}
-		iptr+=int8compstoragesize(iptr);
 	}
 
 	if ((aptr) != sdata->total_value_count) 
@@ -425,15 +430,89 @@ void printSparseData(SparseData sdata) {
 	}
 }
 
+/**
+ * @param sdata A SparseData
+ * @param stride The number of runs between two entries of the skip index
+ * @return A skip index for sdata, or NULL if sdata is stored uncompressed
+ * (in which case elements can be accessed directly)
+ */
+SkipIndex makeSkipIndex(SparseData sdata, int stride) {
+	SkipIndex skip;
+	char * ix = sdata->index->data;
+	int read = 0;
+
+	if (ix == NULL)
+		return NULL;
+
+	skip = (SkipIndex)palloc(sizeof(SkipIndexData));
+	skip->stride = stride;
+	skip->num_entries = (sdata->unique_value_count + stride - 1) / stride;
+	skip->positions = (int *)palloc(sizeof(int)*Max(skip->num_entries,1));
+	skip->offsets = (int *)palloc(sizeof(int)*Max(skip->num_entries,1));
+	for (int i=0; i<sdata->unique_value_count; i++) {
+		if (i % stride == 0) {
+			skip->positions[i / stride] = read;
+			skip->offsets[i / stride] = ix - sdata->index->data;
+		}
+		read += compword_to_int8(ix);
+		ix += int8compstoragesize(ix);
+	}
+	return skip;
+}
+
+void freeSkipIndex(SkipIndex skip) {
+	if (skip == NULL) return;
+	pfree(skip->positions);
+	pfree(skip->offsets);
+	pfree(skip);
+}
+
+/**
+ * @param sdata A SparseData
+ * @param skip A skip index for sdata, or NULL
+ * @param idx The index of an element, counting from one
+ * @param ix Is set to the location of the count of the run that contains 
+ * the element
+ * @param read Is set to the number of elements up to the end of that run
+ * @return The number of the run that contains the element, counting from zero
+ */
+static int find_run(SparseData sdata, SkipIndex skip, int idx,
+		    char **ix, int *read) {
+	int i = 0;
+
+	*ix = sdata->index->data;
+	*read = 0;
+	if (skip != NULL && skip->num_entries > 0) {
+		/* binary search for the last entry whose run starts before idx */
+		int lo = 0, hi = skip->num_entries - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (skip->positions[mid] < idx) lo = mid;
+			else hi = mid - 1;
+		}
+		i = lo * skip->stride;
+		*ix += skip->offsets[lo];
+		*read = skip->positions[lo];
+	}
+
+	*read += compword_to_int8(*ix);
+	while (*read < idx) {
+		*ix += int8compstoragesize(*ix);
+		*read += compword_to_int8(*ix);
+		i++;
+	}
+	return i;
+}
+
 /**
  * @param sdata The SparseData to be projected on
+ * @param skip A skip index for sdata, or NULL
  * @param idx The index to be projected
  * @return The element of a SparseData at location idx. 
  */
-double sd_proj(SparseData sdata, int idx) {
-	char * ix = sdata->index->data;
+double sd_proj(SparseData sdata, SkipIndex skip, int idx) {
+	char * ix;
 	double * vals = (double *)sdata->vals->data;
-	float8 ret;
 	int read, i;
 
 	/* error checking */
@@ -442,31 +521,30 @@ double sd_proj(SparseData sdata, int idx) {
 			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 			 errmsg("Index out of bounds.")));
 
+	/* uncompressed storage */
+	if (sdata->index->data == NULL)
+		return vals[idx-1];
+
 	/* find desired block; as is normal in SQL, we start counting from one */
-	read = compword_to_int8(ix);
-	i = 0;
-	while (read < idx) {
-		ix += int8compstoragesize(ix);
-		read += compword_to_int8(ix);
-		i++;
-	}
+	i = find_run(sdata, skip, idx, &ix, &read);
 	return vals[i];
 }
 
 /**
  * @param sdata The SparseData from which to extract a subarray
+ * @param skip A skip index for sdata, or NULL
  * @param start The start index of the desired subarray
  * @param end The end index of the desired subarray
  * @return The sub-array, indexed by start and end, of a SparseData. 
  */
-SparseData subarr(SparseData sdata, int start, int end) {
-	char * ix = sdata->index->data;
+SparseData subarr(SparseData sdata, SkipIndex skip, int start, int end) {
+	char * ix;
 	double * vals = (double *)sdata->vals->data;
 	SparseData ret = makeSparseData();
 	size_t wf8 = sizeof(float8);
 	
 	if (start > end) 
-		return reverse(subarr(sdata,end,start));
+		return reverse(subarr(sdata,skip,end,start));
 
 	/* error checking */
 	if (0 >= start || start > end || end > sdata->total_value_count)
@@ -475,13 +553,8 @@ SparseData subarr(SparseData sdata, int start, int end) {
 			 errmsg("Array index out of bounds.")));
 
 	/* find start block */
-	int read = compword_to_int8(ix);
-	int i = 0;
-	while (read < start) {
-		ix += int8compstoragesize(ix);
-		read += compword_to_int8(ix);
-		i++;
-	}
+	int read;
+	int i = find_run(sdata, skip, start, &ix, &read);
 	if (end <= read) {
 		/* the whole subarray is in the first block, we are done */
 		add_run_to_sdata((char *)(&vals[i]), end-start+1, wf8, ret);
@@ -54,6 +54,32 @@ typedef struct
  */
 typedef SparseDataStruct *SparseData;
 
+/*!
+ * \internal
+ * A skip index speeds up random access to a SparseData: For every
+ * stride-th run, it records the number of elements preceding the run and
+ * the location of the run's count in the RLE index. A lookup then needs a
+ * binary search and a scan over at most stride runs, instead of a scan
+ * over all runs. Skip indexes are in-memory structures; they are not part
+ * of the serialized format.
+ * \endinternal
+ */
+typedef struct
+{
+	int stride;		/**< The number of runs between two entries */
+	int num_entries;	/**< The number of entries */
+	int *positions;		/**< The number of elements preceding each entry's run */
+	int *offsets;		/**< The byte offset of each entry's run count in the index */
+} SkipIndexData;
+
+/** 
+ * Pointer to a SkipIndexData
+ */
+typedef SkipIndexData *SkipIndex;
+
+/** The default number of runs between two entries of a skip index */
+#define SKIP_INDEX_STRIDE 32
+
 /*------------------------------------------------------------------------------
  * Serialized SparseData
  *------------------------------------------------------------------------------
@@ -154,8 +180,10 @@ SparseData posit_to_sdata(char *array, int64* array_pos, size_t width, Oid type_
 
 /* Some functions for accessing and changing elements of a SparseData */
 SparseData lapply(text * func, SparseData sdata);
-double sd_proj(SparseData sdata, int idx);
-SparseData subarr(SparseData sdata, int start, int end);
+SkipIndex makeSkipIndex(SparseData sdata, int stride);
+void freeSkipIndex(SkipIndex skip);
+double sd_proj(SparseData sdata, SkipIndex skip, int idx);
+SparseData subarr(SparseData sdata, SkipIndex skip, int start, int end);
 SparseData reverse(SparseData sdata);
 SparseData concat(SparseData left, SparseData right);
 
@@ -845,6 +873,41 @@ static inline double id(double x) { return x; }
 static inline double square(double x) { return x*x; }
 static inline double myabs(double x) { return (x < 0) ? -(x) : x ; }
 
+/* The number of run lengths decoded at a time by decode_run_lengths() */
+#define RUN_LENGTH_BLOCK 256
+
+/* Decodes the next num run lengths of an RLE index into a contiguous array
+ * and advances the index pointer past them. Counts below 128, which take a
+ * single byte, are by far the most common and are decoded without calling
+ * compword_to_int8(). Loops over the values can then run over plain arrays
+ * of values and run lengths.
+ */
+static inline void
+decode_run_lengths(char **ix, double *run_lengths, int num)
+{
+	char *ptr = *ix;
+
+	if (ptr == NULL)
+	{
+		/* uncompressed storage: all runs have length one */
+		for (int i=0;i<num;i++) run_lengths[i] = 1.;
+		return;
+	}
+	for (int i=0;i<num;i++)
+	{
+		if (*ptr < 0)
+		{
+			run_lengths[i] = -(*ptr);
+			ptr++;
+		} else
+		{
+			run_lengths[i] = compword_to_int8(ptr);
+			ptr += int8compstoragesize(ptr);
+		}
+	}
+	*ix = ptr;
+}
+
 /* This function is introduced to capture a common routine for 
  * traversing a SparseData, transforming each element as we go along and 
  * summing up the transformed elements. The method is non-destructive to 
@@ -856,13 +919,15 @@ accum_sdata_values_double(SparseData sdata, double (*func)(double))
 	double accum=0.;
 	char *ix = sdata->index->data;
 	double *vals = (double *)sdata->vals->data;
-	int64 run_length;
+	double run_lengths[RUN_LENGTH_BLOCK];
+	int num;
 
-	for (int i=0;i<sdata->unique_value_count;i++)
+	for (int i=0;i<sdata->unique_value_count;i+=RUN_LENGTH_BLOCK)
 	{
-		run_length = compword_to_int8(ix);
-		accum += func(vals[i])*run_length;
-		ix+=int8compstoragesize(ix);
+		num = Min(RUN_LENGTH_BLOCK,sdata->unique_value_count-i);
+		decode_run_lengths(&ix,run_lengths,num);
+		for (int j=0;j<num;j++)
+			accum += func(vals[i+j])*run_lengths[j];
 	}
 	return (accum);
 }
@@ -882,6 +947,83 @@ static inline double l1norm_sdata_values_double(SparseData sdata) {
 	return accum_sdata_values_double(sdata, myabs);
 }
 
+static inline double mult(double x, double y) { return x*y; }
+static inline double diffsquare(double x, double y) { return (x-y)*(x-y); }
+static inline double diffabs(double x, double y) { return myabs(x-y); }
+
+/* The two-argument counterpart of accum_sdata_values_double(): traverses
+ * two SparseData of the same dimension in lockstep, applying func to each
+ * pair of overlapping runs and summing up the results weighted by the
+ * length of the overlap. Nothing is allocated: unlike computing, say,
+ * sum_sdata_values_double(op_sdata_by_sdata(multiply,left,right)), no
+ * intermediate SparseData is built. The method is non-destructive to the
+ * input SparseData.
+ */
+static inline double
+accum_sdata_pair_values_double(SparseData left, SparseData right,
+			       double (*func)(double, double))
+{
+	double accum=0.;
+	char *lix = left->index->data;
+	char *rix = right->index->data;
+	double *lvals = (double *)left->vals->data;
+	double *rvals = (double *)right->vals->data;
+	int64 left_run_length, right_run_length, overlap;
+	int i=0,j=0;
+
+	check_sdata_dimensions(left,right);
+	if (left->total_value_count == 0) return (accum);
+
+	left_run_length  = compword_to_int8(lix);
+	right_run_length = compword_to_int8(rix);
+	while (1)
+	{
+		overlap = Min(left_run_length,right_run_length);
+		accum += func(lvals[i],rvals[j])*overlap;
+		left_run_length  -= overlap;
+		right_run_length -= overlap;
+
+		/*
+		 * Both inputs have the same total length, so they run out
+		 * of runs at the same time.
+		 */
+		if (left_run_length == 0)
+		{
+			if (++i == left->unique_value_count) break;
+			lix += int8compstoragesize(lix);
+			left_run_length = compword_to_int8(lix);
+		}
+		if (right_run_length == 0)
+		{
+			if (++j == right->unique_value_count) break;
+			rix += int8compstoragesize(rix);
+			right_run_length = compword_to_int8(rix);
+		}
+	}
+	return (accum);
+}
+
+/* Computes the dot product of two SparseData */
+static inline double dot_sdata_values_double(SparseData left, SparseData right) {
+	return accum_sdata_pair_values_double(left, right, mult);
+}
+
+/* Computes the l2 distance between two SparseData */
+static inline double l2dist_sdata_values_double(SparseData left, SparseData right) {
+	return sqrt(accum_sdata_pair_values_double(left, right, diffsquare));
+}
+
+/* Computes the l1 distance between two SparseData */
+static inline double l1dist_sdata_values_double(SparseData left, SparseData right) {
+	return accum_sdata_pair_values_double(left, right, diffabs);
+}
+
+/* Computes the cosine of the angle between two SparseData */
+static inline double cosine_sdata_values_double(SparseData left, SparseData right) {
+	return dot_sdata_values_double(left, right) /
+		(l2norm_sdata_values_double(left) * l2norm_sdata_values_double(right));
+}
+
 /* 
  * Addition, Scalar Product, Division between SparseData arrays
  *
@@ -9,15 +9,49 @@
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "catalog/pg_type.h"
 #include "access/tupmacs.h"
+#include "access/hash.h"
+#include "access/tuptoaster.h"
 
 #include "sparse_vector.h"
 
-static char **get_text_array_contents(ArrayType *array, int *numitems);
-
-SvecType * classify_document(char **features, int num_features, 
-			     char **document, int num_words);
+/*
+ * An entry of the hashed feature dictionary: a feature (pointing into the
+ * cached copy of the dictionary array) and its position in the dictionary
+ */
+typedef struct {
+	char *word;
+	int len;
+	int position;	/* counting from zero, -1 marks an empty slot */
+	uint32 hash;
+} FeatureEntry;
+
+/*
+ * A feature dictionary, hashed with open addressing and linear probing.
+ * It is cached in fn_extra and reused for as long as the dictionary
+ * argument stays the same: If the dictionary is stored out of line, it is
+ * identified by its TOAST pointer. An inline dictionary is identified by
+ * the address of the argument if the argument is a constant or a parameter
+ * (get_fn_expr_arg_stable()), and otherwise by its contents: A dictionary
+ * computed per row may be rebuilt at the same address with other words.
+ */
+typedef struct {
+	Pointer datum;		/* the argument the dictionary was built from */
+	Size datum_size;	/* and its size */
+	bool is_external;
+	struct varatt_external toast_pointer;
+	ArrayType *dictionary;	/* our copy of the dictionary */
+	int num_features;
+	uint32 mask;		/* the number of slots minus one */
+	FeatureEntry *entries;
+} FeatureDictionary;
+
+static FeatureDictionary *get_feature_dictionary(FunctionCallInfo fcinfo);
+static int lookup_feature(FeatureDictionary *dict, char *word, int len);
+
+SvecType * classify_document(FeatureDictionary *dict, ArrayType *document);
 
 Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS);
 
@@ -75,19 +109,13 @@ void gp_extract_feature_histogram_errout(char *msg);
  * Returns:
  * 	SFV of the document with counts of each feature, stored in a Sparse Vector (svec) datatype
  *
- * TODO:
- * 	Use the built-in hash table structure instead of hsearch()
- * 		The problem with hsearch is that it's not safe to use more than
- * 		one per process.  That means we currently can't do more than one document
- * 		classification per query slice or we'll get the wrong results.
- *	[DONE] Implement a better scheme for detecting whether we're in a new query since
- *	we created the hash table.
- *		Right now we write a key into palloc'ed memory and check to see
- *		if it's the same value on reentry to the classification routine.
- *		This is a hack and may fail in certain circumstances.
- *		A better approach uses the gp_session_id and gp_command_count
- *		to determine if we're in the same query as the last time we were
- *		called.
+ * Implementation:
+ * 	The feature dictionary is hashed once and cached in fn_extra for as
+ * 	long as the dictionary argument does not change (see
+ * 	get_feature_dictionary()). Each word of a document is then looked up
+ * 	in constant time, and the histogram is built in compressed form from
+ * 	the sorted positions of the features found. The work per document is
+ * 	thus independent of the size of the dictionary.
  */
 
 /**
@@ -116,27 +144,19 @@ PG_FUNCTION_INFO_V1( gp_extract_feature_histogram );
 Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
 {
 	SvecType *returnval;
-	char **features, **document;
-	int num_features, num_words;
+	FeatureDictionary *dict;
 
-        if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
 
         /* Error checking */
         if (PG_NARGS() != 2) 
 		gp_extract_feature_histogram_errout(
 	          "gp_extract_feature_histogram called with wrong number of arguments");
 
-	/* Retrieve the C text array equivalents from the PG text[][] inputs */
-	features = get_text_array_contents(PG_GETARG_ARRAYTYPE_P(0),&num_features);
-	document = get_text_array_contents(PG_GETARG_ARRAYTYPE_P(1),&num_words);
-
-	// elog(NOTICE,"Number of items in the feature array is: %d\n",num_features);
-	// elog(NOTICE,"Number of items in the document array is: %d\n",num_words);
+	/* Hash the feature dictionary, unless we have done so already */
+	dict = get_feature_dictionary(fcinfo);
 
-       	returnval = classify_document(features,num_features,document,num_words);
-
-	pfree(features);
-	pfree(document);
+       	returnval = classify_document(dict,PG_GETARG_ARRAYTYPE_P(1));
 
 	PG_RETURN_POINTER(returnval);
 }
@@ -148,109 +168,210 @@ void gp_extract_feature_histogram_errout(char *msg) {
 		"%s\ngp_extract_feature_histogram internal error.",msg)));
 }
 
-int str_bsearch(char * word, char ** features, int num_features) 
+/**
+ * Returns the hashed feature dictionary for the first argument, from
+ * fn_extra if the dictionary has not changed since the last call
+ */
+static FeatureDictionary *get_feature_dictionary(FunctionCallInfo fcinfo)
 {
-	int low = 0;
-	int high = num_features - 1;
-	int mid;
-	int cmp_result;
+	struct varlena *raw = (struct varlena *)DatumGetPointer(PG_GETARG_DATUM(0));
+	FeatureDictionary *dict = (FeatureDictionary *)fcinfo->flinfo->fn_extra;
+	FeatureDictionary *newdict;
+	struct varatt_external toast_pointer;
+	ArrayType *array = NULL;
+	MemoryContext oldcontext;
+	Datum *elems;
+	bool *nulls;
+	int nelems;
+	uint32 nslots;
+	bool is_external = VARATT_IS_EXTERNAL(raw) &&
+		VARSIZE_EXTERNAL(raw) == TOAST_POINTER_SIZE;
+
+	if (is_external)
+	{
+		memcpy(&toast_pointer, VARDATA_EXTERNAL(raw), sizeof(toast_pointer));
+		if (dict != NULL && dict->is_external &&
+		    memcmp(&toast_pointer, &dict->toast_pointer,
+			   sizeof(toast_pointer)) == 0)
+			return dict;
+	} else
+	{
+		if (dict != NULL && !dict->is_external &&
+		    get_fn_expr_arg_stable(fcinfo->flinfo, 0) &&
+		    (Pointer)raw == dict->datum &&
+		    VARSIZE_ANY(raw) == dict->datum_size)
+			return dict;
+		array = PG_GETARG_ARRAYTYPE_P(0);
+		if (dict != NULL && !dict->is_external &&
+		    VARSIZE(array) == VARSIZE(dict->dictionary) &&
+		    memcmp(array, dict->dictionary, VARSIZE(array)) == 0)
+		{
+			dict->datum = (Pointer)raw;
+			dict->datum_size = VARSIZE_ANY(raw);
+			return dict;
+		}
+	}
 
-	while (true) {
-		if (low > high) return -5;
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	newdict = (FeatureDictionary *)palloc(sizeof(FeatureDictionary));
+	newdict->datum = (Pointer)raw;
+	newdict->datum_size = VARSIZE_ANY(raw);
+	newdict->is_external = is_external;
+	if (is_external)
+	{
+		newdict->toast_pointer = toast_pointer;
+		newdict->dictionary = DatumGetArrayTypePCopy(PointerGetDatum(raw));
+	} else
+	{
+		newdict->dictionary = (ArrayType *)palloc(VARSIZE(array));
+		memcpy(newdict->dictionary, array, VARSIZE(array));
+	}
 
-		mid = low + (high - low)/2;
-		Assert(mid >= 0 && mid < num_features);
+	if (ARR_ELEMTYPE(newdict->dictionary) != TEXTOID)
+		gp_extract_feature_histogram_errout(
+		  "the feature dictionary must be of type text[]");
+	deconstruct_array(newdict->dictionary, TEXTOID, -1, false, 'i',
+			  &elems, &nulls, &nelems);
+
+	/* a load factor of at most 1/2 keeps probe sequences short */
+	for (nslots = 16; nslots < 2 * (uint32)nelems; nslots <<= 1);
+	newdict->num_features = nelems;
+	newdict->mask = nslots - 1;
+	newdict->entries = (FeatureEntry *)palloc(nslots * sizeof(FeatureEntry));
+	for (uint32 i=0; i<nslots; i++)
+		newdict->entries[i].position = -1;
+
+	for (int i=0; i<nelems; i++) {
+		char *word;
+		int len;
+		uint32 hash, slot;
+
+		if (nulls[i]) continue;
+		word = VARDATA_ANY(DatumGetPointer(elems[i]));
+		len = VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i]));
+
+		/* if a feature occurs more than once, its first position wins */
+		if (lookup_feature(newdict, word, len) >= 0) continue;
+
+		hash = DatumGetUInt32(hash_any((unsigned char *)word, len));
+		for (slot = hash & newdict->mask;
+		     newdict->entries[slot].position >= 0;
+		     slot = (slot + 1) & newdict->mask);
+		newdict->entries[slot].word = word;
+		newdict->entries[slot].len = len;
+		newdict->entries[slot].position = i;
+		newdict->entries[slot].hash = hash;
+	}
+	pfree(elems);
+	pfree(nulls);
 
-		cmp_result = strcmp(word, features[mid]);
+	MemoryContextSwitchTo(oldcontext);
 
-		if (cmp_result == 0) return mid;
-		if (cmp_result > 0) low = mid + 1;
-		else high = mid - 1;
+	/* Only free the old dictionary once the new one is complete */
+	if (dict != NULL)
+	{
+		pfree(dict->entries);
+		pfree(dict->dictionary);
+		pfree(dict);
 	}
-
-	/*
-	int i;
-	for (i=0; i!=num_features; i++) 
-		if (strcmp(word, features[i]) == 0)
-			return i;
-	return -5;
-	*/
+	fcinfo->flinfo->fn_extra = newdict;
+	return newdict;
 }
 
-SvecType *classify_document(char **features, int num_features, 
-			    char **document, int num_words) 
+/**
+ * Returns the position (counting from zero) of a word in the feature 
+ * dictionary, or -1 if the word is not a feature
+ */
+static int lookup_feature(FeatureDictionary *dict, char *word, int len)
 {
-	float8 * histogram = (float8 *)palloc0(sizeof(float8)*num_features);
-	SvecType * output_sfv;
-	int i, idx;
-
-	for (i=0; i!=num_words; i++) {
-		if (document[i] == NULL) continue;
-		idx = str_bsearch(document[i], features, num_features);
-		if (idx >= 0)
-			histogram[idx]++;
+	uint32 hash = DatumGetUInt32(hash_any((unsigned char *)word, len));
+	uint32 slot;
+	FeatureEntry *entry;
+
+	for (slot = hash & dict->mask; ; slot = (slot + 1) & dict->mask) {
+		entry = &dict->entries[slot];
+		if (entry->position < 0)
+			return -1;
+		if (entry->hash == hash && entry->len == len &&
+		    memcmp(entry->word, word, len) == 0)
+			return entry->position;
 	}
-	output_sfv = svec_from_float8arr(histogram, num_features);
-	return output_sfv;
 }
 
-/**
- * Deconstruct a text[] into C-strings (note any NULL elements will be
- * returned as NULL pointers)
+static int int_cmp(const void *a, const void *b)
+{
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	return (i > j) - (i < j);
+}
+
+/* Appends a run to a SparseData, merging it with the previous run if the
+ * values agree; the pending run is kept in *run_val and *run_len
  */
-static char ** get_text_array_contents(ArrayType *array, int *numitems)
+static void append_histogram_run(SparseData sdata, float8 *run_val,
+				 int64 *run_len, float8 val, int64 len)
 {
-        int ndim = ARR_NDIM(array);
-        int * dims = ARR_DIMS(array);
-        int nitems;        
-	int16 typlen;
-        bool typbyval;
-        char typalign;
-        char ** values;
-        char * ptr;
-        bits8 * bitmap;
-        int bitmask;
-        int i;
-
-        Assert(ARR_ELEMTYPE(array) == TEXTOID);
-
-        if (ARR_ELEMTYPE(array) != TEXTOID) {
-		*numitems = 0;
-		elog(WARNING,"attempt to use a non-text[][] variable with a function that uses text[][] argumenst.\n");
-		return NULL;
+	if (len == 0) return;
+	if (*run_len > 0 && *run_val == val) {
+		*run_len += len;
+		return;
 	}
-
-	nitems = ArrayGetNItems(ndim, dims);
-        *numitems = nitems;
-
-        get_typlenbyvalalign(ARR_ELEMTYPE(array),&typlen, &typbyval, &typalign);
-
-        values = (char **) palloc(nitems * sizeof(char *));
-
-        ptr = ARR_DATA_PTR(array);
-        bitmap = ARR_NULLBITMAP(array);
-        bitmask = 1;
-
-        for (i = 0; i < nitems; i++) {
-                if (bitmap && (*bitmap & bitmask) == 0) {
-                        values[i] = NULL;
-                } else {
-                        values[i] = DatumGetCString(DirectFunctionCall1(textout,
-					       	PointerGetDatum(ptr)));
-                        ptr = att_addlength_pointer(ptr, typlen, ptr);
-                        ptr = (char *) att_align_nominal(ptr, typalign);
-                }
-                /* advance bitmap pointer if any */
-                if (bitmap) {
-                        bitmask <<= 1;
-                        if (bitmask == 0x100) {
-                                bitmap++;
-                                bitmask = 1;
-                        }
-                }
-        }
-        return values;
+	if (*run_len > 0)
+		add_run_to_sdata((char *)run_val, *run_len, sizeof(float8), sdata);
+	*run_val = val;
+	*run_len = len;
 }
 
+/**
+ * Counts the features in a document. Only the positions of the features
+ * found are collected and sorted; the histogram is then built directly
+ * in compressed form, without a dense array of all features.
+ */
+SvecType *classify_document(FeatureDictionary *dict, ArrayType *document)
+{
+	SparseData sdata = makeSparseData();
+	Datum *elems;
+	bool *nulls;
+	int nelems, nhits = 0, *hits;
+	float8 run_val = 0.;
+	int64 run_len = 0;
+	int i, next = 0;
+
+	if (ARR_ELEMTYPE(document) != TEXTOID)
+		gp_extract_feature_histogram_errout(
+		  "the document must be of type text[]");
+	deconstruct_array(document, TEXTOID, -1, false, 'i',
+			  &elems, &nulls, &nelems);
 
+	hits = (int *)palloc(Max(nelems,1) * sizeof(int));
+	for (i=0; i!=nelems; i++) {
+		int idx;
 
+		if (nulls[i]) continue;
+		idx = lookup_feature(dict, VARDATA_ANY(DatumGetPointer(elems[i])),
+			VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i])));
+		if (idx >= 0)
+			hits[nhits++] = idx;
+	}
+	qsort(hits, nhits, sizeof(int), int_cmp);
+
+	/* next is the first position not yet covered by a run */
+	for (i=0; i<nhits; ) {
+		int count = 1;
+		while (i + count < nhits && hits[i + count] == hits[i]) count++;
+		append_histogram_run(sdata, &run_val, &run_len, 0., hits[i] - next);
+		append_histogram_run(sdata, &run_val, &run_len, count, 1);
+		next = hits[i] + 1;
+		i += count;
+	}
+	append_histogram_run(sdata, &run_val, &run_len, 0.,
+			     dict->num_features - next);
+	if (run_len > 0)
+		add_run_to_sdata((char *)&run_val, run_len, sizeof(float8), sdata);
+
+	pfree(hits);
+	pfree(elems);
+	pfree(nulls);
+	return svec_from_sparsedata(sdata,true);
+}
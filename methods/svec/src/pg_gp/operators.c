@@ -17,6 +17,8 @@
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "access/hash.h"
+#include "access/tuptoaster.h"
+#include "nodes/execnodes.h"
 
 #include "sparse_vector.h"
 
@@ -40,6 +42,20 @@ void check_dimension(SvecType *svec1, SvecType *svec2, char *msg) {
 	}
 }
 
+/**
+ * Returns true if we are called by an aggregate, in which case the
+ * transition state (the first argument) may be updated in place.
+ */
+static inline bool called_as_aggregate(FunctionCallInfo fcinfo)
+{
+	return fcinfo->context &&
+	       (IsA(fcinfo->context, AggState)
+	#ifdef NOTGP
+		|| IsA(fcinfo->context, WindowAggState)
+	#endif
+	       );
+}
+
 /**
  *  svec_dimension - returns the number of elements in an svec
  */
@@ -169,6 +185,68 @@ Datum svec_append(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * Random access into an svec that is stored out of line: When the same TOAST
+ * pointer is looked up twice in a row, the detoasted svec and a skip index
+ * for it are kept in fn_extra. Repeated lookups into the same stored svec,
+ * e.g., when joining with generate_series(), then need neither detoasting
+ * nor a scan over all runs. A single lookup per row, e.g., svec_proj(v,k)
+ * over a table, only records the TOAST pointer and takes the plain scan,
+ * since copying the svec and building the index would cost more than the
+ * scan itself.
+ */
+typedef struct {
+	struct varatt_external toast_pointer;
+	SvecType *svec;		/* NULL until the pointer is seen again */
+	SkipIndex skip;
+} SvecAccessCache;
+
+static SvecType *svec_for_random_access(FunctionCallInfo fcinfo, int argno,
+					SkipIndex *skip)
+{
+	struct varlena *raw = (struct varlena *)DatumGetPointer(PG_GETARG_DATUM(argno));
+	SvecAccessCache *cache = (SvecAccessCache *)fcinfo->flinfo->fn_extra;
+	struct varatt_external toast_pointer;
+	MemoryContext oldcontext;
+
+	*skip = NULL;
+	if (!VARATT_IS_EXTERNAL(raw) ||
+	    VARSIZE_EXTERNAL(raw) != TOAST_POINTER_SIZE)
+	{
+		/* inline svecs are short, a skip index would not pay off */
+		return PG_GETARG_SVECTYPE_P(argno);
+	}
+
+	memcpy(&toast_pointer, VARDATA_EXTERNAL(raw), sizeof(toast_pointer));
+	if (cache == NULL)
+	{
+		cache = (SvecAccessCache *)MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(SvecAccessCache));
+		fcinfo->flinfo->fn_extra = cache;
+	} else if (memcmp(&toast_pointer, &cache->toast_pointer,
+			  sizeof(toast_pointer)) == 0)
+	{
+		if (cache->svec == NULL)
+		{
+			oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+			cache->svec = DatumGetSvecTypePCopy(PointerGetDatum(raw));
+			cache->skip = makeSkipIndex(sdata_from_svec(cache->svec),
+						    SKIP_INDEX_STRIDE);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		*skip = cache->skip;
+		return cache->svec;
+	} else if (cache->svec != NULL)
+	{
+		pfree(cache->svec);
+		freeSkipIndex(cache->skip);
+		cache->svec = NULL;
+		cache->skip = NULL;
+	}
+	cache->toast_pointer = toast_pointer;
+	return PG_GETARG_SVECTYPE_P(argno);
+}
+
 /**
  *  svec_proj - projects onto an element of an svec
  */
@@ -179,15 +257,16 @@ Datum svec_proj(PG_FUNCTION_ARGS)
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
+	SkipIndex skip;
+	SvecType * sv = svec_for_random_access(fcinfo,0,&skip);
 	int idx = PG_GETARG_INT32(1);
 
 	SparseData in = sdata_from_svec(sv);
-	double ret = sd_proj(in,idx);
+	double ret = sd_proj(in,skip,idx);
 
 	if (IS_NVP(ret)) PG_RETURN_NULL();
 
-	PG_RETURN_FLOAT8(sd_proj(in,idx));
+	PG_RETURN_FLOAT8(ret);
 }
 
 /**
@@ -200,12 +279,13 @@ Datum svec_subvec(PG_FUNCTION_ARGS)
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
+	SkipIndex skip;
+	SvecType * sv = svec_for_random_access(fcinfo,0,&skip);
 	int start = PG_GETARG_INT32(1);
 	int end   = PG_GETARG_INT32(2);
 
 	SparseData in = sdata_from_svec(sv);
-	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr(in,start,end),true));
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr(in,skip,start,end),true));
 }
 
 /**
@@ -253,8 +333,8 @@ Datum svec_change(PG_FUNCTION_ARGS)
 			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 			 errmsg("Change vector is too long")));
 
-	if (idx >= 2) head = subarr(indata, 1, idx-1);
-	if (idx + midlen <= inlen) tail = subarr(indata,idx + midlen, inlen);
+	if (idx >= 2) head = subarr(indata, NULL, 1, idx-1);
+	if (idx + midlen <= inlen) tail = subarr(indata, NULL, idx + midlen, inlen);
 
 	if (head == NULL && tail == NULL)
 		ret = makeSparseDataCopy(middle);
@@ -633,6 +713,153 @@ Datum svec_count(PG_FUNCTION_ARGS)
 	PG_RETURN_SVECTYPE_P(result);
 }
 
+/*
+ * The transition state of the svec_sum() aggregate is an svec in
+ * uncompressed format: a SparseData without index, i.e., with one run of
+ * length one per element. Incoming svecs are added to its values in place,
+ * so that no new svec is created per row. A state is only made uncompressed
+ * if that costs little memory: if its dimension is at most
+ * SVEC_SUM_MAX_UNCOMPRESSED_DIM, or if it has at least one run per
+ * SVEC_SUM_MIN_RUN_DENSITY elements. Sparse states of higher dimension, e.g.,
+ * of term-frequency vectors, stay compressed and are added to with
+ * svec_plus(), so that a GROUP BY does not hold a dense vector per group.
+ */
+#define SVEC_SUM_MAX_UNCOMPRESSED_DIM (64*1024)
+#define SVEC_SUM_MIN_RUN_DENSITY 4
+
+static inline bool svec_is_uncompressed(SvecType *svec)
+{
+	return (!IS_SCALAR(svec)) && (SVEC_INDEX_SIZE(svec) == 0);
+}
+
+/*
+ * Returns a copy of an svec in uncompressed format
+ */
+static SvecType *svec_uncompressed_copy(SvecType *svec)
+{
+	SparseData sdata = sdata_from_svec(svec);
+	double *vals = sdata_to_float8arr(sdata);
+	SparseData uncompressed = makeInplaceSparseData((char *)vals, NULL,
+			sdata->total_value_count*sizeof(float8), 0, FLOAT8OID,
+			sdata->total_value_count, sdata->total_value_count);
+	SvecType *result = svec_from_sparsedata(uncompressed,false);
+
+	pfree(vals);
+	pfree(uncompressed);
+	return result;
+}
+
+/*
+ * Returns whether the svec_sum() state svec should be kept uncompressed
+ */
+static inline bool svec_sum_keep_uncompressed(SvecType *svec)
+{
+	return svec->dimension <= SVEC_SUM_MAX_UNCOMPRESSED_DIM ||
+		(int64)SVEC_UNIQUE_VALCNT(svec)*SVEC_SUM_MIN_RUN_DENSITY >=
+			svec->dimension;
+}
+
+/*
+ * Adds an svec to the values of an uncompressed svec in place.
+ * Runs of zeros are skipped.
+ */
+static void svec_add_inplace(SvecType *state, SvecType *svec)
+{
+	double *result = (double *)SVEC_VALS_PTR(state);
+	SparseData sdata = sdata_from_svec(svec);
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	int64 run_length, pos = 0;
+
+	if (IS_SCALAR(svec))
+	{
+		if (vals[0] != 0.)
+			for (int i=0;i<state->dimension;i++) result[i] += vals[0];
+		return;
+	}
+	if (ix == NULL)
+	{
+		/* uncompressed storage: all runs have length one */
+		for (int i=0;i<sdata->unique_value_count;i++) result[i] += vals[i];
+		return;
+	}
+	for (int i=0;i<sdata->unique_value_count;i++)
+	{
+		run_length = compword_to_int8(ix);
+		if (vals[i] != 0.)
+			for (int64 k=pos;k<pos+run_length;k++) result[k] += vals[i];
+		pos += run_length;
+		ix+=int8compstoragesize(ix);
+	}
+}
+
+PG_FUNCTION_INFO_V1( svec_sum_trans );
+/**
+ *  svec_sum_trans - transition function (and Greenplum prefunc) of the
+ *                   svec_sum() aggregate: adds the right argument to the
+ *                   left argument, in place when called in an aggregate
+ */
+Datum svec_sum_trans(PG_FUNCTION_ARGS)
+{
+	SvecType *state;
+	SvecType *svec = PG_GETARG_SVECTYPE_P(1);
+	SvecType *result;
+
+	/*
+	 * The state may only be updated destructively if it belongs to an
+	 * aggregate.
+	 */
+	if (called_as_aggregate(fcinfo))
+		state = PG_GETARG_SVECTYPE_P(0);
+	else
+		state = PG_GETARG_SVECTYPE_P_COPY(0);
+
+	check_dimension(state,svec,"svec_sum");
+
+	if (svec_is_uncompressed(state))
+	{
+		svec_add_inplace(state,svec);
+		PG_RETURN_SVECTYPE_P(state);
+	}
+	if (svec_is_uncompressed(svec))
+	{
+		/*
+		 * Greenplum prefunc: the other segment's state is uncompressed,
+		 * so add our state to a copy of it.
+		 */
+		result = PG_GETARG_SVECTYPE_P_COPY(1);
+		svec_add_inplace(result,state);
+		PG_RETURN_SVECTYPE_P(result);
+	}
+
+	/*
+	 * The state is the initial zero scalar, or is too sparse to be kept
+	 * uncompressed. Add as svec_plus() does; the state turns uncompressed
+	 * as soon as the sum is dense enough.
+	 */
+	result = op_svec_by_svec_internal(add,state,svec);
+	if (!IS_SCALAR(result) && !svec_is_uncompressed(result) &&
+	    svec_sum_keep_uncompressed(result))
+		result = svec_uncompressed_copy(result);
+	PG_RETURN_SVECTYPE_P(result);
+}
+
+PG_FUNCTION_INFO_V1( svec_sum_final );
+/**
+ *  svec_sum_final - final function of the svec_sum() aggregate: compresses
+ *                   the transition state
+ */
+Datum svec_sum_final(PG_FUNCTION_ARGS)
+{
+	SvecType *state = PG_GETARG_SVECTYPE_P(0);
+
+	if (svec_is_uncompressed(state))
+		PG_RETURN_SVECTYPE_P(svec_from_float8arr(
+			(double *)SVEC_VALS_PTR(state),state->dimension));
+
+	PG_RETURN_SVECTYPE_P(state);
+}
+
 PG_FUNCTION_INFO_V1( svec_dot );
 /**
  *  svec_dot - computes the dot product of two svecs
@@ -643,13 +870,72 @@ Datum svec_dot(PG_FUNCTION_ARGS)
 	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
 	SparseData left  = sdata_from_svec(svec1);
 	SparseData right = sdata_from_svec(svec2);
-	SparseData mult_result;
 	double accum;
 	check_dimension(svec1,svec2,"svec_dot");
 
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
-	freeSparseDataAndData(mult_result);
+	accum = dot_sdata_values_double(left,right);
+
+	if (IS_NVP(accum)) PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(accum);
+}
+
+PG_FUNCTION_INFO_V1( svec_l2dist );
+/**
+ *  svec_l2dist - computes the l2 distance between two svecs, i.e., the
+ *                l2 norm of their difference
+ */
+Datum svec_l2dist(PG_FUNCTION_ARGS)
+{
+	SvecType *svec1 = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
+	SparseData left  = sdata_from_svec(svec1);
+	SparseData right = sdata_from_svec(svec2);
+	double accum;
+	check_dimension(svec1,svec2,"svec_l2dist");
+
+	accum = l2dist_sdata_values_double(left,right);
+
+	if (IS_NVP(accum)) PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(accum);
+}
+
+PG_FUNCTION_INFO_V1( svec_l1dist );
+/**
+ *  svec_l1dist - computes the l1 distance between two svecs, i.e., the
+ *                l1 norm of their difference
+ */
+Datum svec_l1dist(PG_FUNCTION_ARGS)
+{
+	SvecType *svec1 = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
+	SparseData left  = sdata_from_svec(svec1);
+	SparseData right = sdata_from_svec(svec2);
+	double accum;
+	check_dimension(svec1,svec2,"svec_l1dist");
+
+	accum = l1dist_sdata_values_double(left,right);
+
+	if (IS_NVP(accum)) PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(accum);
+}
+
+PG_FUNCTION_INFO_V1( svec_cosine );
+/**
+ *  svec_cosine - computes the cosine of the angle between two svecs
+ */
+Datum svec_cosine(PG_FUNCTION_ARGS)
+{
+	SvecType *svec1 = PG_GETARG_SVECTYPE_P(0);
+	SvecType *svec2 = PG_GETARG_SVECTYPE_P(1);
+	SparseData left  = sdata_from_svec(svec1);
+	SparseData right = sdata_from_svec(svec2);
+	double accum;
+	check_dimension(svec1,svec2,"svec_cosine");
+
+	accum = cosine_sdata_values_double(left,right);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1080,14 +1366,11 @@ Datum float8arr_dot(PG_FUNCTION_ARGS) {
 	ArrayType *arr_right  = PG_GETARG_ARRAYTYPE_P(1);
 	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr_left);
 	SparseData right = sdata_uncompressed_from_float8arr_internal(arr_right);
-	SparseData mult_result;
 	double accum;
 
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(left);
 	freeSparseData(right);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1244,12 +1527,9 @@ svec_dot_float8arr(PG_FUNCTION_ARGS)
 	ArrayType *arr = PG_GETARG_ARRAYTYPE_P(1);
 	SparseData right = sdata_uncompressed_from_float8arr_internal(arr);
 	SparseData left = sdata_from_svec(svec);
-	SparseData mult_result;
 	double accum;
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(right);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1263,12 +1543,9 @@ float8arr_dot_svec(PG_FUNCTION_ARGS)
 	SvecType *svec = PG_GETARG_SVECTYPE_P(1);
 	SparseData left = sdata_uncompressed_from_float8arr_internal(arr);
 	SparseData right = sdata_from_svec(svec);
-	SparseData mult_result;
 	double accum;
-	mult_result = op_sdata_by_sdata(multiply,left,right);
-	accum = sum_sdata_values_double(mult_result);
+	accum = dot_sdata_values_double(left,right);
 	freeSparseData(left);
-	freeSparseDataAndData(mult_result);
 
 	if (IS_NVP(accum)) PG_RETURN_NULL();
 
@@ -1303,7 +1580,8 @@ PG_FUNCTION_INFO_V1( svec_pivot );
  * Aggregate function svec_pivot takes its float8 argument and appends it
  * to the state variable (an svec) to produce the concatenated return variable.
  * The StringInfo variables within the state variable svec are used in a way
- * that minimizes the number of memory re-allocations.
+ * that minimizes the number of memory re-allocations. When called as an
+ * aggregate, the state is modified in place rather than copied per call.
  *
  * Note that the first time this is called, the state variable should be null.
  */
@@ -1318,7 +1596,15 @@ Datum svec_pivot(PG_FUNCTION_ARGS)
 
 	if (! PG_ARGISNULL(0))
 	{
-		svec = PG_GETARG_SVECTYPE_P_COPY(0);
+		/*
+		 * Within an aggregate, the state is appended to in place.
+		 * Space is doubled by reallocSvec() when it runs out, so
+		 * n calls take O(n) time overall.
+		 */
+		if (called_as_aggregate(fcinfo))
+			svec = PG_GETARG_SVECTYPE_P(0);
+		else
+			svec = PG_GETARG_SVECTYPE_P_COPY(0);
 	} else {	//first call, construct a new svec
 		/*
 		 * Allocate space for the unique values and index
@@ -1398,14 +1684,9 @@ Datum svec_pivot(PG_FUNCTION_ARGS)
 					- old_index_storage_size);
 			sdata->total_value_count++;
 		} else {
+			/* the count of the new run goes to the end of the index */
+			int len=sdata->index->len;
 			add_run_to_sdata((char *)(&value),1,sizeof(float8),sdata);
-			char *i_ptr=sdata->index->data;
-			int len=0;
-			for (int j=0;j<sdata->unique_value_count-1;j++)
-			{
-				len+=int8compstoragesize(i_ptr);
-				i_ptr+=int8compstoragesize(i_ptr);
-			}
 			sdata->index->cursor = len;
 		}
 	}
@@ -119,10 +119,15 @@ Datum svec_div(PG_FUNCTION_ARGS);
 Datum svec_dot(PG_FUNCTION_ARGS);
 Datum svec_l2norm(PG_FUNCTION_ARGS);
 Datum svec_count(PG_FUNCTION_ARGS);
+Datum svec_sum_trans(PG_FUNCTION_ARGS);
+Datum svec_sum_final(PG_FUNCTION_ARGS);
 Datum svec_mult(PG_FUNCTION_ARGS);
 Datum svec_log(PG_FUNCTION_ARGS);
 Datum svec_l1norm(PG_FUNCTION_ARGS);
 Datum svec_summate(PG_FUNCTION_ARGS);
+Datum svec_l2dist(PG_FUNCTION_ARGS);
+Datum svec_l1dist(PG_FUNCTION_ARGS);
+Datum svec_cosine(PG_FUNCTION_ARGS);
 
 Datum float8arr_minus_float8arr(PG_FUNCTION_ARGS);
 Datum svec_minus_float8arr(PG_FUNCTION_ARGS);
@@ -15,12 +15,15 @@ public:
     /**
      * @brief Context for memory allocations.
      * 
-     * Two contexts are available in the abstraction layer: Current
-     * (user-defined) function call, and aggregate context. The main difference
-     * will be when automatic garbage collection takes place (if the DBMS
-     * supports it).
+     * Three contexts are available in the abstraction layer: Current
+     * (user-defined) function call, aggregate context, and call site. The
+     * main difference will be when automatic garbage collection takes place
+     * (if the DBMS supports it). Memory in the call-site context lives as
+     * long as the function is called from the same place in a query (i.e.,
+     * typically across all rows of a query). It is meant for data stored in
+     * AbstractDBInterface::callSiteCache().
      */
-    enum Context { kFunction, kAggregate };
+    enum Context { kFunction, kAggregate, kCallSite };
 
     virtual ~AbstractAllocator() { }
 
@@ -104,6 +104,18 @@ public:
         AbstractAllocator::Context inMemContext = AbstractAllocator::kFunction)
         = 0;
     
+    /**
+     * @brief Return a slot for data that persists across calls from the same
+     *        call site
+     *
+     * Modules may use this slot for caching data that is expensive to compute
+     * and that depends only on arguments that usually do not change from row
+     * to row. The slot is initially NULL. Data stored in it must be allocated
+     * with allocator(AbstractAllocator::kCallSite), and it is the module's
+     * responsibility to check that the cached data is still valid.
+     */
+    virtual void *&callSiteCache() = 0;
+    
     /**
      * @brief Return the last error message that did not cause an exception (if any).
      * 
@@ -45,9 +45,17 @@ public:
         }
         
         AnyValue operator*() {
-            // FIXME: This could be more efficient, operator->() creates AnyValue
-            // which is then deleted again
-            return *this->operator->();
+            // Unlike operator->(), we do not need an AnyValue on the heap: If
+            // the value returned by getValueByID is not an AnyValue itself, we
+            // use it as delegate of an AnyValue returned by value.
+            AbstractValueSPtr valuePtr = mValue.getValueByID(mCurrentID);
+            shared_ptr<const AnyValue> anyValuePtr(
+                dynamic_pointer_cast<const AnyValue>( valuePtr ));
+            
+            if (anyValuePtr)
+                return *anyValuePtr;
+            else
+                return AnyValue(valuePtr);
         }
         
         shared_ptr<const AnyValue> operator->() {
@@ -48,6 +48,22 @@ public:
           mMemoryHandle(inHandle)
         { }
     
+    /**
+     * @brief Construct a view of existing memory
+     *
+     * The array does not have a memory handle (memoryHandle() returns an
+     * empty pointer), so nothing is allocated on the heap. The caller must
+     * ensure that the memory outlives the array.
+     */
+    inline Array_const(
+        const T *inData,
+        const extent_gen &ranges)
+        : const_multi_array_ref<T, NumDims>(
+            inData,
+            ranges),
+          mMemoryHandle()
+        { }
+    
     inline Array_const(
         AllocatorSPtr inAllocator,
         const extent_gen &ranges)
@@ -144,6 +144,11 @@ inline bool ConcreteValue<Array_const<double> >::isMutable() const {
 
 template <>
 inline AbstractValueSPtr ConcreteValue<Array_const<double> >::mutableClone() const {
+    // Views of foreign memory (see Array_const(const T*, const extent_gen&))
+    // do not have a memory handle that could be cloned
+    if (!mValue.memoryHandle())
+        throw std::logic_error("Internal error: Cannot clone an array view");
+
     return AbstractValueSPtr(
         new ConcreteValue<Array<double> >(
                 Array<double>(
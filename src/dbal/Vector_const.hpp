@@ -53,6 +53,27 @@ public:
           n_elem(mVector.n_elem)
         { }
 
+    /**
+     * @brief Construct a view of existing memory
+     *
+     * The vector does not have a memory handle (memoryHandle() returns an
+     * empty pointer), so nothing is allocated on the heap. The caller must
+     * ensure that the memory outlives the vector.
+     */
+    inline Vector_const(
+        const eT *inPtr,
+        const uint32_t inNumElem)
+        : mMemoryHandle(),
+          mVector(
+            const_cast<eT*>(inPtr),
+            inNumElem,
+            false /* copy_aux_mem */,
+            true /* strict */),
+          n_rows(mVector.n_rows),
+          n_cols(mVector.n_cols),
+          n_elem(mVector.n_elem)
+        { }
+
     inline Vector_const(
         const Vector<T, eT> &inVec)
         : mMemoryHandle(inVec.mMemoryHandle),
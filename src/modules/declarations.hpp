@@ -22,8 +22,56 @@
  * where \c SQLName is the external name (which the database will use as entry
  * point when calling the madlib library) and \c Function is the internal class
  * name implementing the UDF.
+ *
+ * Functions with a native C++ signature (instead of
+ * <tt>AnyValue(AbstractDBInterface&, AnyValue)</tt>) are declared with
+ * @code
+ * DECLARE_TYPED_UDF_EXT(SQLName, NameSpace, Function, Signature)
+ * DECLARE_TYPED_UDF(NameSpace, Function, Signature)
+ * @endcode
+ * where \c Signature is a function type of form <tt>R(A1, ..., An)</tt>. The
+ * internal function then has signature
+ * <tt>R(AbstractDBInterface&, A1, ..., An)</tt>. Ports generate the code for
+ * converting arguments and the return value at compile time.
  */
 
+// kmeans/lloyd.hpp
+DECLARE_TYPED_UDF_EXT(internal_kmeans_closest_centroid, kmeans,
+    KMeans::closestCentroid,
+    int32_t(DoubleCol_const, Array_const<double>, int32_t))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_mean_transition, kmeans,
+    KMeans::meanTransition, Array<double>(Array<double>, DoubleRow_const))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_mean_merge_states, kmeans,
+    KMeans::meanMergeStates, Array<double>(Array<double>, Array<double>))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_mean_final, kmeans,
+    KMeans::meanFinal, DoubleCol(Array_const<double>))
+
+// kmeans/hamerly.hpp
+DECLARE_TYPED_UDF_EXT(internal_kmeans_hamerly_assign, kmeans,
+    Hamerly::assign, DoubleCol(DoubleCol_const, Array_const<double>,
+        Array_const<double>, Array_const<double>, int32_t))
+
+// kmeans/seeding.hpp
+DECLARE_TYPED_UDF_EXT(internal_kmeans_min_squared_dist, kmeans,
+    KMeansParallel::minSquaredDistance,
+    double(DoubleCol_const, Array_const<double>, double))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_sample_transition, kmeans,
+    KMeansParallel::sampleTransition, Array<double>(Array<double>,
+        DoubleCol_const, double, int32_t, double))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_sample_merge_states, kmeans,
+    KMeansParallel::sampleMergeStates,
+    Array<double>(Array<double>, Array<double>))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_sample_final, kmeans,
+    KMeansParallel::sampleFinal, DoubleCol(Array_const<double>))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_seed_transition, kmeans,
+    KMeansParallel::seedTransition, Array<double>(Array<double>,
+        DoubleCol_const, Array_const<double>, int32_t, double))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_seed_merge_states, kmeans,
+    KMeansParallel::seedMergeStates,
+    Array<double>(Array<double>, Array<double>))
+DECLARE_TYPED_UDF_EXT(internal_kmeans_parallel_seed_final, kmeans,
+    KMeansParallel::seedFinal, DoubleCol(Array_const<double>))
+
 // prob/chiSquared.hpp
 DECLARE_UDF(prob, chi_squared_cdf)
 
@@ -32,9 +80,12 @@ DECLARE_UDF(prob, student_t_cdf)
 
 
 // regress/linear.hpp
-DECLARE_UDF_EXT(linregr_transition, regress, LinearRegression::transition)
-DECLARE_UDF_EXT(linregr_merge_states, regress, LinearRegression::mergeStates)
-DECLARE_UDF_EXT(linregr_final, regress, LinearRegression::final)
+DECLARE_TYPED_UDF_EXT(linregr_transition, regress, LinearRegression::transition,
+    Array<double>(Array<double>, double, DoubleRow_const))
+DECLARE_TYPED_UDF_EXT(linregr_merge_states, regress, LinearRegression::mergeStates,
+    Array<double>(Array<double>, Array<double>))
+DECLARE_TYPED_UDF_EXT(linregr_final, regress, LinearRegression::final,
+    AnyValue(Array<double>))
     
 // regress/logistic.hpp
 DECLARE_UDF_EXT(logregr_cg_step_transition, regress, LogisticRegressionCG::transition)
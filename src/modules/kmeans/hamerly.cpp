@@ -0,0 +1,236 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file hamerly.cpp
+ *
+ * @brief Assignment step of k-means with triangle-inequality pruning
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <modules/kmeans/hamerly.hpp>
+#include <modules/kmeans/lloyd.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Centroid drifts and centroid separations, cached across rows
+ *
+ * For each centroid \f$ c \f$, we store
+ * - the drift \f$ \| c - c' \| \f$, where \f$ c' \f$ is the previous position
+ *   of the centroid,
+ * - half the distance to the closest other centroid,
+ *   \f$ s(c) = \frac 12 \min_{c'' \neq c} \| c - c'' \| \f$. A point closer
+ *   than \f$ s(c) \f$ to \f$ c \f$ cannot be closer to any other centroid.
+ *
+ * Computing this takes \f$ O(k^2 d) \f$ time, so we do it only once per query.
+ * Comparing the centroids with a cached copy would take \f$ O(kd) \f$ time
+ * per row, so the cache is instead keyed on the iteration number passed by
+ * the caller. We still keep copies of the centroids because the argument
+ * memory does not outlive the call.
+ */
+class Hamerly::CentroidCache {
+public:
+    static const CentroidCache &get(AbstractDBInterface &db,
+        const Array_const<double> &inCentroids,
+        const Array_const<double> &inPrevCentroids, uint32_t inDimension,
+        int32_t inIteration) {
+
+        CentroidCache *cache = static_cast<CentroidCache*>(db.callSiteCache());
+        uint32_t numElements = inCentroids.num_elements();
+        uint32_t numPrevElements = inPrevCentroids.num_elements();
+
+        if (cache != NULL
+            && cache->iteration == inIteration
+            && cache->numElements == numElements
+            && cache->numPrevElements == numPrevElements
+            && cache->dimension == inDimension)
+            return *cache;
+
+        AllocatorSPtr allocator = db.allocator(AbstractAllocator::kCallSite);
+        uint32_t numCentroids = numElements / inDimension;
+
+        if (cache != NULL)
+            allocator->free(cache);
+        cache = static_cast<CentroidCache*>(allocator->allocate(
+            sizeof(CentroidCache)
+            + (numElements + numPrevElements + 2 * numCentroids)
+                * sizeof(double)));
+        db.callSiteCache() = cache;
+
+        cache->iteration = inIteration;
+        cache->numElements = numElements;
+        cache->numPrevElements = numPrevElements;
+        cache->dimension = inDimension;
+        cache->numCentroids = numCentroids;
+        cache->centroids = reinterpret_cast<double*>(cache + 1);
+        cache->prevCentroids = cache->centroids + numElements;
+        cache->drift = cache->prevCentroids + numPrevElements;
+        cache->halfSeparation = cache->drift + numCentroids;
+        std::memcpy(cache->centroids, inCentroids.data(),
+            numElements * sizeof(double));
+        std::memcpy(cache->prevCentroids, inPrevCentroids.data(),
+            numPrevElements * sizeof(double));
+
+        // If the number of centroids changed (because a cluster became
+        // empty), the indices of the previous centroids are meaningless.
+        cache->hasDrift = (numPrevElements == numElements);
+        cache->maxDriftIndex = 0;
+        cache->maxDrift = 0;
+        cache->secondMaxDrift = 0;
+        for (uint32_t i = 0; cache->hasDrift && i < numCentroids; i++) {
+            double drift = std::sqrt(KMeans::squaredDistance(
+                cache->centroids + i * inDimension,
+                cache->prevCentroids + i * inDimension, inDimension));
+            cache->drift[i] = drift;
+
+            if (drift > cache->maxDrift) {
+                cache->secondMaxDrift = cache->maxDrift;
+                cache->maxDrift = drift;
+                cache->maxDriftIndex = i;
+            } else if (drift > cache->secondMaxDrift)
+                cache->secondMaxDrift = drift;
+        }
+
+        for (uint32_t i = 0; i < numCentroids; i++)
+            cache->halfSeparation[i] = std::numeric_limits<double>::infinity();
+        for (uint32_t i = 0; i < numCentroids; i++) {
+            for (uint32_t j = i + 1; j < numCentroids; j++) {
+                double halfDist = 0.5 * std::sqrt(KMeans::squaredDistance(
+                    cache->centroids + i * inDimension,
+                    cache->centroids + j * inDimension, inDimension));
+                if (halfDist < cache->halfSeparation[i])
+                    cache->halfSeparation[i] = halfDist;
+                if (halfDist < cache->halfSeparation[j])
+                    cache->halfSeparation[j] = halfDist;
+            }
+        }
+
+        return *cache;
+    }
+
+    /**
+     * @brief Return the maximum drift of all centroids other than the given
+     *     one
+     */
+    double maxDriftExcept(uint32_t inIndex) const {
+        return inIndex == maxDriftIndex ? secondMaxDrift : maxDrift;
+    }
+
+    int32_t iteration;
+    uint32_t numElements;
+    uint32_t numPrevElements;
+    uint32_t dimension;
+    uint32_t numCentroids;
+    double *centroids;
+    double *prevCentroids;
+
+    bool hasDrift;
+    uint32_t maxDriftIndex;
+    double maxDrift;
+    double secondMaxDrift;
+    double *drift;
+    double *halfSeparation;
+};
+
+/**
+ * @brief Assign a point to its closest centroid, skipping distance
+ *     computations where the bounds allow it
+ *
+ * @param point Point coordinates
+ * @param bounds Bounds array <tt>{index, upper, lower}</tt> from the previous
+ *     iteration. An index of 0 means that nothing is known, e.g.,
+ *     <tt>{0,0,0}</tt> for the first iteration.
+ * @param centroids Current centroids
+ * @param prevCentroids Centroids that \c bounds refer to. If they have a
+ *     different number of elements than \c centroids, all bounds are
+ *     discarded.
+ * @param iteration Identifies \c centroids and \c prevCentroids. The caller
+ *     must pass a different value whenever it passes different centroids
+ *     through the same call site.
+ * @return New bounds array <tt>{index, upper, lower}</tt>. Ties are broken in
+ *     favor of the centroid with the smaller index, as in
+ *     KMeans::closestCentroid().
+ */
+DoubleCol Hamerly::assign(AbstractDBInterface &db,
+    DoubleCol_const point, Array_const<double> bounds,
+    Array_const<double> centroids, Array_const<double> prevCentroids,
+    int32_t iteration) {
+
+    uint32_t dimension = point.n_elem;
+
+    if (dimension == 0)
+        throw std::invalid_argument("Point has dimension 0.");
+    if (centroids.num_elements() == 0
+        || centroids.num_elements() % dimension != 0)
+        throw std::invalid_argument("Dimension of centroids does not match "
+            "dimension of point.");
+    if (bounds.num_elements() != 3)
+        throw std::invalid_argument("Bounds must have 3 elements.");
+    if (!point.is_finite())
+        throw std::invalid_argument("Point is not finite.");
+
+    const CentroidCache &cache = CentroidCache::get(db, centroids,
+        prevCentroids, dimension, iteration);
+    const double *p = point.memptr();
+
+    // For efficiency reasons, we want to return this by reference, so we need
+    // to bind to db memory
+    DoubleCol result(db.allocator(), 3);
+
+    double assigned = bounds[0];
+    if (cache.hasDrift && assigned >= 1 && assigned <= cache.numCentroids) {
+        uint32_t a = static_cast<uint32_t>(assigned) - 1;
+        double upper = bounds[1] + cache.drift[a];
+        double lower = bounds[2] - cache.maxDriftExcept(a);
+        double threshold = std::max(cache.halfSeparation[a], lower);
+
+        // The tests are strict: If the point is only as close to centroid a
+        // as to another centroid, a centroid with a smaller index may have to
+        // win the tie, so we need the full scan.
+        if (upper >= threshold)
+            upper = std::sqrt(KMeans::squaredDistance(p,
+                cache.centroids + a * dimension, dimension));
+
+        if (upper < threshold) {
+            result(0) = a + 1;
+            result(1) = upper;
+            result(2) = lower;
+            return result;
+        }
+    }
+
+    // Bounds are not tight enough: Find the closest and second-closest
+    // centroid
+    uint32_t closest = 0;
+    double minDist = std::numeric_limits<double>::infinity();
+    double secondMinDist = std::numeric_limits<double>::infinity();
+    const double *centroid = cache.centroids;
+    for (uint32_t i = 0; i < cache.numCentroids; i++, centroid += dimension) {
+        double dist = KMeans::squaredDistance(p, centroid, dimension);
+        if (dist < minDist) {
+            secondMinDist = minDist;
+            minDist = dist;
+            closest = i;
+        } else if (dist < secondMinDist)
+            secondMinDist = dist;
+    }
+
+    result(0) = closest + 1;
+    result(1) = std::sqrt(minDist);
+    result(2) = std::sqrt(secondMinDist);
+    return result;
+}
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
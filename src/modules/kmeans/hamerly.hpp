@@ -0,0 +1,47 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file hamerly.hpp
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_KMEANS_HAMERLY_H
+#define MADLIB_KMEANS_HAMERLY_H
+
+#include <modules/common.hpp>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Assignment step of k-means that uses the triangle inequality to skip
+ *        distance computations (Hamerly's algorithm)
+ *
+ * Each point carries a bounds array <tt>{index, upper, lower}</tt>: the
+ * (1-based) index of the assigned centroid, an upper bound on the distance to
+ * it, and a lower bound on the distance to every other centroid. After the
+ * centroids move, the bounds are loosened by the distance each centroid
+ * drifted. Only if the bounds can no longer guarantee that the assignment is
+ * unchanged do we compute distances.
+ *
+ * Centroids are passed as in KMeans, i.e., as a single DOUBLE PRECISION array
+ * with all centroids one after another.
+ */
+struct Hamerly {
+    class CentroidCache;
+
+    static DoubleCol assign(AbstractDBInterface &db,
+        DoubleCol_const point, Array_const<double> bounds,
+        Array_const<double> centroids, Array_const<double> prevCentroids,
+        int32_t iteration);
+};
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
+
+#endif
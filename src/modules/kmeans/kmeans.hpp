@@ -0,0 +1,17 @@
+/* -----------------------------------------------------------------------------
+ *
+ * @file kmeans.hpp
+ *
+ * @brief Umbrella header that includes all k-means headers
+ *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * @namespace madlib::modules::kmeans
+ * 
+ * @brief k-means clustering
+ */
+
+#include <modules/kmeans/lloyd.hpp>
+#include <modules/kmeans/hamerly.hpp>
+#include <modules/kmeans/seeding.hpp>
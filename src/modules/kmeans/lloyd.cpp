@@ -0,0 +1,208 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file lloyd.cpp
+ *
+ * @brief Steps of Lloyd's algorithm for k-means clustering
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <modules/kmeans/lloyd.hpp>
+
+#include <cstring>
+#include <limits>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Centroids and their squared norms, cached across rows
+ *
+ * For point \f$ p \f$ and centroid \f$ c \f$, we have
+ * \f$ \| p - c \|^2 = \| p \|^2 - 2 p^T c + \| c \|^2 \f$. Since
+ * \f$ \| p \|^2 \f$ is the same for all centroids, the closest centroid
+ * minimizes \f$ \| c \|^2 - 2 p^T c \f$. Computing this takes one dot product
+ * per centroid, and no temporaries.
+ *
+ * The cache is stored in AbstractDBInterface::callSiteCache(). Comparing the
+ * centroids passed with the current row against a cached copy would take
+ * \f$ O(kd) \f$ time per row, i.e., as long as the assignment itself. The
+ * cache is therefore keyed on the iteration number passed by the caller, who
+ * is responsible for changing it whenever the centroids change. We keep a
+ * copy of the centroids because the argument memory does not outlive the
+ * call.
+ */
+class KMeans::CentroidCache {
+public:
+    /**
+     * @brief Return the cache for the given centroids. Recompute it if the
+     *     iteration number or the dimensions changed since the last call.
+     */
+    static const CentroidCache &get(AbstractDBInterface &db,
+        const Array_const<double> &inCentroids, uint32_t inDimension,
+        int32_t inIteration) {
+        
+        CentroidCache *cache = static_cast<CentroidCache*>(db.callSiteCache());
+        uint32_t numElements = inCentroids.num_elements();
+        
+        if (cache != NULL
+            && cache->iteration == inIteration
+            && cache->numElements == numElements
+            && cache->dimension == inDimension)
+            return *cache;
+        
+        AllocatorSPtr allocator = db.allocator(AbstractAllocator::kCallSite);
+        uint32_t numCentroids = numElements / inDimension;
+        
+        if (cache != NULL)
+            allocator->free(cache);
+        cache = static_cast<CentroidCache*>(allocator->allocate(
+            sizeof(CentroidCache)
+            + (numElements + numCentroids) * sizeof(double)));
+        db.callSiteCache() = cache;
+        
+        cache->iteration = inIteration;
+        cache->numElements = numElements;
+        cache->dimension = inDimension;
+        cache->numCentroids = numCentroids;
+        cache->centroids = reinterpret_cast<double*>(cache + 1);
+        cache->squaredNorms = cache->centroids + numElements;
+        std::memcpy(cache->centroids, inCentroids.data(),
+            numElements * sizeof(double));
+        
+        const double *centroid = cache->centroids;
+        for (uint32_t i = 0; i < numCentroids; i++) {
+            double squaredNorm = 0;
+            for (uint32_t j = 0; j < inDimension; j++, centroid++)
+                squaredNorm += *centroid * *centroid;
+            cache->squaredNorms[i] = squaredNorm;
+        }
+        
+        return *cache;
+    }
+    
+    int32_t iteration;
+    uint32_t numElements;
+    uint32_t dimension;
+    uint32_t numCentroids;
+    double *centroids;
+    double *squaredNorms;
+};
+
+/**
+ * @brief Return the (1-based) index of the centroid closest to a point
+ *
+ * Ties are broken in favor of the centroid with the smaller index.
+ *
+ * @param iteration Identifies \c centroids. The caller must pass a different
+ *     value whenever it passes different centroids through the same call site.
+ */
+int32_t KMeans::closestCentroid(AbstractDBInterface &db,
+    DoubleCol_const point, Array_const<double> centroids, int32_t iteration) {
+    
+    uint32_t dimension = point.n_elem;
+    
+    if (dimension == 0)
+        throw std::invalid_argument("Point has dimension 0.");
+    if (centroids.num_elements() == 0
+        || centroids.num_elements() % dimension != 0)
+        throw std::invalid_argument("Dimension of centroids does not match "
+            "dimension of point.");
+    if (!point.is_finite())
+        throw std::invalid_argument("Point is not finite.");
+    
+    const CentroidCache &cache = CentroidCache::get(db, centroids, dimension,
+        iteration);
+    const double *p = point.memptr();
+    const double *centroid = cache.centroids;
+    int32_t closest = 0;
+    double minDistance = std::numeric_limits<double>::infinity();
+    
+    for (uint32_t i = 0; i < cache.numCentroids; i++) {
+        double dotProduct = 0;
+        for (uint32_t j = 0; j < dimension; j++)
+            dotProduct += p[j] * centroid[j];
+        centroid += dimension;
+        
+        double distance = cache.squaredNorms[i] - 2. * dotProduct;
+        if (distance < minDistance) {
+            minDistance = distance;
+            closest = i;
+        }
+    }
+    
+    return closest + 1;
+}
+
+/**
+ * @brief Transition step of the mean-position aggregate
+ *
+ * The state is a DOUBLE PRECISION array containing the number of points and
+ * the sum of all points. It is initialized by the database as
+ * <tt>{0}</tt>.
+ */
+Array<double> KMeans::meanTransition(AbstractDBInterface &db,
+    Array<double> state, DoubleRow_const point) {
+    
+    if (!point.is_finite())
+        throw std::invalid_argument("Point is not finite.");
+    
+    if (state[0] == 0) {
+        state.rebind(db.allocator(AbstractAllocator::kAggregate),
+            boost::extents[ 1 + point.n_elem ]);
+    } else if (state.size() != 1 + point.n_elem)
+        throw std::invalid_argument("Points have different dimensions.");
+    
+    state[0]++;
+    double *sum = state.data() + 1;
+    for (uint32_t i = 0; i < point.n_elem; i++)
+        sum[i] += point(i);
+    
+    return state;
+}
+
+/**
+ * @brief Merge two states of the mean-position aggregate
+ */
+Array<double> KMeans::meanMergeStates(AbstractDBInterface & /* db */,
+    Array<double> stateLeft, Array<double> stateRight) {
+    
+    if (stateLeft[0] == 0)
+        return stateRight;
+    else if (stateRight[0] == 0)
+        return stateLeft;
+    
+    if (stateLeft.size() != stateRight.size())
+        throw std::invalid_argument("Points have different dimensions.");
+    
+    for (uint32_t i = 0; i < stateLeft.size(); i++)
+        stateLeft[i] += stateRight[i];
+    
+    return stateLeft;
+}
+
+/**
+ * @brief Final step of the mean-position aggregate
+ */
+DoubleCol KMeans::meanFinal(AbstractDBInterface &db,
+    Array_const<double> state) {
+    
+    if (state[0] == 0)
+        throw std::invalid_argument("Mean of empty set of points.");
+    
+    // For efficiency reasons, we want to return this by reference, so we need
+    // to bind to db memory
+    DoubleCol mean(db.allocator(), state.size() - 1);
+    for (uint32_t i = 0; i < mean.n_elem; i++)
+        mean(i) = state[i + 1] / state[0];
+    
+    return mean;
+}
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
@@ -0,0 +1,61 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file lloyd.hpp
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_KMEANS_LLOYD_H
+#define MADLIB_KMEANS_LLOYD_H
+
+#include <modules/common.hpp>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Steps of Lloyd's algorithm for k-means clustering: Assigning points
+ *        to the closest centroid, and recomputing centroids as mean positions
+ *
+ * Points are DOUBLE PRECISION arrays. A set of \f$ k \f$ centroids of
+ * dimension \f$ d \f$ is passed as a single DOUBLE PRECISION array of length
+ * \f$ k \cdot d \f$, containing the centroids one after another.
+ */
+struct KMeans {
+    class CentroidCache;
+    
+    /**
+     * @brief Return the squared Euclidean distance between two points
+     */
+    static double squaredDistance(const double *inX, const double *inY,
+        uint32_t inDimension) {
+        
+        double squaredDist = 0;
+        for (uint32_t i = 0; i < inDimension; i++) {
+            double diff = inX[i] - inY[i];
+            squaredDist += diff * diff;
+        }
+        return squaredDist;
+    }
+    
+    static int32_t closestCentroid(AbstractDBInterface &db,
+        DoubleCol_const point, Array_const<double> centroids,
+        int32_t iteration);
+    
+    static Array<double> meanTransition(AbstractDBInterface &db,
+        Array<double> state, DoubleRow_const point);
+    static Array<double> meanMergeStates(AbstractDBInterface &db,
+        Array<double> stateLeft, Array<double> stateRight);
+    static DoubleCol meanFinal(AbstractDBInterface &db,
+        Array_const<double> state);
+};
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
+
+#endif
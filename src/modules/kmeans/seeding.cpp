@@ -0,0 +1,461 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file seeding.cpp
+ *
+ * @brief k-means|| seeding aggregates
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <modules/kmeans/seeding.hpp>
+#include <modules/kmeans/lloyd.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <boost/random/linear_congruential.hpp>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+namespace {
+
+/**
+ * @brief Return the index of the closest point in a flat array of points, and
+ *     the squared distance to it
+ */
+inline uint32_t closestPoint(const double *inPoint, const double *inPoints,
+    uint32_t inNumPoints, uint32_t inDimension, double &outSquaredDist) {
+
+    uint32_t closest = 0;
+    outSquaredDist = std::numeric_limits<double>::infinity();
+    for (uint32_t i = 0; i < inNumPoints; i++, inPoints += inDimension) {
+        double dist = KMeans::squaredDistance(inPoint, inPoints, inDimension);
+        if (dist < outSquaredDist) {
+            outSquaredDist = dist;
+            closest = i;
+        }
+    }
+    return closest;
+}
+
+void checkArguments(const DoubleCol_const &inPoint,
+    const Array_const<double> &inCandidates) {
+
+    if (inPoint.n_elem == 0)
+        throw std::invalid_argument("Point has dimension 0.");
+    if (inCandidates.num_elements() == 0
+        || inCandidates.num_elements() % inPoint.n_elem != 0)
+        throw std::invalid_argument("Dimension of candidates does not match "
+            "dimension of point.");
+    if (!inPoint.is_finite())
+        throw std::invalid_argument("Point is not finite.");
+}
+
+} // namespace
+
+/**
+ * @brief Transition state of the sampling aggregate
+ *
+ * Layout of the DOUBLE PRECISION array:
+ * - [0]: dimension of points (0 if the state is not initialized yet)
+ * - [1]: sample size, i.e., the capacity of the reservoir
+ * - [2]: number of points in the reservoir
+ * - [3], [4]: smallest key in the reservoir and its slot. Only valid if the
+ *   reservoir is full.
+ * - Then, for each slot: the key, followed by the point coordinates
+ *
+ * The state is initialized by the database as <tt>{0}</tt>.
+ */
+class KMeansParallel::SampleState {
+public:
+    SampleState(const Array<double> &inStorage)
+      : mStorage(inStorage) { }
+
+    inline operator Array<double>() const {
+        return mStorage;
+    }
+
+    static uint32_t arraySize(uint32_t inDimension, uint32_t inSampleSize) {
+        return 5 + inSampleSize * (1 + inDimension);
+    }
+
+    bool isInitialized() const {
+        return mStorage[0] != 0;
+    }
+
+    void initialize(AllocatorSPtr inAllocator, uint32_t inDimension,
+        uint32_t inSampleSize) {
+
+        mStorage.rebind(inAllocator,
+            boost::extents[ arraySize(inDimension, inSampleSize) ]);
+        mStorage[0] = inDimension;
+        mStorage[1] = inSampleSize;
+    }
+
+    uint32_t dimension() const { return static_cast<uint32_t>(mStorage[0]); }
+    uint32_t sampleSize() const { return static_cast<uint32_t>(mStorage[1]); }
+    uint32_t numSampled() const { return static_cast<uint32_t>(mStorage[2]); }
+
+    double *slot(uint32_t inSlot) {
+        return mStorage.data() + 5 + inSlot * (1 + dimension());
+    }
+    const double *slot(uint32_t inSlot) const {
+        return mStorage.data() + 5 + inSlot * (1 + dimension());
+    }
+
+    /**
+     * @brief Offer a point with the given key to the reservoir
+     */
+    void insert(double inKey, const double *inPoint) {
+        uint32_t target;
+
+        if (numSampled() < sampleSize()) {
+            target = numSampled();
+            mStorage[2]++;
+        } else if (inKey > mStorage[3])
+            target = static_cast<uint32_t>(mStorage[4]);
+        else
+            return;
+
+        double *record = slot(target);
+        record[0] = inKey;
+        std::memcpy(record + 1, inPoint, dimension() * sizeof(double));
+
+        if (numSampled() == sampleSize())
+            updateMinimum();
+    }
+
+    /**
+     * @brief Merge another reservoir into this one
+     */
+    void merge(const SampleState &inOther) {
+        if (inOther.dimension() != dimension()
+            || inOther.sampleSize() != sampleSize())
+            throw std::invalid_argument("Inconsistent sampling states.");
+
+        for (uint32_t i = 0; i < inOther.numSampled(); i++) {
+            const double *record = inOther.slot(i);
+            insert(record[0], record + 1);
+        }
+    }
+
+private:
+    void updateMinimum() {
+        uint32_t minSlot = 0;
+        double minKey = slot(0)[0];
+        for (uint32_t i = 1; i < numSampled(); i++) {
+            if (slot(i)[0] < minKey) {
+                minKey = slot(i)[0];
+                minSlot = i;
+            }
+        }
+        mStorage[3] = minKey;
+        mStorage[4] = minSlot;
+    }
+
+    Array<double> mStorage;
+};
+
+/**
+ * @brief Transition state of the seeding aggregate
+ *
+ * Layout of the DOUBLE PRECISION array:
+ * - [0]: dimension of points (0 if the state is not initialized yet)
+ * - [1]: number of candidates \f$ m \f$
+ * - [2]: number of seeds \f$ k \f$
+ * - [3]: random variate used to seed the final k-means++ run
+ * - Then \f$ m \f$ weights, followed by the coordinates of all \f$ m \f$
+ *   candidates
+ *
+ * The state is initialized by the database as <tt>{0}</tt>.
+ */
+class KMeansParallel::SeedState {
+public:
+    SeedState(const Array<double> &inStorage)
+      : mStorage(inStorage) { }
+
+    inline operator Array<double>() const {
+        return mStorage;
+    }
+
+    bool isInitialized() const {
+        return mStorage[0] != 0;
+    }
+
+    void initialize(AllocatorSPtr inAllocator, uint32_t inDimension,
+        const Array_const<double> &inCandidates, uint32_t inK,
+        double inRandom) {
+
+        uint32_t numCandidates = inCandidates.num_elements() / inDimension;
+
+        mStorage.rebind(inAllocator,
+            boost::extents[ 4 + numCandidates * (1 + inDimension) ]);
+        mStorage[0] = inDimension;
+        mStorage[1] = numCandidates;
+        mStorage[2] = inK;
+        mStorage[3] = inRandom;
+        std::memcpy(candidates(), inCandidates.data(),
+            inCandidates.num_elements() * sizeof(double));
+    }
+
+    uint32_t dimension() const { return static_cast<uint32_t>(mStorage[0]); }
+    uint32_t numCandidates() const {
+        return static_cast<uint32_t>(mStorage[1]);
+    }
+    double *weights() { return mStorage.data() + 4; }
+    const double *weights() const { return mStorage.data() + 4; }
+    double *candidates() { return mStorage.data() + 4 + numCandidates(); }
+    const double *candidates() const {
+        return mStorage.data() + 4 + numCandidates();
+    }
+
+private:
+    Array<double> mStorage;
+};
+
+/**
+ * @brief Update the squared distance of a point to its closest candidate
+ *
+ * @param point Point coordinates
+ * @param candidates Candidates added since \c squaredDist was computed. May be
+ *     empty.
+ * @param squaredDist Squared distance to the closest of the earlier
+ *     candidates, or infinity if there are none
+ * @return The squared distance to the closest of all candidates
+ */
+double KMeansParallel::minSquaredDistance(AbstractDBInterface & /* db */,
+    DoubleCol_const point, Array_const<double> candidates,
+    double squaredDist) {
+
+    if (candidates.num_elements() == 0)
+        return squaredDist;
+
+    checkArguments(point, candidates);
+
+    double newSquaredDist;
+    closestPoint(point.memptr(), candidates.data(),
+        candidates.num_elements() / point.n_elem, point.n_elem,
+        newSquaredDist);
+
+    return std::min(squaredDist, newSquaredDist);
+}
+
+/**
+ * @brief Transition step of the sampling aggregate
+ *
+ * @param state Transition state
+ * @param point Point coordinates
+ * @param squaredDist Squared distance of the point to the closest candidate
+ *     (see minSquaredDistance())
+ * @param sampleSize Number of points to sample
+ * @param uniform Uniform random variate in [0, 1)
+ */
+Array<double> KMeansParallel::sampleTransition(AbstractDBInterface &db,
+    Array<double> inState, DoubleCol_const point, double squaredDist,
+    int32_t sampleSize, double uniform) {
+
+    if (point.n_elem == 0)
+        throw std::invalid_argument("Point has dimension 0.");
+    if (!point.is_finite())
+        throw std::invalid_argument("Point is not finite.");
+    if (!(squaredDist >= 0)
+        || squaredDist == std::numeric_limits<double>::infinity())
+        throw std::invalid_argument("Squared distance to the candidates must "
+            "be non-negative and finite.");
+    if (sampleSize <= 0)
+        throw std::invalid_argument("Sample size must be positive.");
+
+    SampleState state = inState;
+    if (!state.isInitialized())
+        state.initialize(db.allocator(AbstractAllocator::kAggregate),
+            point.n_elem, sampleSize);
+    else if (state.dimension() != point.n_elem)
+        throw std::invalid_argument("Points have different dimensions.");
+
+    // Points that coincide with a candidate, and random variates of 0, have
+    // key -infinity and are never sampled
+    if (squaredDist > 0 && uniform > 0)
+        state.insert(std::log(uniform) / squaredDist, point.memptr());
+
+    return state;
+}
+
+/**
+ * @brief Merge two states of the sampling aggregate
+ */
+Array<double> KMeansParallel::sampleMergeStates(AbstractDBInterface & /* db */,
+    Array<double> inStateLeft, Array<double> inStateRight) {
+
+    SampleState stateLeft = inStateLeft;
+    const SampleState stateRight = inStateRight;
+
+    if (!stateLeft.isInitialized())
+        return stateRight;
+    else if (!stateRight.isInitialized())
+        return stateLeft;
+
+    stateLeft.merge(stateRight);
+    return stateLeft;
+}
+
+/**
+ * @brief Final step of the sampling aggregate
+ *
+ * @return The sampled points, one after another
+ */
+DoubleCol KMeansParallel::sampleFinal(AbstractDBInterface &db,
+    Array_const<double> inState) {
+
+    uint32_t dimension = static_cast<uint32_t>(inState[0]);
+    uint32_t numSampled = dimension == 0
+        ? 0 : static_cast<uint32_t>(inState[2]);
+
+    DoubleCol sample(db.allocator(), numSampled * dimension);
+    for (uint32_t i = 0; i < numSampled; i++)
+        std::memcpy(sample.memptr() + i * dimension,
+            inState.data() + 5 + i * (1 + dimension) + 1,
+            dimension * sizeof(double));
+
+    return sample;
+}
+
+/**
+ * @brief Transition step of the seeding aggregate
+ *
+ * @param state Transition state
+ * @param point Point coordinates
+ * @param candidates Candidates from the sampling passes
+ * @param k Number of seeds
+ * @param uniform Uniform random variate in [0, 1). Only the value of the first
+ *     row is used.
+ */
+Array<double> KMeansParallel::seedTransition(AbstractDBInterface &db,
+    Array<double> inState, DoubleCol_const point,
+    Array_const<double> candidates, int32_t k, double uniform) {
+
+    checkArguments(point, candidates);
+    if (k <= 0)
+        throw std::invalid_argument("Number of seeds must be positive.");
+
+    SeedState state = inState;
+    if (!state.isInitialized())
+        state.initialize(db.allocator(AbstractAllocator::kAggregate),
+            point.n_elem, candidates, k, uniform);
+    else if (state.dimension() != point.n_elem)
+        throw std::invalid_argument("Points have different dimensions.");
+
+    double squaredDist;
+    uint32_t closest = closestPoint(point.memptr(), state.candidates(),
+        state.numCandidates(), point.n_elem, squaredDist);
+    state.weights()[closest]++;
+
+    return state;
+}
+
+/**
+ * @brief Merge two states of the seeding aggregate
+ */
+Array<double> KMeansParallel::seedMergeStates(AbstractDBInterface & /* db */,
+    Array<double> inStateLeft, Array<double> inStateRight) {
+
+    SeedState stateLeft = inStateLeft;
+    const SeedState stateRight = inStateRight;
+
+    if (!stateLeft.isInitialized())
+        return stateRight;
+    else if (!stateRight.isInitialized())
+        return stateLeft;
+
+    if (stateLeft.dimension() != stateRight.dimension()
+        || stateLeft.numCandidates() != stateRight.numCandidates())
+        throw std::invalid_argument("Inconsistent seeding states.");
+
+    for (uint32_t i = 0; i < stateLeft.numCandidates(); i++)
+        stateLeft.weights()[i] += stateRight.weights()[i];
+
+    return stateLeft;
+}
+
+/**
+ * @brief Final step of the seeding aggregate: Weighted k-means++ on the
+ *     candidates
+ *
+ * The first seed is chosen with probability proportional to the weight of
+ * a candidate, each further seed with probability proportional to the weight
+ * times the squared distance to the closest seed chosen so far.
+ *
+ * @return At most \f$ k \f$ seeds, one after another. Fewer seeds are returned
+ *     if there are fewer distinct candidates with positive weight.
+ */
+DoubleCol KMeansParallel::seedFinal(AbstractDBInterface &db,
+    Array_const<double> inState) {
+
+    uint32_t dimension = static_cast<uint32_t>(inState[0]);
+    if (dimension == 0)
+        return DoubleCol(db.allocator(), 0);
+
+    uint32_t numCandidates = static_cast<uint32_t>(inState[1]);
+    uint32_t k = static_cast<uint32_t>(inState[2]);
+    const double *weights = inState.data() + 4;
+    const double *candidates = weights + numCandidates;
+
+    // Seeds of minstd_rand must be in [1, modulus - 1]
+    boost::minstd_rand generator(
+        static_cast<boost::minstd_rand::result_type>(
+            inState[3] * (boost::minstd_rand::modulus - 2)) + 1);
+
+    // Probability mass of each candidate
+    std::vector<double> mass(weights, weights + numCandidates);
+    std::vector<uint32_t> seeds;
+
+    while (seeds.size() < k) {
+        double totalMass = 0;
+        for (uint32_t i = 0; i < numCandidates; i++)
+            totalMass += mass[i];
+        if (!(totalMass > 0))
+            break;
+
+        double target = totalMass
+            * static_cast<double>(generator() - generator.min())
+            / (static_cast<double>(generator.max()) - generator.min() + 1);
+        uint32_t chosen = 0;
+        double cumulative = 0;
+        for (uint32_t i = 0; i < numCandidates; i++) {
+            if (mass[i] <= 0)
+                continue;
+            chosen = i;
+            cumulative += mass[i];
+            if (cumulative > target)
+                break;
+        }
+        seeds.push_back(chosen);
+
+        const double *seed = candidates + chosen * dimension;
+        for (uint32_t i = 0; i < numCandidates; i++) {
+            double squaredDist = KMeans::squaredDistance(seed,
+                candidates + i * dimension, dimension);
+            double candidateMass = weights[i] * squaredDist;
+            if (seeds.size() == 1 || candidateMass < mass[i])
+                mass[i] = candidateMass;
+        }
+    }
+
+    DoubleCol result(db.allocator(), seeds.size() * dimension);
+    for (uint32_t i = 0; i < seeds.size(); i++)
+        std::memcpy(result.memptr() + i * dimension,
+            candidates + seeds[i] * dimension, dimension * sizeof(double));
+
+    return result;
+}
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
@@ -0,0 +1,82 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file seeding.hpp
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_KMEANS_SEEDING_H
+#define MADLIB_KMEANS_SEEDING_H
+
+#include <modules/common.hpp>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Seeding of k-means with k-means|| (scalable k-means++)
+ *
+ * k-means|| [1] starts with a single random candidate and then, in
+ * \f$ O(\log k) \f$ passes over the data, oversamples points with probability
+ * proportional to their squared distance to the current candidates. A final
+ * pass counts how many points are closest to each candidate, and the weighted
+ * candidates are reduced to \f$ k \f$ seeds with k-means++.
+ *
+ * Each point keeps its squared distance to the closest candidate across
+ * rounds. A round only measures the distance to the candidates sampled in the
+ * previous round (minSquaredDistance()), so all rounds together cost
+ * \f$ O(\text{rounds} \cdot k \cdot n) \f$ distance computations.
+ *
+ * Each pass is a single aggregate:
+ * - sampleTransition() etc. draw a weighted sample of fixed size without
+ *   replacement, using a reservoir where each point has key
+ *   \f$ \log(u) / d^2 \f$ for a uniform random variate \f$ u \f$ (this is the
+ *   reservoir algorithm A-Res [2]). Reservoirs of different segments are
+ *   merged by keeping the largest keys.
+ * - seedTransition() etc. weight the candidates. The final function runs
+ *   weighted k-means++ on the candidates.
+ *
+ * Points and sets of points are passed as in KMeans. Random variates are
+ * passed as arguments (e.g., <tt>random()</tt>), so that all randomness is
+ * under the control of the database.
+ *
+ * [1] Bahmani, Bahman, Moseley, Benjamin, Vattani, Andrea, Kumar, Ravi, and
+ *     Vassilvitskii, Sergei: Scalable K-Means++, Proceedings of the VLDB
+ *     Endowment 5(7), 2012
+ * [2] Efraimidis, Pavlos S., and Spirakis, Paul G.: Weighted random sampling
+ *     with a reservoir, Information Processing Letters 97(5), 2006
+ */
+struct KMeansParallel {
+    class SampleState;
+    class SeedState;
+
+    static double minSquaredDistance(AbstractDBInterface &db,
+        DoubleCol_const point, Array_const<double> candidates,
+        double squaredDist);
+
+    static Array<double> sampleTransition(AbstractDBInterface &db,
+        Array<double> state, DoubleCol_const point, double squaredDist,
+        int32_t sampleSize, double uniform);
+    static Array<double> sampleMergeStates(AbstractDBInterface &db,
+        Array<double> stateLeft, Array<double> stateRight);
+    static DoubleCol sampleFinal(AbstractDBInterface &db,
+        Array_const<double> state);
+
+    static Array<double> seedTransition(AbstractDBInterface &db,
+        Array<double> state, DoubleCol_const point,
+        Array_const<double> candidates, int32_t k, double uniform);
+    static Array<double> seedMergeStates(AbstractDBInterface &db,
+        Array<double> stateLeft, Array<double> stateRight);
+    static DoubleCol seedFinal(AbstractDBInterface &db,
+        Array_const<double> state);
+};
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
+
+#endif
@@ -9,6 +9,7 @@
 #ifndef MADLIB_MODULES_MODULES_HPP
 #define MADLIB_MODULES_MODULES_HPP
 
+#include <modules/kmeans/kmeans.hpp>
 #include <modules/prob/prob.hpp>
 #include <modules/regress/regress.hpp>
 
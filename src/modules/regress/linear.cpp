@@ -10,6 +10,10 @@
 #include <modules/prob/student.hpp>
 #include <utils/Reference.hpp>
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 // Floating-point classification functions are in C99 and TR1, but not in the
 // official C++ Standard (before C++0x). We therefore use the Boost implementation
 #include <boost/math/special_functions/fpclassify.hpp>
@@ -37,76 +41,413 @@ namespace regress {
  * TransitionState encapsualtes the transition state during the
  * linear-regression aggregate functions. To the database, the state is exposed
  * as a single DOUBLE PRECISION array, to the C++ code it is a proper object
- * containing scalars, a vector, and a matrix.
+ * containing scalars, vectors, and matrices.
+ *
+ * There are two layouts, chosen by the initial value of the state:
+ * - kSums (the default): We accumulate \f$ \sum_i y_i \f$,
+ *   \f$ \sum_i y_i^2 \f$, \f$ X^T \boldsymbol y \f$, and \f$ X^T X \f$.
+ * - kMoments: We keep running means \f$ \bar y \f$ and \f$ \bar{\boldsymbol x}
+ *   \f$, and the co-moments \f$ \sum_i (y_i - \bar y)^2 \f$,
+ *   \f$ \sum_i (\boldsymbol x_i - \bar{\boldsymbol x}) (y_i - \bar y) \f$, and
+ *   \f$ \sum_i (\boldsymbol x_i - \bar{\boldsymbol x})
+ *   (\boldsymbol x_i - \bar{\boldsymbol x})^T \f$. Partial results are
+ *   combined with the pairwise update formulas by Chan et al. [1]. This
+ *   avoids the catastrophic cancellation in
+ *   \f$ \sum_i y_i^2 - (\sum_i y_i)^2 / n \f$ on large, uncentered data.
+ *
+ * Since \f$ X^T X \f$ (or the co-moment matrix) is symmetric, we only store
+ * its upper triangle, packed column by column (the same layout as LAPACK's
+ * packed storage with <tt>UPLO = 'U'</tt>). Rows are not added one at a time.
+ * Instead, they are collected in a block of kBlockRows rows, which is flushed
+ * with a single rank-k update (see flush()). The full matrix is only
+ * materialized in the final step.
  *
  * Note: We assume that the DOUBLE PRECISION array is initialized by the
- * database with length at least 5, and all elemenets are 0.
+ * database with length at least 6, all elemenets are 0 except for the layout
+ * (element 2). The array must be writable, i.e., the caller needs to pass a
+ * copy if the memory must not be modified in-place.
+ *
+ * [1] Chan, Tony F., Golub, Gene H., and LeVeque, Randall J.: Updating
+ *     Formulae and a Pairwise Algorithm for Computing Sample Variances,
+ *     Technical Report STAN-CS-79-773, Stanford University, 1979
  */
 class LinearRegression::TransitionState {
 public:
+    enum Layout { kSums = 0, kMoments = 1 };
+
+    /**
+     * Number of rows that are buffered before they are added to
+     * \f$ X^T X \f$ and \f$ X^T \boldsymbol y \f$.
+     */
+    static const uint16_t kBlockRows = 32;
+
     /**
      * @internal Member initalization occurs in the order of declaration in the
      *      class (see ISO/IEC 14882:2003, Section 12.6.2). The order in the
      *      init list is irrelevant. It is important that mStorage gets
      *      initialized before the other members!
      */
-    TransitionState(AnyValue inArg)
-        : mStorage(inArg.copyIfImmutable()),
+    TransitionState(const Array<double> &inStorage)
+        : mStorage(inStorage),
           numRows(&mStorage[0]),
           widthOfX(&mStorage[1]),
-          y_sum(&mStorage[2]),
-          y_square_sum(&mStorage[3]),
+          layout(&mStorage[2]),
+          numBuffered(&mStorage[3]),
+          y_sum(&mStorage[4]),
+          y_square_sum(&mStorage[5]),
+          y_mean(&mStorage[4]),
+          y_comoment(&mStorage[5]),
           X_transp_Y(
-            TransparentHandle::create(&mStorage[4]),
+            TransparentHandle::create(mStorage.data() + 6),
+            widthOfX),
+          xy_comoment(
+            TransparentHandle::create(mStorage.data() + 6),
             widthOfX),
-          X_transp_X(
-            TransparentHandle::create(&mStorage[4 + widthOfX]),
-            widthOfX, widthOfX) { }
+          x_mean(
+            TransparentHandle::create(mStorage.data() + 6 + widthOfX),
+            widthOfX),
+          X_transp_X_packed(
+            TransparentHandle::create(mStorage.data() + 6 + 2 * widthOfX),
+            packedSize(widthOfX)),
+          xx_comoment_packed(
+            TransparentHandle::create(mStorage.data() + 6 + 2 * widthOfX),
+            packedSize(widthOfX)),
+          y_block(
+            TransparentHandle::create(mStorage.data() + blockOffset(widthOfX)),
+            kBlockRows),
+          X_block(
+            TransparentHandle::create(
+                mStorage.data() + blockOffset(widthOfX) + kBlockRows),
+            kBlockRows, widthOfX) { }
 
     /**
-     * We define this function so that we can use TransitionState in the argument
-     * list and as a return type.
+     * We define this function so that we can use TransitionState as a return
+     * type.
      */
-    inline operator AnyValue() const {
+    inline operator Array<double>() const {
         return mStorage;
     }
     
     /**
      * @brief Initialize the transition state. Only called for first row.
+     *
+     * The layout is taken from the initial state.
      */
     inline void initialize(AllocatorSPtr inAllocator,
         const uint16_t inWidthOfX) {
         
+        uint16_t inLayout = layout;
+        if (inLayout != kSums && inLayout != kMoments)
+            throw std::invalid_argument("Invalid initial transition state.");
+
         mStorage.rebind(inAllocator, boost::extents[ arraySize(inWidthOfX) ]);
         numRows.rebind(&mStorage[0]) = 0;
         widthOfX.rebind(&mStorage[1]) = inWidthOfX;
-        y_sum.rebind(&mStorage[2]) = 0;
-        y_square_sum.rebind(&mStorage[3]) = 0;
+        layout.rebind(&mStorage[2]) = inLayout;
+        numBuffered.rebind(&mStorage[3]) = 0;
+        y_sum.rebind(&mStorage[4]) = 0;
+        y_square_sum.rebind(&mStorage[5]) = 0;
+        y_mean.rebind(&mStorage[4]);
+        y_comoment.rebind(&mStorage[5]);
         X_transp_Y.rebind(
-            TransparentHandle::create(&mStorage[4]),
+            TransparentHandle::create(mStorage.data() + 6),
+            inWidthOfX);
+        xy_comoment.rebind(
+            TransparentHandle::create(mStorage.data() + 6),
             inWidthOfX);
-        X_transp_X.rebind(
-            TransparentHandle::create(&mStorage[4 + inWidthOfX]),
-            inWidthOfX, inWidthOfX);
+        x_mean.rebind(
+            TransparentHandle::create(mStorage.data() + 6 + inWidthOfX),
+            inWidthOfX);
+        X_transp_X_packed.rebind(
+            TransparentHandle::create(mStorage.data() + 6 + 2 * inWidthOfX),
+            packedSize(inWidthOfX));
+        xx_comoment_packed.rebind(
+            TransparentHandle::create(mStorage.data() + 6 + 2 * inWidthOfX),
+            packedSize(inWidthOfX));
+        y_block.rebind(
+            TransparentHandle::create(mStorage.data() + blockOffset(inWidthOfX)),
+            kBlockRows);
+        X_block.rebind(
+            TransparentHandle::create(
+                mStorage.data() + blockOffset(inWidthOfX) + kBlockRows),
+            kBlockRows, inWidthOfX);
+    }
+
+    /**
+     * @brief Append a row to the block of buffered rows. Flush if the block
+     *     is full.
+     */
+    inline void append(double y, const DoubleRow_const &x) {
+        uint16_t row = numBuffered;
+
+        numRows++;
+        if (layout == kSums) {
+            y_sum += y;
+            y_square_sum += y * y;
+        }
+        y_block(row) = y;
+        X_block.row(row) = x;
+        if (++numBuffered == kBlockRows)
+            flush();
+    }
+
+    /**
+     * @brief Add all buffered rows to the accumulated sums or moments
+     */
+    inline void flush() {
+        addBlock(*this, numRows - numBuffered);
+        numBuffered = 0;
+    }
+
+    /**
+     * @brief Return the normal equations \f$ X^T X \f$ and
+     *     \f$ X^T \boldsymbol y \f$
+     *
+     * Buffered rows are not included. Call flush() first. In the moments
+     * layout, this is only needed for models without an intercept, which
+     * cannot be solved from the centered co-moments (see solveCentered()).
+     */
+    void normalEquations(mat &outX_transp_X, vec &outX_transp_Y) const {
+        outX_transp_X.set_size(widthOfX, widthOfX);
+        const double *packed = X_transp_X_packed.memptr();
+
+        for (uint16_t j = 0; j < widthOfX; j++)
+            for (uint16_t i = 0; i <= j; i++, packed++)
+                outX_transp_X(i, j) = outX_transp_X(j, i) = *packed;
+        outX_transp_Y = X_transp_Y;
+
+        if (layout == kMoments) {
+            // X^T X = C_xx + n * mean_x * mean_x^T, X^T y = C_xy + n * mean_x
+            // * mean_y
+            outX_transp_X += static_cast<double>(numRows) * x_mean
+                * trans(x_mean);
+            outX_transp_Y += static_cast<double>(numRows) * y_mean * x_mean;
+        }
+    }
+
+    /**
+     * @brief Return the total sum of squares \f$ \sum_i (y_i - \bar y)^2 \f$
+     */
+    double totalSumOfSquares() const {
+        if (layout == kMoments)
+            return y_comoment;
+
+        return y_square_sum - y_sum * y_sum / numRows;
+    }
+
+    /**
+     * @brief Return whether the model has an intercept, so that it can be
+     *     solved from the centered co-moments
+     *
+     * Moments layout only. The model has an intercept if one of the constant
+     * columns (see isConstantColumn()) is not identically zero.
+     */
+    bool hasIntercept() const {
+        if (layout != kMoments)
+            return false;
+
+        for (uint16_t j = 0; j < widthOfX; j++)
+            if (isConstantColumn(j) && x_mean(j) != 0)
+                return true;
+        return false;
+    }
+
+    double solveCentered(vec &outCoef, mat &outInverse) const;
+
+    /**
+     * @brief Return the explained sum of squares for the given coefficients
+     *
+     * In the moments layout with an intercept, the fitted values have mean
+     * \f$ \bar y \f$, so \f$ ESS = \boldsymbol c_S^T C_{Sy} \f$ comes from the
+     * centered co-moments of the varying columns \f$ S \f$ alone. Without an
+     * intercept, we use \f$ ESS = \boldsymbol c^T C_{xy} - n \bar y (\bar y -
+     * \bar{\boldsymbol x}^T \boldsymbol c) \f$, the same quantity as in the
+     * sums layout.
+     */
+    double explainedSumOfSquares(const vec &inCoef) const {
+        if (hasIntercept()) {
+            double ess = 0;
+            for (uint16_t j = 0; j < widthOfX; j++)
+                if (!isConstantColumn(j))
+                    ess += xy_comoment(j) * inCoef(j);
+            return ess;
+        } else if (layout == kMoments)
+            return dot(xy_comoment, inCoef)
+                - numRows * y_mean * (y_mean - dot(x_mean, inCoef));
+
+        return dot(X_transp_Y, inCoef) - y_sum * y_sum / numRows;
     }
     
     /**
      * @brief Merge with another TransitionState object
+     *
+     * The rows buffered in this state are flushed, and the rows buffered in
+     * the other state are added without modifying it.
      */
     TransitionState &operator+=(const TransitionState &inOtherState) {
-        if (mStorage.size() != inOtherState.mStorage.size())
+        if (mStorage.size() != inOtherState.mStorage.size()
+            || layout != inOtherState.layout)
             throw std::logic_error("Internal error: Incompatible transition states");
-            
-        for (uint32_t i = 0; i < mStorage.size(); i++)
-            mStorage[i] += inOtherState.mStorage[i];
         
-        widthOfX = inOtherState.widthOfX;
+        flush();
+
+        uint64_t numOtherAggregated
+            = inOtherState.numRows - inOtherState.numBuffered;
+        if (layout == kSums) {
+            y_sum += inOtherState.y_sum;
+            y_square_sum += inOtherState.y_square_sum;
+            X_transp_Y += inOtherState.X_transp_Y;
+            X_transp_X_packed += inOtherState.X_transp_X_packed;
+        } else if (numOtherAggregated > 0) {
+            addMoments(numRows, numOtherAggregated, inOtherState.y_mean,
+                inOtherState.x_mean, inOtherState.y_comoment,
+                inOtherState.xy_comoment,
+                inOtherState.xx_comoment_packed.memptr());
+        }
+        addBlock(inOtherState, numRows + numOtherAggregated);
+        numRows += inOtherState.numRows;
         return *this;
     }
         
 private:
+    static inline uint32_t packedSize(const uint16_t inWidthOfX) {
+        return static_cast<uint32_t>(inWidthOfX) * (inWidthOfX + 1) / 2;
+    }
+
+    static inline uint32_t blockOffset(const uint16_t inWidthOfX) {
+        return 6 + 2 * inWidthOfX + packedSize(inWidthOfX);
+    }
+
     static inline uint32_t arraySize(const uint16_t inWidthOfX) {
-        return 4 + inWidthOfX + inWidthOfX * inWidthOfX;
+        return blockOffset(inWidthOfX) + kBlockRows * (1 + inWidthOfX);
+    }
+
+    /**
+     * @brief Return entry (i, j) of the co-moment matrix of x
+     */
+    double xxComoment(uint16_t i, uint16_t j) const {
+        if (i > j)
+            std::swap(i, j);
+        return xx_comoment_packed(packedSize(j) + i);
+    }
+
+    /**
+     * @brief Return whether column j of the design matrix is constant
+     *
+     * Moments layout only. A column is constant if its co-moment is at most
+     * \f$ n \bar x_j^2 \epsilon^2 \f$: Its deviations from the mean are
+     * then within rounding error of the mean.
+     */
+    bool isConstantColumn(uint16_t j) const {
+        const double eps = std::numeric_limits<double>::epsilon();
+        return xxComoment(j, j) <= numRows * x_mean(j) * x_mean(j) * eps * eps;
+    }
+
+    /**
+     * @brief Symmetric rank-k update with the rows buffered in a state
+     *
+     * In the sums layout, we update \f$ X^T X \mathrel{+}= B^T B \f$ (upper
+     * triangle only) and \f$ X^T \boldsymbol y \mathrel{+}= B^T \boldsymbol
+     * y_B \f$, where \f$ B \f$ are the first \c numBuffered rows of
+     * \c inState.X_block. Since X_block is stored column-major, each entry of
+     * the upper triangle is a dot product of two contiguous columns of length
+     * at most kBlockRows, which stay in cache for the whole update.
+     *
+     * In the moments layout, we center the block at its own mean first,
+     * compute the block's co-moments the same way, and then combine them with
+     * the accumulated moments of \c inNumAggregated rows (see addMoments()).
+     */
+    void addBlock(const TransitionState &inState, uint64_t inNumAggregated) {
+        const uint16_t k = inState.numBuffered;
+        if (k == 0)
+            return;
+
+        if (layout == kSums) {
+            addRankK(inState.X_block.memptr(), kBlockRows, k,
+                X_transp_X_packed.memptr());
+            X_transp_Y += trans(inState.X_block.rows(0, k - 1))
+                * inState.y_block.rows(0, k - 1);
+            return;
+        }
+
+        mat block = inState.X_block.rows(0, k - 1);
+        vec y = inState.y_block.rows(0, k - 1);
+        vec blockXMean = trans(mean(block));
+        double blockYMean = mean(y);
+
+        block -= arma::ones<vec>(k) * trans(blockXMean);
+        y -= blockYMean;
+
+        if (inNumAggregated == 0) {
+            y_mean = blockYMean;
+            x_mean = blockXMean;
+            y_comoment = dot(y, y);
+            xy_comoment = trans(block) * y;
+            xx_comoment_packed.zeros();
+            addRankK(block.memptr(), k, k, xx_comoment_packed.memptr());
+            return;
+        }
+
+        // The block co-moments of x are added in place by addRankK()
+        addMoments(inNumAggregated, k, blockYMean, blockXMean, dot(y, y),
+            trans(block) * y, NULL);
+        addRankK(block.memptr(), k, k, xx_comoment_packed.memptr());
+    }
+
+    /**
+     * @brief Add the upper triangle of \f$ B^T B \f$ to a packed matrix
+     *
+     * @param inBlock Column-major matrix \f$ B \f$ with \c inStride rows (of
+     *     which only the first \c inNumRows are used) and widthOfX columns
+     */
+    void addRankK(const double *inBlock, uint16_t inStride,
+        uint16_t inNumRows, double *ioPacked) const {
+
+        for (uint16_t j = 0; j < widthOfX; j++) {
+            const double *col_j = inBlock + j * inStride;
+            for (uint16_t i = 0; i <= j; i++, ioPacked++) {
+                const double *col_i = inBlock + i * inStride;
+                double sum = 0;
+                for (uint16_t r = 0; r < inNumRows; r++)
+                    sum += col_i[r] * col_j[r];
+                *ioPacked += sum;
+            }
+        }
+    }
+
+    /**
+     * @brief Combine the moments of \c inNumA rows (this state) with the
+     *     moments of \c inNumB other rows
+     *
+     * With \f$ \delta = \bar x_B - \bar x_A \f$ and \f$ n = n_A + n_B \f$:
+     * \f$ \bar x = \bar x_A + \delta \frac{n_B}{n} \f$ and
+     * \f$ C = C_A + C_B + \delta \delta^T \frac{n_A n_B}{n} \f$.
+     * If \c inXXComomentPacked is \c NULL, the x co-moments of the other rows
+     * are added by the caller.
+     */
+    void addMoments(uint64_t inNumA, uint64_t inNumB, double inYMean,
+        const vec &inXMean, double inYComoment, const vec &inXYComoment,
+        const double *inXXComomentPacked) {
+
+        double n = static_cast<double>(inNumA) + inNumB;
+        double factor = static_cast<double>(inNumA) * inNumB / n;
+        double deltaY = inYMean - y_mean;
+        vec deltaX = inXMean - x_mean;
+
+        y_comoment += inYComoment + factor * deltaY * deltaY;
+        xy_comoment += inXYComoment + factor * deltaY * deltaX;
+
+        double *packed = xx_comoment_packed.memptr();
+        const double *otherPacked = inXXComomentPacked;
+        for (uint16_t j = 0; j < widthOfX; j++)
+            for (uint16_t i = 0; i <= j; i++, packed++) {
+                *packed += factor * deltaX(i) * deltaX(j);
+                if (otherPacked)
+                    *packed += *(otherPacked++);
+            }
+
+        y_mean += deltaY * inNumB / n;
+        x_mean += deltaX * (inNumB / n);
     }
 
     Array<double> mStorage;
@@ -114,29 +455,47 @@ private:
 public:
     Reference<double, uint64_t> numRows;
     Reference<double, uint16_t> widthOfX;
+    Reference<double, uint16_t> layout;
+    Reference<double, uint16_t> numBuffered;
+
+    // Sums layout
     Reference<double> y_sum;
     Reference<double> y_square_sum;
+
+    // Moments layout (aliases of the above)
+    Reference<double> y_mean;
+    Reference<double> y_comoment;
+
+    // Sums layout: X^T y. Moments layout: co-moments of x and y.
     DoubleCol X_transp_Y;
-    DoubleMat X_transp_X;
+    DoubleCol xy_comoment;
+
+    // Moments layout only
+    DoubleCol x_mean;
+
+    // Sums layout: X^T X. Moments layout: co-moments of x. Both packed.
+    DoubleCol X_transp_X_packed;
+    DoubleCol xx_comoment_packed;
+
+    DoubleCol y_block;
+    DoubleMat X_block;
 };
 
 /**
  * @brief Perform the linear-regression transition step
  * 
- * We update: the number of rows \f$ n \f$, the partial sums
- * \f$ \sum_{i=1}^n y_i \f$ and \f$ \sum_{i=1}^n y_i^2 \f$, the matrix
- * \f$ X^T X \f$, and the vector \f$ X^T \boldsymbol y \f$.
+ * We update the number of rows \f$ n \f$ and append the row to the block of
+ * buffered rows. Only when the block is full, we update the accumulated sums
+ * (or moments), see TransitionState.
  */
-AnyValue LinearRegression::transition(AbstractDBInterface &db, AnyValue args) {
-    AnyValue::iterator arg(args);
+Array<double> LinearRegression::transition(AbstractDBInterface &db,
+    Array<double> inState, double y, DoubleRow_const x) {
     
-    // Arguments from SQL call. Immutable values passed by reference should be
-    // instantiated from the respective <tt>_const</tt> class. Otherwise, the
+    // Immutable values passed by reference should be declared with the
+    // respective <tt>_const</tt> class in the signature. Otherwise, the
     // abstraction layer will perform a deep copy (i.e., waste unnecessary
     // processor cycles).
-    TransitionState state = *arg++;
-    double y = *arg++;
-    DoubleRow_const x = *arg++;
+    TransitionState state = inState;
     
     // See MADLIB-138. At least on certain platforms and with certain versions,
     // LAPACK will run into an infinite loop if pinv() is called for non-finite
@@ -149,11 +508,10 @@ AnyValue LinearRegression::transition(AbstractDBInterface &db, AnyValue args) {
     // Now do the transition step.
     if (state.numRows == 0)
         state.initialize(db.allocator(AbstractAllocator::kAggregate), x.n_elem);
-    state.numRows++;
-    state.y_sum += y;
-    state.y_square_sum += y * y;
-    state.X_transp_Y += trans(x) * y;
-    state.X_transp_X += trans(x) * x;
+    else if (x.n_elem != state.widthOfX)
+        throw std::invalid_argument("Inconsistent numbers of independent "
+            "variables.");
+    state.append(y, x);
         
     return state;
 }
@@ -161,9 +519,11 @@ AnyValue LinearRegression::transition(AbstractDBInterface &db, AnyValue args) {
 /**
  * @brief Perform the perliminary aggregation function: Merge transition states
  */
-AnyValue LinearRegression::mergeStates(AbstractDBInterface &db, AnyValue args) {
-    TransitionState stateLeft = args[0].copyIfImmutable();
-    const TransitionState stateRight = args[1];
+Array<double> LinearRegression::mergeStates(AbstractDBInterface &db,
+    Array<double> inStateLeft, Array<double> inStateRight) {
+    
+    TransitionState stateLeft = inStateLeft;
+    const TransitionState stateRight = inStateRight;
     
     // We first handle the trivial case where this function is called with one
     // of the states being the initial state
@@ -177,22 +537,196 @@ AnyValue LinearRegression::mergeStates(AbstractDBInterface &db, AnyValue args) {
     return stateLeft;
 }
 
+/**
+ * @brief Return the 1-norm condition number \f$ \|A\|_1 \|A^{-1}\|_1 \f$,
+ *     given the inverse
+ *
+ * The 1-norm of a matrix is its largest absolute column sum.
+ */
+static inline double oneNormCondition(const mat &inA, const mat &inInverse) {
+    return max(sum(abs(inA))) * max(sum(abs(inInverse)));
+}
+
+/**
+ * @brief Compute the (pseudo-)inverse of a symmetric positive semi-definite
+ *     matrix and its condition number, with a single factorization
+ *
+ * For normal equations, \f$ A = X^T X \f$ is usually positive definite, so we
+ * first try a Cholesky factorization \f$ A = R^T R \f$, which costs about a
+ * tenth of an SVD. The inverse is then \f$ R^{-1} R^{-T} \f$. Only if the
+ * Cholesky factorization fails or \f$ A \f$ is numerically singular, we fall
+ * back to a single SVD, from which we obtain the Moore-Penrose pseudo-inverse.
+ *
+ * On both paths, we return the exact 1-norm condition number
+ * \f$ \kappa_1(A) = \|A\|_1 \|A^{-1}\|_1 \f$ (we have the inverse at hand
+ * anyway, so there is no need for an estimate like LAPACK's dpocon). If the SVD
+ * finds \f$ A \f$ numerically singular, the condition number is infinite.
+ *
+ * @param inA Symmetric positive semi-definite matrix
+ * @param outInverse (Pseudo-)inverse of \c inA
+ * @return 1-norm condition number of \c inA
+ */
+static double symmetricPseudoInverse(const mat &inA, mat &outInverse) {
+    const double eps = std::numeric_limits<double>::epsilon();
+    mat R;
+
+    if (chol(R, inA)) {
+        mat R_inverse = inv(trimatu(R));
+        outInverse = R_inverse * trans(R_inverse);
+
+        double condition = oneNormCondition(inA, outInverse);
+        if (boost::math::isfinite(condition) && condition * eps < 1)
+            return condition;
+    }
+
+    mat U;
+    vec s;
+    mat V;
+    if (!svd(U, s, V, inA))
+        throw std::runtime_error("Singular value decomposition of X^T X "
+            "failed.");
+
+    // Same tolerance as used by pinv() and by MATLAB
+    double tolerance = std::max(inA.n_rows, inA.n_cols) * max(s) * eps;
+    vec s_inverse(s.n_elem);
+    s_inverse.zeros();
+    bool singular = false;
+    for (uint32_t i = 0; i < s.n_elem; i++)
+        if (s(i) > tolerance)
+            s_inverse(i) = 1. / s(i);
+        else
+            singular = true;
+
+    outInverse = V * diagmat(s_inverse) * trans(U);
+    return singular
+        ? std::numeric_limits<double>::infinity()
+        : oneNormCondition(inA, outInverse);
+}
+
+/**
+ * @brief Solve for the coefficients from the centered co-moments
+ *
+ * Moments layout with an intercept only. Let \f$ S \f$ be the varying and
+ * \f$ K \f$ the constant columns. The slopes solve the centered normal
+ * equations \f$ C_{SS} \boldsymbol c_S = C_{Sy} \f$, which do not contain
+ * the (possibly large) means. Since the fitted values have mean \f$ \bar y
+ * \f$, the intercept satisfies \f$ \bar{\boldsymbol x}_K^T \boldsymbol c_K =
+ * \bar y - \bar{\boldsymbol x}_S^T \boldsymbol c_S =: d \f$. We take the
+ * minimum-norm solution \f$ \boldsymbol c_K = d \boldsymbol w \f$ with
+ * \f$ \boldsymbol w = \bar{\boldsymbol x}_K / \|\bar{\boldsymbol x}_K\|^2
+ * \f$, which is just \f$ c_K = d \f$ for a single column of ones.
+ *
+ * @param outCoef Coefficients
+ * @param outInverse \f$ (X^T X)^{-1} \f$, assembled blockwise from
+ *     \f$ C_{SS}^{-1} \f$: With \f$ \boldsymbol v = C_{SS}^{-1}
+ *     \bar{\boldsymbol x}_S \f$, the blocks are \f$ C_{SS}^{-1} \f$,
+ *     \f$ -\boldsymbol v \boldsymbol w^T \f$, and \f$ (1/n +
+ *     \bar{\boldsymbol x}_S^T \boldsymbol v) \boldsymbol w \boldsymbol w^T \f$.
+ * @return 1-norm condition number of \f$ C_{SS} \f$ (1 if all columns are
+ *     constant)
+ */
+double LinearRegression::TransitionState::solveCentered(vec &outCoef,
+    mat &outInverse) const {
+
+    std::vector<uint16_t> varying;
+    std::vector<uint16_t> constant;
+    for (uint16_t j = 0; j < widthOfX; j++)
+        (isConstantColumn(j) ? constant : varying).push_back(j);
+
+    const uint16_t numVarying = varying.size();
+    const uint16_t numConstant = constant.size();
+
+    vec w(numConstant);
+    for (uint16_t k = 0; k < numConstant; k++)
+        w(k) = x_mean(constant[k]);
+    w /= dot(w, w);
+
+    double d = y_mean;
+    double leverage = 0;
+    double condition = 1;
+    mat C_SS_inverse;
+    vec coef_S;
+    vec v;
+    if (numVarying > 0) {
+        mat C_SS(numVarying, numVarying);
+        vec C_Sy(numVarying);
+        vec x_mean_S(numVarying);
+        for (uint16_t b = 0; b < numVarying; b++) {
+            for (uint16_t a = 0; a < numVarying; a++)
+                C_SS(a, b) = xxComoment(varying[a], varying[b]);
+            C_Sy(b) = xy_comoment(varying[b]);
+            x_mean_S(b) = x_mean(varying[b]);
+        }
+
+        // See MADLIB-138 and final()
+        if (!C_SS.is_finite() || !C_Sy.is_finite())
+            throw std::invalid_argument("Design matrix is not finite.");
+
+        condition = symmetricPseudoInverse(C_SS, C_SS_inverse);
+        coef_S = C_SS_inverse * C_Sy;
+        v = C_SS_inverse * x_mean_S;
+        d -= dot(x_mean_S, coef_S);
+        leverage = dot(x_mean_S, v);
+    }
+
+    outCoef.set_size(widthOfX);
+    outInverse.set_size(widthOfX, widthOfX);
+    for (uint16_t a = 0; a < numVarying; a++) {
+        outCoef(varying[a]) = coef_S(a);
+        for (uint16_t b = 0; b < numVarying; b++)
+            outInverse(varying[a], varying[b]) = C_SS_inverse(a, b);
+        for (uint16_t k = 0; k < numConstant; k++)
+            outInverse(varying[a], constant[k])
+                = outInverse(constant[k], varying[a]) = -v(a) * w(k);
+    }
+    for (uint16_t k = 0; k < numConstant; k++) {
+        outCoef(constant[k]) = d * w(k);
+        for (uint16_t l = 0; l < numConstant; l++)
+            outInverse(constant[k], constant[l])
+                = (1. / numRows + leverage) * w(k) * w(l);
+    }
+    return condition;
+}
+
 /**
  * @brief Perform the linear-regression final step
  */
-AnyValue LinearRegression::final(AbstractDBInterface &db, AnyValue args) {
-    const TransitionState state = args[0];
+AnyValue LinearRegression::final(AbstractDBInterface &db,
+    Array<double> inState) {
+    
+    TransitionState state = inState;
+    state.flush();
 
-    // See MADLIB-138. At least on certain platforms and with certain versions,
-    // LAPACK will run into an infinite loop if pinv() is called for non-finite
-    // matrices. We extend the check also to the dependent variables.
-    if (!state.X_transp_X.is_finite() || !state.X_transp_Y.is_finite())
-        throw std::invalid_argument("Design matrix is not finite.");
-        
-    // FIXME: We have essentially two calls to svd now (pinv calls svd, too).
-    // This is a waste of processor cycles and energy.
-    vec singularValues = svd(state.X_transp_X);
-    double condition_X_transp_X = max(singularValues) / min(singularValues);
+    // Vector of coefficients: For efficiency reasons, we want to return this
+    // by reference, so we need to bind to db memory
+    DoubleCol coef(db.allocator(), state.widthOfX);
+    mat inverse_of_X_transp_X;
+    double condition_X_transp_X;
+
+    if (state.hasIntercept()) {
+        // Moments layout: Solve the centered system. The condition number is
+        // that of the centered co-moments, which large means do not inflate.
+        vec centeredCoef;
+        condition_X_transp_X = state.solveCentered(centeredCoef,
+            inverse_of_X_transp_X);
+        coef = centeredCoef;
+    } else {
+        mat X_transp_X;
+        vec X_transp_Y;
+        state.normalEquations(X_transp_X, X_transp_Y);
+
+        // See MADLIB-138. At least on certain platforms and with certain
+        // versions, LAPACK will run into an infinite loop if pinv() is called
+        // for non-finite matrices. We extend the check also to the dependent
+        // variables.
+        if (!X_transp_X.is_finite() || !X_transp_Y.is_finite())
+            throw std::invalid_argument("Design matrix is not finite.");
+            
+        // Precompute (X^T * X)^+ with a single factorization
+        condition_X_transp_X = symmetricPseudoInverse(X_transp_X,
+            inverse_of_X_transp_X);
+        coef = inverse_of_X_transp_X * X_transp_Y;
+    }
 
     // See:
     // Lichtblau, Daniel and Weisstein, Eric W. "Condition Number."
@@ -202,26 +736,12 @@ AnyValue LinearRegression::final(AbstractDBInterface &db, AnyValue args) {
         db.out << "Matrix X^T X is ill-conditioned (condition number "
             "= " << condition_X_transp_X << "). "
             "Expect strong multicollinerity." << std::endl;
-    
-    // Precompute (X^T * X)^+
-    mat inverse_of_X_transp_X = pinv(state.X_transp_X);
 
-    // Vector of coefficients: For efficiency reasons, we want to return this
-    // by reference, so we need to bind to db memory
-    DoubleCol coef(db.allocator(), state.widthOfX);
-    coef = inverse_of_X_transp_X * state.X_transp_Y;
-    
     // explained sum of squares (regression sum of squares)
-    double ess
-        = as_scalar(
-            trans(state.X_transp_Y) * coef
-            - ((state.y_sum * state.y_sum) / state.numRows)
-          );
+    double ess = state.explainedSumOfSquares(coef);
 
     // total sum of squares
-    double tss
-        = state.y_square_sum
-            - ((state.y_sum * state.y_sum) / state.numRows);
+    double tss = state.totalSumOfSquares();
 
     // coefficient of determination
     double r2 = ess / tss;
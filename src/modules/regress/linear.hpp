@@ -23,9 +23,11 @@ struct LinearRegression {
     
     class TransitionState;
     
-    static AnyValue transition(AbstractDBInterface &db, AnyValue args);
-    static AnyValue mergeStates(AbstractDBInterface &db, AnyValue args);
-    static AnyValue final(AbstractDBInterface &db, AnyValue args);
+    static Array<double> transition(AbstractDBInterface &db,
+        Array<double> state, double y, DoubleRow_const x);
+    static Array<double> mergeStates(AbstractDBInterface &db,
+        Array<double> stateLeft, Array<double> stateRight);
+    static AnyValue final(AbstractDBInterface &db, Array<double> state);
 };
 
 } // namespace regress
@@ -26,20 +26,45 @@ namespace dbconnector {
 AbstractValueSPtr PGAbstractValue::DatumToValue(bool inMemoryIsWritable,
     Oid inTypeID, Datum inDatum) const {
     
+    bool isTuple;
+    bool isArray;
+    bool errorOccurred = false;
+    
+    PG_TRY(); {
+        isTuple = type_is_rowtype(inTypeID);
+        isArray = type_is_array(inTypeID);
+    } PG_CATCH(); {
+        errorOccurred = true;
+    } PG_END_TRY();
+    
+    BOOST_ASSERT_MSG(errorOccurred == false, "An exception occurred while "
+        "converting a PostgreSQL datum to DBAL object.");
+    
+    return DatumToValue(inMemoryIsWritable, inTypeID, isTuple, isArray,
+        inDatum);
+}
+
+/**
+ * @brief Convert postgres Datum into a ConcreteValue object, with the type
+ *     classification already known.
+ *
+ * Callers that have cached whether \c inTypeID is a row type or an array type
+ * (see PGArguments) use this function in order to avoid catalog lookups.
+ */
+AbstractValueSPtr PGAbstractValue::DatumToValue(bool inMemoryIsWritable,
+    Oid inTypeID, bool inIsTuple, bool inIsArray, Datum inDatum) const {
+    
     /*
      * See PGNewDelete::allocate(const uint32_t, const std::nothrow_t&) why we
      * disable processing of interrupts.
      */
-    bool isTuple;
-    bool isArray;
+    bool isTuple = inIsTuple;
+    bool isArray = inIsArray;
     HeapTupleHeader pgTuple;
     ArrayType *pgArray;
     bool errorOccurred = false;
     
     PG_TRY(); {
-        isTuple = type_is_rowtype(inTypeID);
-        isArray = type_is_array(inTypeID);
-        
         if (isTuple)
             pgTuple = DatumGetHeapTupleHeader(inDatum);
         else if (isArray)
@@ -53,7 +78,7 @@ AbstractValueSPtr PGAbstractValue::DatumToValue(bool inMemoryIsWritable,
 
     // First check if datum is rowtype
     if (isTuple) {
-        return AbstractValueSPtr(new PGValue<HeapTupleHeader>(pgTuple));
+        return AbstractValueSPtr(new PGValue<HeapTupleHeader>(fcinfo, pgTuple));
     } else if (isArray) {
         if (ARR_NDIM(pgArray) != 1)
             throw std::invalid_argument("Multidimensional arrays not yet supported");
@@ -9,6 +9,10 @@
 
 #include <dbconnector/PGCommon.hpp>
 
+extern "C" {
+    #include <fmgr.h>           // for FunctionCallInfo
+}
+
 namespace madlib {
 
 namespace dbconnector {
@@ -21,11 +25,26 @@ namespace dbconnector {
  * PGvalue<HeapTupleHeader> objects are instantiated for "normal" composite
  * values.
  * PGAbstractValue is the common superclass that contains common parts.
+ *
+ * Both keep a reference to the function call information, so that meta data
+ * (argument types and row types) can be cached in
+ * <tt>fcinfo->flinfo->fn_extra</tt>. See PGArguments.
  */
 class PGAbstractValue : public AbstractValue {
 protected:
+    PGAbstractValue(const FunctionCallInfo inFCinfo)
+        : fcinfo(inFCinfo) { }
+
     AbstractValueSPtr getValueByID(unsigned int inID) const = 0;
     AbstractValueSPtr DatumToValue(bool inMemoryIsWritable, Oid inTypeID, Datum inDatum) const;
+    AbstractValueSPtr DatumToValue(bool inMemoryIsWritable, Oid inTypeID,
+        bool inIsTuple, bool inIsArray, Datum inDatum) const;
+
+    /**
+     * The name is chosen so that PostgreSQL macros like PG_NARGS can be
+     * used.
+     */
+    const FunctionCallInfo fcinfo;
 };
 
 } // namespace dbconnector
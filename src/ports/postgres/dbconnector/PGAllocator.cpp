@@ -81,6 +81,9 @@ void *PGAllocator::allocate(const uint32_t inSize) const throw(std::bad_alloc) {
                 ptr = palloc(inSize);
                 MemoryContextSwitchTo(oldContext);
             }
+        } else if (mContext == kCallSite) {
+            ptr = MemoryContextAlloc(mPGInterface->fcinfo->flinfo->fn_mcxt,
+                inSize);
         } else {
             ptr = palloc(inSize);
         }
@@ -155,7 +158,10 @@ void *PGAllocator::allocate(const uint32_t inSize, const std::nothrow_t&) const
     
     HOLD_INTERRUPTS();
     PG_TRY(); {
-        if (mContext != kAggregate ||
+        if (mContext == kCallSite) {
+            ptr = MemoryContextAlloc(mPGInterface->fcinfo->flinfo->fn_mcxt,
+                inSize);
+        } else if (mContext != kAggregate ||
             AggCheckCallContext(mPGInterface->fcinfo, &aggContext)) {
         
             ptr = palloc(inSize);
@@ -0,0 +1,443 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file PGArguments.cpp
+ *
+ * @brief Cached, typed access to PostgreSQL function arguments
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <dbconnector/PGCompatibility.hpp>
+#include <dbconnector/PGArguments.hpp>
+#include <dbconnector/PGAllocator.hpp>
+#include <dbconnector/PGArrayHandle.hpp>
+
+#include <stdexcept>
+
+extern "C" {
+    #include <access/tuptoaster.h>
+    #include <catalog/pg_type.h>
+    #include <utils/lsyscache.h>
+    #include <utils/memutils.h>
+    #include <utils/typcache.h>
+}
+
+
+namespace madlib {
+
+namespace dbconnector {
+
+/**
+ * @brief Constructor. Only the first call through a particular \c FmgrInfo
+ *        calls into the backend.
+ */
+PGArguments::PGArguments(const FunctionCallInfo inFCinfo)
+    : fcinfo(inFCinfo), mCache(NULL) {
+
+    if (fcinfo == NULL)
+        throw std::invalid_argument("fcinfo is NULL");
+
+    mCache = static_cast<Cache*>(fcinfo->flinfo->fn_extra);
+    if (mCache == NULL)
+        mCache = initializeCache(fcinfo);
+}
+
+/**
+ * @brief Look up the meta data of all arguments and store it in
+ *        <tt>fcinfo->flinfo->fn_extra</tt>
+ *
+ * The cache is a single chunk of memory in <tt>fcinfo->flinfo->fn_mcxt</tt>:
+ * The Cache struct, followed by one PGArgumentInfo and one PGDetoastedArray
+ * per argument.
+ */
+PGArguments::Cache *PGArguments::initializeCache(const FunctionCallInfo fcinfo) {
+    bool exceptionOccurred = false;
+    Cache *cache;
+    PGArgumentInfo *arg;
+    uint16_t numArgs = PG_NARGS();
+    uint16_t i;
+
+    PG_TRY(); {
+        cache = static_cast<Cache*>(
+            MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                sizeof(Cache) + numArgs * (sizeof(PGArgumentInfo)
+                    + sizeof(PGDetoastedArray))));
+        cache->numArgs = numArgs;
+        cache->args = reinterpret_cast<PGArgumentInfo*>(cache + 1);
+        cache->rowTypes = NULL;
+        cache->detoasted = reinterpret_cast<PGDetoastedArray*>(
+            cache->args + numArgs);
+        cache->callSiteCache = NULL;
+
+        for (i = 0; i < numArgs; i++) {
+            arg = &cache->args[i];
+            arg->typeID = get_fn_expr_argtype(fcinfo->flinfo, i);
+            arg->isTuple = arg->typeID != InvalidOid
+                && type_is_rowtype(arg->typeID);
+            arg->isArray = arg->typeID != InvalidOid
+                && type_is_array(arg->typeID);
+
+            // If we are called as an aggregate function, the first argument is
+            // the transition state. In that case, we are free to modify the
+            // data. In fact, for performance reasons, we *should* even do all
+            // modifications in-place. In all other cases, directly modifying
+            // memory is dangerous.
+            // See warning at:
+            // http://www.postgresql.org/docs/current/static/xfunc-c.html#XFUNC-C-BASETYPE
+            arg->isWritable = (i == 0 && AggCheckCallContext(fcinfo, NULL));
+            cache->detoasted[i].array = NULL;
+        }
+        fcinfo->flinfo->fn_extra = cache;
+    } PG_CATCH(); {
+        exceptionOccurred = true;
+    } PG_END_TRY();
+
+    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
+        "gathering inormation about PostgreSQL function arguments");
+
+    return cache;
+}
+
+/**
+ * @brief Return the cached meta data of a row type. Look it up on first use.
+ *
+ * Row types are identified by type ID and type modifier (the latter
+ * distinguishes anonymous record types).
+ */
+const PGRowTypeInfo &PGArguments::rowType(Oid inTypeID, int32 inTypmod) const {
+    PGRowTypeInfo *rowType;
+
+    for (rowType = mCache->rowTypes; rowType != NULL; rowType = rowType->next)
+        if (rowType->typeID == inTypeID && rowType->typmod == inTypmod)
+            return *rowType;
+
+    bool exceptionOccurred = false;
+    MemoryContext oldContext = NULL;
+    TupleDesc tupDesc;
+    PGArgumentInfo *attr;
+    int i;
+
+    PG_TRY(); {
+        oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+        tupDesc = lookup_rowtype_tupdesc(inTypeID, inTypmod);
+        rowType = static_cast<PGRowTypeInfo*>(palloc(
+            sizeof(PGRowTypeInfo) + tupDesc->natts * sizeof(PGArgumentInfo)));
+        rowType->typeID = inTypeID;
+        rowType->typmod = inTypmod;
+        rowType->tupDesc = CreateTupleDescCopy(tupDesc);
+        rowType->attributes = reinterpret_cast<PGArgumentInfo*>(rowType + 1);
+        ReleaseTupleDesc(tupDesc);
+
+        for (i = 0; i < rowType->tupDesc->natts; i++) {
+            attr = &rowType->attributes[i];
+            attr->typeID = rowType->tupDesc->attrs[i]->atttypid;
+            attr->isTuple = type_is_rowtype(attr->typeID);
+            attr->isArray = type_is_array(attr->typeID);
+            attr->isWritable = false;
+        }
+
+        rowType->next = mCache->rowTypes;
+        mCache->rowTypes = rowType;
+        MemoryContextSwitchTo(oldContext);
+    } PG_CATCH(); {
+        exceptionOccurred = true;
+    } PG_END_TRY();
+
+    if (exceptionOccurred) {
+        PG_TRY(); {
+            if (oldContext != NULL)
+                MemoryContextSwitchTo(oldContext);
+        } PG_CATCH(); {
+        } PG_END_TRY();
+    }
+
+    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
+        "gathering inormation about a PostgreSQL row type");
+
+    return *rowType;
+}
+
+/**
+ * @brief Return whether the <tt>inID</tt>-th argument is NULL
+ */
+bool PGArguments::isNull(uint16_t inID) const {
+    if (inID >= size())
+        throw std::out_of_range("Access behind end of argument list");
+
+    return PG_ARGISNULL(inID);
+}
+
+/**
+ * @brief Return the meta data of the <tt>inID</tt>-th argument
+ */
+const PGArgumentInfo &PGArguments::info(uint16_t inID) const {
+    if (inID >= size())
+        throw std::out_of_range("Access behind end of argument list");
+
+    const PGArgumentInfo &arg = mCache->args[inID];
+    if (arg.typeID == InvalidOid)
+        throw std::invalid_argument("Cannot determine function argument type");
+
+    return arg;
+}
+
+/**
+ * @brief Return the <tt>inID</tt>-th argument as raw Datum. Throw if NULL.
+ */
+Datum PGArguments::datum(uint16_t inID) const {
+    if (isNull(inID))
+        throw std::invalid_argument("Function argument is NULL");
+
+    return PG_GETARG_DATUM(inID);
+}
+
+/**
+ * @brief Return the <tt>inID</tt>-th argument as a one-dimensional
+ *        DOUBLE PRECISION array without NULLs
+ *
+ * We only call into the backend if the array needs to be detoasted. If the
+ * array is stored out-of-line, we keep the detoasted copy and reuse it as long
+ * as the TOAST pointer does not change (see PGDetoastedArray).
+ */
+ArrayType *PGArguments::getArray(uint16_t inID) const {
+    if (!info(inID).isArray)
+        throw std::invalid_argument(
+            "Internal argument type does not match SQL argument type");
+
+    struct varlena *rawDatum
+        = reinterpret_cast<struct varlena*>(DatumGetPointer(datum(inID)));
+    ArrayType *array;
+
+    if (!VARATT_IS_EXTENDED(rawDatum)) {
+        array = reinterpret_cast<ArrayType*>(rawDatum);
+    } else if (VARATT_IS_EXTERNAL(rawDatum)
+        && VARSIZE_EXTERNAL(rawDatum) == TOAST_POINTER_SIZE
+        && !info(inID).isWritable) {
+
+        PGDetoastedArray &detoasted = mCache->detoasted[inID];
+        struct varatt_external toastPointer;
+        std::memcpy(&toastPointer, VARDATA_EXTERNAL(rawDatum),
+            sizeof(toastPointer));
+
+        if (detoasted.array != NULL && std::memcmp(&toastPointer,
+                &detoasted.toastPointer, sizeof(toastPointer)) == 0)
+            array = detoasted.array;
+        else {
+            bool exceptionOccurred = false;
+            MemoryContext oldContext = NULL;
+
+            // We allocate the new copy before freeing the old one. Hence, a
+            // new value is never at the same address as the previous one.
+            PG_TRY(); {
+                oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+                array = DatumGetArrayTypePCopy(PointerGetDatum(rawDatum));
+                MemoryContextSwitchTo(oldContext);
+                if (detoasted.array != NULL)
+                    pfree(detoasted.array);
+            } PG_CATCH(); {
+                exceptionOccurred = true;
+            } PG_END_TRY();
+
+            if (exceptionOccurred) {
+                PG_TRY(); {
+                    if (oldContext != NULL)
+                        MemoryContextSwitchTo(oldContext);
+                } PG_CATCH(); {
+                } PG_END_TRY();
+            }
+
+            BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception "
+                "occurred while detoasting a PostgreSQL array.");
+
+            detoasted.toastPointer = toastPointer;
+            detoasted.array = array;
+        }
+    } else {
+        bool exceptionOccurred = false;
+
+        PG_TRY(); {
+            array = DatumGetArrayTypeP(PointerGetDatum(rawDatum));
+        } PG_CATCH(); {
+            exceptionOccurred = true;
+        } PG_END_TRY();
+
+        BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred "
+            "while detoasting a PostgreSQL array.");
+    }
+
+    if (ARR_NDIM(array) != 1)
+        throw std::invalid_argument("Multidimensional arrays not yet supported");
+
+    if (ARR_HASNULL(array))
+        throw std::invalid_argument("Arrays with NULLs not yet supported");
+
+    if (ARR_ELEMTYPE(array) != FLOAT8OID)
+        throw std::invalid_argument(
+            "Internal argument type does not match SQL argument type");
+
+    return array;
+}
+
+/**
+ * @brief Return the <tt>inID</tt>-th argument as an array that may be
+ *        modified
+ *
+ * If the argument is not writable, we return a copy. The copy is allocated in
+ * the function-call memory context and it is not owned by any memory handle.
+ * It may therefore be returned by reference to the backend.
+ */
+ArrayType *PGArguments::getMutableArray(uint16_t inID) const {
+    ArrayType *array = getArray(inID);
+
+    if (info(inID).isWritable)
+        return array;
+
+    ArrayType *copy = static_cast<ArrayType*>(
+        PGAllocator::defaultAllocator().allocate(VARSIZE(array)));
+    std::memcpy(copy, array, VARSIZE(array));
+    return copy;
+}
+
+
+// Scalars. We allow the same lossless implicit conversions as ConcreteValue.
+
+template <>
+double PGArguments::get<double>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    switch (info(inID).typeID) {
+        case FLOAT8OID: return DatumGetFloat8(value);
+        case FLOAT4OID: return DatumGetFloat4(value);
+        case INT4OID: return DatumGetInt32(value);
+        case INT2OID: return DatumGetInt16(value);
+        case BOOLOID: return DatumGetBool(value);
+    }
+    throw std::invalid_argument(
+        "Internal argument type does not match SQL argument type");
+}
+
+template <>
+float PGArguments::get<float>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    switch (info(inID).typeID) {
+        case FLOAT4OID: return DatumGetFloat4(value);
+        case INT2OID: return DatumGetInt16(value);
+        case BOOLOID: return DatumGetBool(value);
+    }
+    throw std::invalid_argument(
+        "Internal argument type does not match SQL argument type");
+}
+
+template <>
+int64_t PGArguments::get<int64_t>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    switch (info(inID).typeID) {
+        case INT8OID: return DatumGetInt64(value);
+        case INT4OID: return DatumGetInt32(value);
+        case INT2OID: return DatumGetInt16(value);
+        case BOOLOID: return DatumGetBool(value);
+    }
+    throw std::invalid_argument(
+        "Internal argument type does not match SQL argument type");
+}
+
+template <>
+int32_t PGArguments::get<int32_t>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    switch (info(inID).typeID) {
+        case INT4OID: return DatumGetInt32(value);
+        case INT2OID: return DatumGetInt16(value);
+        case BOOLOID: return DatumGetBool(value);
+    }
+    throw std::invalid_argument(
+        "Internal argument type does not match SQL argument type");
+}
+
+template <>
+int16_t PGArguments::get<int16_t>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    switch (info(inID).typeID) {
+        case INT2OID: return DatumGetInt16(value);
+        case BOOLOID: return DatumGetBool(value);
+    }
+    throw std::invalid_argument(
+        "Internal argument type does not match SQL argument type");
+}
+
+template <>
+bool PGArguments::get<bool>(uint16_t inID) const {
+    Datum value = datum(inID);
+
+    if (info(inID).typeID != BOOLOID)
+        throw std::invalid_argument(
+            "Internal argument type does not match SQL argument type");
+    return DatumGetBool(value);
+}
+
+
+// Immutable arrays and vectors: Views of the argument memory
+
+template <>
+Array_const<double> PGArguments::get<Array_const<double> >(uint16_t inID) const {
+    ArrayType *array = getArray(inID);
+
+    return Array_const<double>(
+        reinterpret_cast<const double*>(ARR_DATA_PTR(array)),
+        boost::extents[ ARR_DIMS(array)[0] ]);
+}
+
+template <>
+DoubleCol_const PGArguments::get<DoubleCol_const>(uint16_t inID) const {
+    ArrayType *array = getArray(inID);
+
+    return DoubleCol_const(
+        reinterpret_cast<const double*>(ARR_DATA_PTR(array)),
+        ARR_DIMS(array)[0]);
+}
+
+template <>
+DoubleRow_const PGArguments::get<DoubleRow_const>(uint16_t inID) const {
+    ArrayType *array = getArray(inID);
+
+    return DoubleRow_const(
+        reinterpret_cast<const double*>(ARR_DATA_PTR(array)),
+        ARR_DIMS(array)[0]);
+}
+
+
+// Mutable arrays and vectors: In-place if writable, otherwise copy
+
+template <>
+Array<double> PGArguments::get<Array<double> >(uint16_t inID) const {
+    ArrayType *array = getMutableArray(inID);
+
+    return Array<double>(
+        MemHandleSPtr(new PGArrayHandle(array)),
+        boost::extents[ ARR_DIMS(array)[0] ]);
+}
+
+template <>
+DoubleCol PGArguments::get<DoubleCol>(uint16_t inID) const {
+    ArrayType *array = getMutableArray(inID);
+
+    return DoubleCol(
+        MemHandleSPtr(new PGArrayHandle(array)),
+        ARR_DIMS(array)[0]);
+}
+
+template <>
+DoubleRow PGArguments::get<DoubleRow>(uint16_t inID) const {
+    ArrayType *array = getMutableArray(inID);
+
+    return DoubleRow(
+        MemHandleSPtr(new PGArrayHandle(array)),
+        ARR_DIMS(array)[0]);
+}
+
+} // namespace dbconnector
+
+} // namespace madlib
@@ -0,0 +1,198 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file PGArguments.hpp
+ *
+ * @brief Header file for cached, typed access to PostgreSQL function arguments
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_POSTGRES_PGARGUMENTS_HPP
+#define MADLIB_POSTGRES_PGARGUMENTS_HPP
+
+#include <dbconnector/PGCommon.hpp>
+
+extern "C" {
+    #include <fmgr.h>
+    #include <access/tupdesc.h>
+    #include <utils/array.h>
+} // extern "C"
+
+namespace madlib {
+
+namespace dbconnector {
+
+/**
+ * @brief Meta data about a single function argument
+ */
+struct PGArgumentInfo {
+    Oid typeID;
+    bool isTuple;
+    bool isArray;
+
+    /**
+     * Whether we are allowed to modify the argument in-place. This is only the
+     * case for the transition state of an aggregate function.
+     */
+    bool isWritable;
+};
+
+/**
+ * @brief Cached meta data about a row type (composite type)
+ *
+ * Entries are created by PGArguments::rowType() and live as long as the
+ * argument cache, in <tt>fcinfo->flinfo->fn_mcxt</tt>.
+ */
+struct PGRowTypeInfo {
+    Oid typeID;
+    int32 typmod;
+
+    /**
+     * Private copy of the tuple descriptor (we do not hold a reference count
+     * on the type cache's descriptor)
+     */
+    TupleDesc tupDesc;
+
+    /**
+     * Meta data for each attribute. Attributes are never writable.
+     */
+    PGArgumentInfo *attributes;
+
+    PGRowTypeInfo *next;
+};
+
+/**
+ * @brief Detoasted copy of an array argument that is stored out-of-line
+ *
+ * Arguments that do not change from row to row (e.g., an array of centroids
+ * that is joined to every row) are usually stored out-of-line in a TOAST
+ * table. Each TOAST pointer uniquely identifies the stored value, so as long
+ * as we see the same TOAST pointer, we can skip fetching (and decompressing)
+ * the value.
+ */
+struct PGDetoastedArray {
+    struct varatt_external toastPointer;
+    ArrayType *array;
+};
+
+/**
+ * @brief Typed access to the arguments of a PostgreSQL function call
+ *
+ * Determining the type of an argument (get_fn_expr_argtype, type_is_rowtype,
+ * type_is_array) and checking for an aggregate calling context
+ * (AggCheckCallContext) involves catalog lookups, and it has to be guarded by
+ * a \c PG_TRY() block. None of this can change between calls through the same
+ * \c FmgrInfo. We therefore do it only once, on the first call, and store the
+ * result in <tt>fcinfo->flinfo->fn_extra</tt> (allocated in the long-lived
+ * memory context <tt>fcinfo->flinfo->fn_mcxt</tt>). All later calls only read
+ * from this cache.
+ *
+ * The cache also holds the detoasted copies of out-of-line array arguments
+ * (see PGDetoastedArray) and a slot for module-specific data (see
+ * callSiteCache()).
+ *
+ * get() returns values by value:
+ * - Scalars are returned as C++ primitive types. The same lossless implicit
+ *   conversions as for ConcreteValue are allowed.
+ * - Immutable arrays and vectors (Array_const, DoubleCol_const,
+ *   DoubleRow_const) are views of the argument memory. They have no memory
+ *   handle, so nothing is allocated on the heap.
+ * - Mutable arrays and vectors (Array, DoubleCol, DoubleRow) are bound to the
+ *   argument in-place if the argument is writable, and to a copy otherwise.
+ *   They are backed by a (non-owning) PGArrayHandle, so they can be returned
+ *   by reference.
+ *
+ * @see PGInterface for information on necessary precautions when writing
+ *      PostgreSQL plug-in code in C++.
+ */
+class PGArguments {
+public:
+    PGArguments(const FunctionCallInfo inFCinfo);
+
+    /**
+     * @brief Return the number of arguments
+     */
+    uint16_t size() const {
+        return mCache->numArgs;
+    }
+
+    bool isNull(uint16_t inID) const;
+    const PGArgumentInfo &info(uint16_t inID) const;
+    Datum datum(uint16_t inID) const;
+
+    /**
+     * @brief Return the <tt>inID</tt>-th argument as type \c T
+     */
+    template <typename T>
+    T get(uint16_t inID) const;
+
+    const PGRowTypeInfo &rowType(Oid inTypeID, int32 inTypmod) const;
+
+    /**
+     * @brief Return a slot for data that persists across calls through the
+     *     same \c FmgrInfo (see AbstractDBInterface::callSiteCache())
+     */
+    void *&callSiteCache() const {
+        return mCache->callSiteCache;
+    }
+
+private:
+    /**
+     * @brief The structure stored in <tt>fcinfo->flinfo->fn_extra</tt>
+     */
+    struct Cache {
+        uint16_t numArgs;
+        PGArgumentInfo *args;
+
+        /**
+         * Linked list of row types seen in composite arguments (usually
+         * there is at most one)
+         */
+        PGRowTypeInfo *rowTypes;
+
+        /**
+         * One entry per argument, the array is \c NULL if nothing is cached
+         */
+        PGDetoastedArray *detoasted;
+
+        void *callSiteCache;
+    };
+
+    static Cache *initializeCache(const FunctionCallInfo fcinfo);
+    ArrayType *getArray(uint16_t inID) const;
+    ArrayType *getMutableArray(uint16_t inID) const;
+
+    /**
+     * @internal The name is chosen so that PostgreSQL macros like \c PG_NARGS
+     *           can be used.
+     */
+    const FunctionCallInfo fcinfo;
+    Cache *mCache;
+};
+
+// Supported argument types. We only declare the specializations here, they
+// are defined in PGArguments.cpp.
+
+#define DECLARE_ARGUMENT_TYPE(T) \
+    template <> \
+    T PGArguments::get<T >(uint16_t inID) const;
+
+DECLARE_ARGUMENT_TYPE(double)
+DECLARE_ARGUMENT_TYPE(float)
+DECLARE_ARGUMENT_TYPE(int64_t)
+DECLARE_ARGUMENT_TYPE(int32_t)
+DECLARE_ARGUMENT_TYPE(int16_t)
+DECLARE_ARGUMENT_TYPE(bool)
+DECLARE_ARGUMENT_TYPE(Array<double>)
+DECLARE_ARGUMENT_TYPE(Array_const<double>)
+DECLARE_ARGUMENT_TYPE(DoubleCol)
+DECLARE_ARGUMENT_TYPE(DoubleCol_const)
+DECLARE_ARGUMENT_TYPE(DoubleRow)
+DECLARE_ARGUMENT_TYPE(DoubleRow_const)
+
+#undef DECLARE_ARGUMENT_TYPE
+
+} // namespace dbconnector
+
+} // namespace madlib
+
+#endif
@@ -1,5 +1,6 @@
 #include <dbconnector/PGInterface.hpp>
 #include <dbconnector/PGAllocator.hpp>
+#include <dbconnector/PGArguments.hpp>
 
 namespace madlib {
 
@@ -11,6 +12,15 @@ inline AllocatorSPtr PGInterface::allocator(
     return AllocatorSPtr(new PGAllocator(this, inMemContext));
 }
 
+/**
+ * @brief Return the slot for module data in <tt>fcinfo->flinfo->fn_extra</tt>
+ *
+ * The slot is part of the argument cache, see PGArguments.
+ */
+void *&PGInterface::callSiteCache() {
+    return PGArguments(fcinfo).callSiteCache();
+}
+
 inline void PGInterface::PGOutputStreamBuffer::output(
     char *inMsg, uint32_t /* inLength */) {
 
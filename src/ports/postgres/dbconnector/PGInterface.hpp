@@ -71,6 +71,8 @@ public:
     AllocatorSPtr allocator(
         AbstractAllocator::Context inMemContext = AbstractAllocator::kFunction);
     
+    void *&callSiteCache();
+    
 private:
     /**
      * @brief Stream buffer that dispatches all output to PostgreSQL's ereport
@@ -30,13 +30,29 @@ extern "C" {
         PG_FUNCTION_INFO_V1(SQLName); \
         Datum SQLName(PG_FUNCTION_ARGS) { \
             return call( \
-                modules::NameSpace::Function, \
+                AnyValueUDF(modules::NameSpace::Function), \
+                fcinfo); \
+        } \
+    }
+
+#define DECLARE_TYPED_UDF(NameSpace, Function, Signature) \
+    DECLARE_TYPED_UDF_EXT(Function, NameSpace, Function, Signature)
+
+#define DECLARE_TYPED_UDF_EXT(SQLName, NameSpace, Function, Signature) \
+    extern "C" { \
+        Datum SQLName(PG_FUNCTION_ARGS); \
+        PG_FUNCTION_INFO_V1(SQLName); \
+        Datum SQLName(PG_FUNCTION_ARGS) { \
+            return call( \
+                TypedUDF<Signature>(modules::NameSpace::Function), \
                 fcinfo); \
         } \
     }
 
 #include <modules/declarations.hpp>
 
+#undef DECLARE_TYPED_UDF_EXT
+#undef DECLARE_TYPED_UDF
 #undef DECLARE_UDF_EXT
 #undef DECLARE_UDF
 
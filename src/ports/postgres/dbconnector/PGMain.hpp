@@ -13,6 +13,7 @@
 #include <dbconnector/PGToDatumConverter.hpp>
 #include <dbconnector/PGInterface.hpp>
 #include <dbconnector/PGValue.hpp>
+#include <dbconnector/PGTypedUDF.hpp>
 
 extern "C" {
     #include <funcapi.h>
@@ -24,13 +25,40 @@ namespace madlib {
 
 namespace dbconnector {
 
+/**
+ * @brief Call a module function with the generic signature
+ *     <tt>AnyValue(AbstractDBInterface&, AnyValue)</tt>
+ *
+ * Arguments are accessed through PGValue<FunctionCallInfo>, and the return
+ * value is converted with PGToDatumConverter (both use dynamic dispatch).
+ *
+ * @see TypedUDF for module functions with native C++ signatures
+ */
+class AnyValueUDF {
+public:
+    AnyValueUDF(MADFunction &inFunction) : mFunction(inFunction) { }
+
+    Datum operator()(PGInterface &db, PG_FUNCTION_ARGS) const {
+        AnyValue result = mFunction(db, PGValue<FunctionCallInfo>(fcinfo));
+
+        if (result.isNull())
+            PG_RETURN_NULL();
+        
+        return PGToDatumConverter(fcinfo, result);
+    }
+
+private:
+    MADFunction &mFunction;
+};
+
 /**
  * @brief C++ entry point for calls from the database
  *
  * The DBMS calls an export "C" function defined in PGMain.cpp, which calls
- * this function.
+ * this function. \c UDF is either AnyValueUDF or TypedUDF.
  */
-inline static Datum call(MADFunction &f, PG_FUNCTION_ARGS) {
+template <class UDF>
+inline static Datum call(const UDF &inUDF, PG_FUNCTION_ARGS) {
     int sqlerrcode;
     char msg[2048];
     Datum datum;
@@ -39,12 +67,7 @@ inline static Datum call(MADFunction &f, PG_FUNCTION_ARGS) {
         PGInterface db(fcinfo);
         
         try {
-            AnyValue result = f(db, PGValue<FunctionCallInfo>(fcinfo));
-
-            if (result.isNull())
-                PG_RETURN_NULL();
-            
-            datum = PGToDatumConverter(fcinfo, result);
+            datum = inUDF(db, fcinfo);
             return datum;
         } catch (std::exception &exc) {
             sqlerrcode = ERRCODE_INVALID_PARAMETER_VALUE;
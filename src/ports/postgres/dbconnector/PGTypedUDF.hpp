@@ -0,0 +1,223 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file PGTypedUDF.hpp
+ *
+ * @brief Compile-time marshalling of arguments and return values for module
+ *        functions with native C++ signatures
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_POSTGRES_PGTYPEDUDF_HPP
+#define MADLIB_POSTGRES_PGTYPEDUDF_HPP
+
+#include <dbconnector/PGCommon.hpp>
+#include <dbconnector/PGArguments.hpp>
+#include <dbconnector/PGArrayHandle.hpp>
+#include <dbconnector/PGInterface.hpp>
+#include <dbconnector/PGToDatumConverter.hpp>
+
+#include <boost/preprocessor/arithmetic/inc.hpp>
+#include <boost/preprocessor/repetition/enum_params.hpp>
+#include <boost/preprocessor/repetition/enum_trailing.hpp>
+#include <boost/preprocessor/repetition/enum_trailing_params.hpp>
+#include <boost/preprocessor/repetition/repeat.hpp>
+
+extern "C" {
+    #include <fmgr.h>
+    #include <catalog/pg_type.h>
+    #include <utils/array.h>
+} // extern "C"
+
+/**
+ * Maximum number of SQL arguments of a function declared with
+ * DECLARE_TYPED_UDF
+ */
+#define MADLIB_TYPED_UDF_MAX_ARGS 6
+
+namespace madlib {
+
+namespace dbconnector {
+
+/**
+ * @brief Convert a return value of a typed module function into a Datum
+ *
+ * The generic version goes through the (dynamically dispatched)
+ * PGToDatumConverter. This is necessary for composite return types.
+ * Overloads for the most common types avoid all heap allocations and calls
+ * into the backend (except where the backend has to construct an array).
+ *
+ * @see PGInterface for information on necessary precautions when writing
+ *      PostgreSQL plug-in code in C++.
+ */
+template <typename T>
+inline Datum returnValueToDatum(const FunctionCallInfo fcinfo,
+    const T &inValue) {
+
+    return PGToDatumConverter(fcinfo, AnyValue(inValue));
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo fcinfo,
+    const AnyValue &inValue) {
+
+    if (inValue.isNull()) {
+        fcinfo->isnull = true;
+        return Datum(0);
+    }
+
+    return PGToDatumConverter(fcinfo, inValue);
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const bool &inValue) {
+
+    return BoolGetDatum(inValue);
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const int32_t &inValue) {
+
+    return Int32GetDatum(inValue);
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const int64_t &inValue) {
+
+    bool exceptionOccurred = false;
+    Datum datum;
+
+    // Int64GetDatum() might palloc (if int8 is not pass-by-value)
+    PG_TRY(); {
+        datum = Int64GetDatum(inValue);
+    } PG_CATCH(); {
+        exceptionOccurred = true;
+    } PG_END_TRY();
+
+    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
+        "converting a DBAL object to a PostgreSQL datum.");
+    return datum;
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const double &inValue) {
+
+    bool exceptionOccurred = false;
+    Datum datum;
+
+    // Float8GetDatum() might palloc (if float8 is not pass-by-value)
+    PG_TRY(); {
+        datum = Float8GetDatum(inValue);
+    } PG_CATCH(); {
+        exceptionOccurred = true;
+    } PG_END_TRY();
+
+    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
+        "converting a DBAL object to a PostgreSQL datum.");
+    return datum;
+}
+
+/**
+ * @brief Convert a DOUBLE PRECISION array or vector into a Datum
+ *
+ * If the memory is a PostgreSQL array already (e.g., the transition state
+ * that was modified in-place, or memory from AbstractDBInterface::allocator),
+ * we return it by reference. Otherwise, we need to construct a new array.
+ */
+inline Datum doubleArrayToDatum(const MemHandleSPtr &inHandle,
+    const double *inData, uint32_t inNumElements) {
+
+    shared_ptr<PGArrayHandle> arrayHandle
+        = dynamic_pointer_cast<PGArrayHandle>(inHandle);
+
+    if (arrayHandle && ARR_DATA_PTR(arrayHandle->array())
+            == reinterpret_cast<const char*>(inData))
+        return PointerGetDatum(arrayHandle->array());
+
+    bool exceptionOccurred = false;
+    Datum datum;
+
+    PG_TRY(); {
+        datum = PointerGetDatum(
+            construct_array(
+                reinterpret_cast<Datum*>(const_cast<double*>(inData)),
+                inNumElements,
+                FLOAT8OID, sizeof(double), true, 'd'
+            )
+        );
+    } PG_CATCH(); {
+        exceptionOccurred = true;
+    } PG_END_TRY();
+
+    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
+        "converting a DBAL object to a PostgreSQL datum.");
+    return datum;
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const Array<double> &inValue) {
+
+    return doubleArrayToDatum(inValue.memoryHandle(), inValue.data(),
+        inValue.num_elements());
+}
+
+inline Datum returnValueToDatum(const FunctionCallInfo /* fcinfo */,
+    const DoubleCol &inValue) {
+
+    return doubleArrayToDatum(inValue.memoryHandle(), inValue.memptr(),
+        inValue.n_elem);
+}
+
+/**
+ * @brief Call a module function with a native C++ signature
+ *
+ * \c Signature is a function type of form <tt>R(A1, ..., An)</tt>, where
+ * \c A1, ..., \c An are the types of the SQL arguments (see PGArguments::get()
+ * for the supported types) and \c R is the return type. The module function
+ * itself has signature <tt>R(AbstractDBInterface&, A1, ..., An)</tt>.
+ *
+ * All marshalling code is generated at compile time. There is no virtual
+ * dispatch through AbstractValue, and no boxing of values in ConcreteValue
+ * objects.
+ *
+ * SQL NULL arguments cause an exception. Typed UDFs should therefore be
+ * declared \c STRICT in SQL.
+ */
+template <typename Signature>
+class TypedUDF;
+
+#define MADLIB_TYPED_UDF_ARG(z, n, unused) \
+    args.get<A ## n>(n)
+
+#define MADLIB_TYPED_UDF(z, n, unused) \
+    template <typename R BOOST_PP_ENUM_TRAILING_PARAMS(n, typename A)> \
+    class TypedUDF<R(BOOST_PP_ENUM_PARAMS(n, A))> { \
+    public: \
+        typedef R (Function)(AbstractDBInterface & \
+            BOOST_PP_ENUM_TRAILING_PARAMS(n, A)); \
+        \
+        TypedUDF(Function &inFunction) : mFunction(inFunction) { } \
+        \
+        Datum operator()(PGInterface &db, PG_FUNCTION_ARGS) const { \
+            PGArguments args(fcinfo); \
+            \
+            if (args.size() != n) \
+                throw std::invalid_argument("Number of SQL arguments does " \
+                    "not match internal function signature"); \
+            \
+            return returnValueToDatum(fcinfo, \
+                mFunction(db BOOST_PP_ENUM_TRAILING(n, MADLIB_TYPED_UDF_ARG, ~))); \
+        } \
+    \
+    private: \
+        Function &mFunction; \
+    };
+
+BOOST_PP_REPEAT(BOOST_PP_INC(MADLIB_TYPED_UDF_MAX_ARGS), MADLIB_TYPED_UDF, ~)
+
+#undef MADLIB_TYPED_UDF
+#undef MADLIB_TYPED_UDF_ARG
+
+} // namespace dbconnector
+
+} // namespace madlib
+
+#endif
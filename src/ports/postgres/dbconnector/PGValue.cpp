@@ -12,8 +12,7 @@
 #include <stdexcept>
 
 extern "C" {
-    #include <utils/typcache.h>
-    #include <executor/executor.h>
+    #include <access/heapam.h>
 }
 
 
@@ -25,51 +24,73 @@ using namespace dbal;
 
 /**
  * @brief Convert the <tt>inID</tt>-th function argument to a DBAL object
+ *
+ * The argument type and whether the argument is writable are cached in
+ * <tt>fcinfo->flinfo->fn_extra</tt> (see PGArguments), so we only call into
+ * the backend once per call site and not once per row.
  */
 AbstractValueSPtr PGValue<FunctionCallInfo>::getValueByID(unsigned int inID) const {
-    if (fcinfo == NULL)
-        throw std::invalid_argument("fcinfo is NULL");
+    PGArguments args(fcinfo);
 
-    if (inID >= size_t(PG_NARGS()))
+    if (inID >= args.size())
         throw std::out_of_range("Access behind end of argument list");
 
-    if (PG_ARGISNULL(inID))
+    if (args.isNull(inID))
         return AbstractValueSPtr(new AnyValue(Null()));
     
-    bool exceptionOccurred = false;
-    Oid typeID;
-    bool writable;
+    const PGArgumentInfo &arg = args.info(inID);
+    AbstractValueSPtr value = DatumToValue(arg.isWritable, arg.typeID,
+        arg.isTuple, arg.isArray, args.datum(inID));
+    if (!value)
+        throw std::invalid_argument(
+            "Internal argument type does not match SQL argument type");
     
+    return value;
+}
+
+/**
+ * @brief Deform the tuple into arrays of datums and null flags
+ *
+ * The arrays are allocated in the current (per-call) memory context. Unlike
+ * GetAttributeByNum(), which looks up the row type and walks the tuple for
+ * every single attribute, this is done only once per tuple.
+ */
+void PGValue<HeapTupleHeader>::deform() const {
+    const PGRowTypeInfo &rowType = PGArguments(fcinfo).rowType(
+        HeapTupleHeaderGetTypeId(mTuple), HeapTupleHeaderGetTypMod(mTuple));
+    bool exceptionOccurred = false;
+    HeapTupleData tuple;
+    Datum *values;
+    bool *isNull;
+
     PG_TRY(); {
-        typeID = get_fn_expr_argtype(fcinfo->flinfo, inID);
-
-        // If we are called as an aggregate function, the first argument is the
-        // transition state. In that case, we are free to modify the data.
-        // In fact, for performance reasons, we *should* even do all modifications
-        // in-place. In all other cases, directly modifying memory is dangerous.
-        // See warning at:
-        // http://www.postgresql.org/docs/current/static/xfunc-c.html#XFUNC-C-BASETYPE
-        writable = (inID == 0 && AggCheckCallContext(fcinfo, NULL));
+        values = static_cast<Datum*>(
+            palloc(rowType.tupDesc->natts * sizeof(Datum)));
+        isNull = static_cast<bool*>(
+            palloc(rowType.tupDesc->natts * sizeof(bool)));
+
+        tuple.t_len = HeapTupleHeaderGetDatumLength(mTuple);
+        ItemPointerSetInvalid(&(tuple.t_self));
+        tuple.t_tableOid = InvalidOid;
+        tuple.t_data = mTuple;
+        heap_deform_tuple(&tuple, rowType.tupDesc, values, isNull);
     } PG_CATCH(); {
         exceptionOccurred = true;
     } PG_END_TRY();
-    
+
     BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
-        "gathering inormation about PostgreSQL function arguments");
-    
-    if (typeID == InvalidOid)
-        throw std::invalid_argument("Cannot determine function argument type");
+        "gathering inormation about a PostgreSQL tuple value");
 
-    AbstractValueSPtr value = DatumToValue(writable, typeID, PG_GETARG_DATUM(inID));
-    if (!value)
-        throw std::invalid_argument(
-            "Internal argument type does not match SQL argument type");
-    
-    return value;
+    mRowType = &rowType;
+    mValues = values;
+    mIsNull = isNull;
 }
 
 /**
  * @brief Convert the <tt>inID</tt>-th tuple element to a DBAL object
+ *
+ * Note that \c inID is 0-based, whereas PostgreSQL attribute numbers are
+ * 1-based.
  */
 AbstractValueSPtr PGValue<HeapTupleHeader>::getValueByID(unsigned int inID) const {
     if (mTuple == NULL)
@@ -78,33 +99,18 @@ AbstractValueSPtr PGValue<HeapTupleHeader>::getValueByID(unsigned int inID) cons
     if (inID >= HeapTupleHeaderGetNatts(mTuple))
         throw std::out_of_range("Access behind end of tuple");
     
-    bool exceptionOccurred = false;
-    Oid tupType;
-	int32 tupTypmod;
-    TupleDesc tupDesc;
-    Oid typeID;
-    bool isNull = false;
-    Datum datum;
-    
-    PG_TRY(); {
-        tupType = HeapTupleHeaderGetTypeId(mTuple);
-        tupTypmod = HeapTupleHeaderGetTypMod(mTuple);
-        tupDesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
-        typeID = tupDesc->attrs[inID]->atttypid;
-        ReleaseTupleDesc(tupDesc);
-        datum = GetAttributeByNum(mTuple, inID, &isNull);
-    } PG_CATCH(); {
-        exceptionOccurred = true;
-    } PG_END_TRY();
-    
-    BOOST_ASSERT_MSG(exceptionOccurred == false, "An exception occurred while "
-        "gathering inormation about a PostgreSQL tuple value");
+    if (mValues == NULL)
+        deform();
+
+    if (inID >= static_cast<unsigned int>(mRowType->tupDesc->natts))
+        throw std::out_of_range("Access behind end of tuple");
 
-    if (isNull)
+    if (mIsNull[inID])
         throw std::invalid_argument("Tuple item is NULL");
     
+    const PGArgumentInfo &attr = mRowType->attributes[inID];
     AbstractValueSPtr value = DatumToValue(false /* memory is not writable */,
-        typeID, datum);
+        attr.typeID, attr.isTuple, attr.isArray, mValues[inID]);
     if (!value)
         throw std::invalid_argument(
             "Internal argument type does not match SQL argument type");
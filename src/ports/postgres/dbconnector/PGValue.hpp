@@ -11,6 +11,7 @@
 
 #include <dbconnector/PGCommon.hpp>
 #include <dbconnector/PGAbstractValue.hpp>
+#include <dbconnector/PGArguments.hpp>
 
 extern "C" {
     #include <fmgr.h>           // for FunctionCallInfo
@@ -38,7 +39,7 @@ template <>
 class PGValue<FunctionCallInfo> : public PGAbstractValue {
 public:
     PGValue<FunctionCallInfo>(const FunctionCallInfo inFCinfo)
-        : fcinfo(inFCinfo) { }
+        : PGAbstractValue(inFCinfo) { }
     
 protected:
     AbstractValueSPtr getValueByID(unsigned int inID) const;
@@ -46,13 +47,6 @@ protected:
     AbstractValueSPtr clone() const {
         return AbstractValueSPtr( new PGValue<FunctionCallInfo>(*this) );
     }
-    
-private:
-    /**
-     * The name is chosen so that PostgreSQL macros like PG_NARGS can be
-     * used.
-     */
-    const FunctionCallInfo fcinfo;
 };
 
 /**
@@ -60,12 +54,18 @@ private:
  *
  * Implements PGAbstractValue for "normal" composite values (as opposed to the
  * "virtual" composite value consisting of all function arguments).
+ *
+ * The tuple descriptor is looked up only once per row type and call site (it
+ * is cached together with the argument meta data, see PGArguments::rowType()).
+ * The tuple is deformed only once, on first access to any of its elements.
  */
 template <>
 class PGValue<HeapTupleHeader> : public PGAbstractValue {
 public:    
-    PGValue<HeapTupleHeader>(HeapTupleHeader inTuple)
-        : mTuple(inTuple) { }
+    PGValue<HeapTupleHeader>(const FunctionCallInfo inFCinfo,
+        HeapTupleHeader inTuple)
+        : PGAbstractValue(inFCinfo), mTuple(inTuple), mRowType(NULL),
+          mValues(NULL), mIsNull(NULL) { }
 
 protected:
     AbstractValueSPtr getValueByID(unsigned int inID) const;
@@ -75,7 +75,13 @@ protected:
     }
 
 private:    
+    void deform() const;
+
     const HeapTupleHeader mTuple;
+
+    mutable const PGRowTypeInfo *mRowType;
+    mutable Datum *mValues;
+    mutable bool *mIsNull;
 };
 
 } // namespace dbconnector